@@ -38,13 +38,127 @@ THE SOFTWARE.
 */
 
 static AtomPtr *atomHashTable;
+static int log2AtomHashTableSize;
 int used_atoms;
 
+/* Small atoms are carved out of slabs and recycled through per-size
+   free lists rather than going through malloc.  Slabs are never given
+   back, which is fine since the number of live atoms tends to remain
+   roughly constant over the life of the proxy. */
+
+#define ATOM_SLAB_SIZE 4096
+#define ATOM_SIZE_QUANTUM 16
+#define ATOM_SIZE_CLASSES 8
+
+static AtomPtr atomFreeList[ATOM_SIZE_CLASSES];
+static char *atomSlab = NULL;
+static int atomSlabUsed = ATOM_SLAB_SIZE;
+
+#define ATOM_ALLOC_SIZE(n) (sizeof(AtomRec) - 1 + (n) + 1)
+#define ATOM_SIZE_CLASS(n) \
+    ((ATOM_ALLOC_SIZE(n) + ATOM_SIZE_QUANTUM - 1) / ATOM_SIZE_QUANTUM - 1)
+
+static AtomPtr
+allocAtom(int n)
+{
+    int c = ATOM_SIZE_CLASS(n);
+    int size;
+    AtomPtr atom;
+
+    if(c >= ATOM_SIZE_CLASSES)
+        return malloc(ATOM_ALLOC_SIZE(n));
+
+    if(atomFreeList[c]) {
+        atom = atomFreeList[c];
+        atomFreeList[c] = atom->next;
+        return atom;
+    }
+
+    size = (c + 1) * ATOM_SIZE_QUANTUM;
+    if(atomSlabUsed + size > ATOM_SLAB_SIZE) {
+        char *slab = malloc(ATOM_SLAB_SIZE);
+        if(slab == NULL)
+            return malloc(ATOM_ALLOC_SIZE(n));
+        /* Put the leftovers of the current slab to good use. */
+        while(atomSlab && ATOM_SLAB_SIZE - atomSlabUsed >= ATOM_SIZE_QUANTUM) {
+            int d = (ATOM_SLAB_SIZE - atomSlabUsed) / ATOM_SIZE_QUANTUM - 1;
+            if(d >= ATOM_SIZE_CLASSES)
+                d = ATOM_SIZE_CLASSES - 1;
+            atom = (AtomPtr)(atomSlab + atomSlabUsed);
+            atom->next = atomFreeList[d];
+            atomFreeList[d] = atom;
+            atomSlabUsed += (d + 1) * ATOM_SIZE_QUANTUM;
+        }
+        atomSlab = slab;
+        atomSlabUsed = 0;
+    }
+    atom = (AtomPtr)(atomSlab + atomSlabUsed);
+    atomSlabUsed += size;
+    return atom;
+}
+
+static void
+freeAtom(AtomPtr atom)
+{
+    int c = ATOM_SIZE_CLASS(atom->length);
+    if(c >= ATOM_SIZE_CLASSES) {
+        free(atom);
+        return;
+    }
+    atom->next = atomFreeList[c];
+    atomFreeList[c] = atom;
+}
+
+/* FNV-1a.  The full value is kept in the atom, so that resizing the
+   hash table doesn't require rehashing the strings. */
+static unsigned int
+atomHash(const char *string, int n)
+{
+    unsigned int h = 2166136261U;
+    int i;
+    for(i = 0; i < n; i++) {
+        h ^= (unsigned char)string[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+#define ATOM_BUCKET(h) ((h) & ((1U << log2AtomHashTableSize) - 1))
+
+static void
+resizeAtomHashTable(int log2size)
+{
+    AtomPtr *table;
+    AtomPtr atom, next;
+    int i;
+
+    table = calloc(1 << log2size, sizeof(AtomPtr));
+    if(table == NULL) {
+        /* Not fatal -- we'll just have longer chains. */
+        do_log(L_WARN, "Couldn't resize atom hash table.\n");
+        return;
+    }
+
+    for(i = 0; i < (1 << log2AtomHashTableSize); i++) {
+        atom = atomHashTable[i];
+        while(atom) {
+            int h = atom->hash & ((1U << log2size) - 1);
+            next = atom->next;
+            atom->next = table[h];
+            table[h] = atom;
+            atom = next;
+        }
+    }
+    free(atomHashTable);
+    atomHashTable = table;
+    log2AtomHashTableSize = log2size;
+}
+
 void
 initAtoms()
 {
-    atomHashTable = calloc((1 << LOG2_ATOM_HASH_TABLE_SIZE),
-                           sizeof(AtomPtr));
+    log2AtomHashTableSize = LOG2_ATOM_HASH_TABLE_SIZE;
+    atomHashTable = calloc((1 << log2AtomHashTableSize), sizeof(AtomPtr));
 
     if(atomHashTable == NULL) {
         do_log(L_ERROR, "Couldn't allocate atom hash table.\n");
@@ -57,35 +171,39 @@ AtomPtr
 internAtomN(const char *string, int n)
 {
     AtomPtr atom;
-    int h;
+    unsigned int h;
 
     if(n < 0 || n >= (1 << (8 * sizeof(unsigned short))))
         return NULL;
 
-    h = hash(0, string, n, LOG2_ATOM_HASH_TABLE_SIZE);
-    atom = atomHashTable[h];
+    h = atomHash(string, n);
+    atom = atomHashTable[ATOM_BUCKET(h)];
     while(atom) {
-        if(atom->length == n &&
+        if(atom->hash == h && atom->length == n &&
            (n == 0 || memcmp(atom->string, string, n) == 0))
             break;
         atom = atom->next;
     }
 
     if(!atom) {
-        atom = malloc(sizeof(AtomRec) - 1 + n + 1);
+        atom = allocAtom(n);
         if(atom == NULL) {
             return NULL;
         }
         atom->refcount = 0;
+        atom->hash = h;
         atom->length = n;
         /* Atoms are used both for binary data and strings.  To make
            their use as strings more convenient, atoms are always
            NUL-terminated. */
         memcpy(atom->string, string, n);
         atom->string[n] = '\0';
-        atom->next = atomHashTable[h];
-        atomHashTable[h] = atom;
+        atom->next = atomHashTable[ATOM_BUCKET(h)];
+        atomHashTable[ATOM_BUCKET(h)] = atom;
         used_atoms++;
+        if(used_atoms > (1 << log2AtomHashTableSize) &&
+           log2AtomHashTableSize < MAX_LOG2_ATOM_HASH_TABLE_SIZE)
+            resizeAtomHashTable(log2AtomHashTableSize + 1);
     }
     do_log(D_ATOM_REFCOUNT, "A 0x%lx %d++\n",
            (unsigned long)atom, atom->refcount);
@@ -189,12 +307,11 @@ releaseAtom(AtomPtr atom)
     atom->refcount--;
 
     if(atom->refcount == 0) {
-        int h = hash(0, atom->string, atom->length, LOG2_ATOM_HASH_TABLE_SIZE);
+        int h = ATOM_BUCKET(atom->hash);
         assert(atomHashTable[h] != NULL);
 
         if(atom == atomHashTable[h]) {
             atomHashTable[h] = atom->next;
-            free(atom);
         } else {
             AtomPtr previous = atomHashTable[h];
             while(previous->next) {
@@ -204,9 +321,13 @@ releaseAtom(AtomPtr atom)
             }
             assert(previous->next != NULL);
             previous->next = atom->next;
-            free(atom);
         }
+        freeAtom(atom);
         used_atoms--;
+        /* Shrink lazily, so that we don't thrash around the threshold. */
+        if(used_atoms < (1 << log2AtomHashTableSize) / 8 &&
+           log2AtomHashTableSize > LOG2_ATOM_HASH_TABLE_SIZE)
+            resizeAtomHashTable(log2AtomHashTableSize - 1);
     }
 }
 
@@ -22,6 +22,7 @@ THE SOFTWARE.
 
 typedef struct _Atom {
     unsigned int refcount;
+    unsigned int hash;
     struct _Atom *next;
     unsigned short length;
     char string[1];
@@ -33,7 +34,10 @@ typedef struct _AtomList {
     AtomPtr *list;
 } AtomListRec, *AtomListPtr;
 
+/* Initial (and minimum) size of the atom hash table, which grows and
+   shrinks with the number of atoms. */
 #define LOG2_ATOM_HASH_TABLE_SIZE 10
+#define MAX_LOG2_ATOM_HASH_TABLE_SIZE 22
 #define LARGE_ATOM_REFCOUNT 0xFFFFFF00U
 
 extern int used_atoms;
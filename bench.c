@@ -0,0 +1,988 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* A load generator for Polipo.  This runs a synthetic origin server
+   and a number of client processes over the loopback interface, and
+   reports throughput, hit ratio, latency and Polipo's memory usage.
+   It is deliberately independent of the rest of Polipo; the only
+   communication is through the proxy port. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define MAX_WORKERS 256
+#define MAX_SAMPLES (1024 * 1024)
+#define BUF_SIZE 16384
+
+/* Parameters of the synthetic workload. */
+static int concurrency = 10;
+static double rate = 0.0;
+static int duration = 10;
+static int numObjects = 1000;
+static double zipfExponent = 1.0;
+static int minSize = 1024;
+static int maxSize = 1024 * 1024;
+static int originLatency = 20;
+static int freshPercent = 70;
+static int revalidatePercent = 20;
+static int chunkedPercent = 50;
+static int proxyPort = 28123;
+static char *polipoPath = "./polipo";
+static int startPolipo = 1;
+static int fillScenario = 0;
+
+/* Counters shared between the origin and client processes. */
+typedef struct _Shared {
+    long originReplies;
+    long originNotModified;
+    long long originBytes;
+    long requests[MAX_WORKERS];
+    long errors[MAX_WORKERS];
+    long long bytes[MAX_WORKERS];
+    int nsamples[MAX_WORKERS];
+    int samples[1];
+} SharedRec, *SharedPtr;
+
+static SharedPtr shared;
+
+typedef struct _Reader {
+    int fd;
+    int start, end;
+    char buf[BUF_SIZE + 1];
+} ReaderRec, *ReaderPtr;
+
+static char body[BUF_SIZE];
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr,
+            "%s [-c concurrency] [-r rate] [-d duration] [-n objects]\n"
+            "    [-z exponent] [-s min_size] [-S max_size] [-l latency]\n"
+            "    [-m fresh,revalidate] [-C chunked] [-p port] [-P polipo]\n"
+            "    [-x] [-F] [-- var=val...]\n", argv0);
+    fprintf(stderr,
+            "  -c: number of client connections (default 10).\n"
+            "  -r: requests per second, open loop (default closed loop).\n"
+            "  -d: duration of the run in seconds (default 10).\n"
+            "  -n: number of distinct objects (default 1000).\n"
+            "  -z: exponent of the Zipf popularity distribution "
+            "(default 1.0).\n"
+            "  -s, -S: object sizes are log-uniform between these "
+            "(default 1024, 1048576).\n"
+            "  -l: origin latency in ms (default 20).\n"
+            "  -m: percentages of fresh and must-revalidate objects; "
+            "the rest\n"
+            "      are no-store (default 70,20).\n"
+            "  -C: percentage of chunked replies (default 50).\n"
+            "  -p: proxy port (default 28123).\n"
+            "  -P: polipo binary (default ./polipo).\n"
+            "  -x: don't start polipo, use the one at the proxy port.\n"
+            "  -F: instead of the load test, check that a background range\n"
+            "      fill to an origin that went away fails cleanly.\n"
+            "Remaining arguments are passed to polipo.\n");
+}
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1.0E6;
+}
+
+static unsigned int
+hashObject(int id, int salt)
+{
+    unsigned int h = (unsigned int)id * 2654435761U + salt * 40503U;
+    h ^= h >> 15;
+    h *= 2246822519U;
+    h ^= h >> 13;
+    return h;
+}
+
+static int
+objectSize(int id)
+{
+    double u = (hashObject(id, 1) % 10000) / 10000.0;
+    if(maxSize <= minSize)
+        return minSize;
+    return (int)(minSize * exp(u * log((double)maxSize / minSize)));
+}
+
+static int
+randomNumber(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x & 0x7FFFFFFF;
+}
+
+static double *zipf;
+
+static int
+makeZipf()
+{
+    int i;
+    double sum = 0.0;
+
+    zipf = malloc(numObjects * sizeof(double));
+    if(zipf == NULL)
+        return -1;
+    for(i = 0; i < numObjects; i++) {
+        sum += 1.0 / pow(i + 1, zipfExponent);
+        zipf[i] = sum;
+    }
+    for(i = 0; i < numObjects; i++)
+        zipf[i] /= sum;
+    return 1;
+}
+
+static int
+randomObject(unsigned int *state)
+{
+    double u = randomNumber(state) / (double)0x7FFFFFFF;
+    int lo = 0, hi = numObjects - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(zipf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int
+writeAll(int fd, const char *buf, int len)
+{
+    int rc, n = 0;
+    while(n < len) {
+        rc = write(fd, buf + n, len - n);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        n += rc;
+    }
+    return n;
+}
+
+static int
+fillReader(ReaderPtr reader)
+{
+    int rc;
+    if(reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if(reader->end >= BUF_SIZE)
+        return -1;
+    do {
+        rc = read(reader->fd, reader->buf + reader->end,
+                  BUF_SIZE - reader->end);
+    } while(rc < 0 && errno == EINTR);
+    if(rc <= 0)
+        return -1;
+    reader->end += rc;
+    return rc;
+}
+
+/* Returns the length of a header block terminated by an empty line,
+   reading more data as needed. */
+static int
+readHeaders(ReaderPtr reader)
+{
+    char *p;
+    while(1) {
+        reader->buf[reader->end] = '\0';
+        p = strstr(reader->buf + reader->start, "\r\n\r\n");
+        if(p)
+            return p + 4 - (reader->buf + reader->start);
+        if(reader->end >= BUF_SIZE - 1)
+            return -1;
+        if(fillReader(reader) < 0)
+            return -1;
+    }
+}
+
+static int
+skipBytes(ReaderPtr reader, long long n)
+{
+    while(n > 0) {
+        int len = reader->end - reader->start;
+        if(len == 0) {
+            reader->start = reader->end = 0;
+            if(fillReader(reader) < 0)
+                return -1;
+            continue;
+        }
+        if(len > n)
+            len = n;
+        reader->start += len;
+        n -= len;
+    }
+    return 1;
+}
+
+static int
+readLine(ReaderPtr reader, char *line, int size)
+{
+    char *p;
+    int len;
+    while(1) {
+        p = memchr(reader->buf + reader->start, '\n',
+                   reader->end - reader->start);
+        if(p)
+            break;
+        if(fillReader(reader) < 0)
+            return -1;
+    }
+    len = p - (reader->buf + reader->start) + 1;
+    if(len >= size)
+        return -1;
+    memcpy(line, reader->buf + reader->start, len);
+    line[len] = '\0';
+    reader->start += len;
+    return len;
+}
+
+/* Case-insensitive lookup of a header within a header block. */
+static char *
+findHeader(char *headers, const char *name)
+{
+    int n = strlen(name);
+    char *p = headers;
+    while((p = strstr(p, "\r\n")) != NULL) {
+        p += 2;
+        if(strncasecmp(p, name, n) == 0 && p[n] == ':') {
+            p += n + 1;
+            while(*p == ' ')
+                p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void
+originReply(int fd, int id, int inm)
+{
+    char buf[512];
+    int size = objectSize(id);
+    int class = hashObject(id, 2) % 100;
+    int chunked = (int)(hashObject(id, 3) % 100) < chunkedPercent;
+    const char *cc;
+    int n, len;
+
+    if(class < freshPercent)
+        cc = "max-age=3600";
+    else if(class < freshPercent + revalidatePercent)
+        cc = "max-age=0, must-revalidate";
+    else
+        cc = "no-store";
+
+    if(originLatency > 0)
+        usleep(originLatency * 1000);
+
+    if(inm == id) {
+        n = snprintf(buf, 512,
+                     "HTTP/1.1 304 Not Modified\r\n"
+                     "ETag: \"%d\"\r\nCache-Control: %s\r\n\r\n", id, cc);
+        __sync_fetch_and_add(&shared->originNotModified, 1);
+        writeAll(fd, buf, n);
+        return;
+    }
+
+    n = snprintf(buf, 512,
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: application/octet-stream\r\n"
+                 "ETag: \"%d\"\r\nCache-Control: %s\r\n", id, cc);
+    if(chunked)
+        n += snprintf(buf + n, 512 - n,
+                      "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        n += snprintf(buf + n, 512 - n, "Content-Length: %d\r\n\r\n", size);
+    if(writeAll(fd, buf, n) < 0)
+        return;
+
+    len = size;
+    while(len > 0) {
+        int m = len < BUF_SIZE ? len : BUF_SIZE;
+        if(chunked) {
+            n = snprintf(buf, 512, "%x\r\n", m);
+            if(writeAll(fd, buf, n) < 0)
+                return;
+        }
+        if(writeAll(fd, body, m) < 0)
+            return;
+        if(chunked && writeAll(fd, "\r\n", 2) < 0)
+            return;
+        len -= m;
+    }
+    if(chunked)
+        writeAll(fd, "0\r\n\r\n", 5);
+    __sync_fetch_and_add(&shared->originReplies, 1);
+    __sync_fetch_and_add(&shared->originBytes, size);
+}
+
+static void
+originConnection(int fd)
+{
+    ReaderRec reader;
+    int n, id, inm;
+    char *p;
+
+    reader.fd = fd;
+    reader.start = reader.end = 0;
+    while(1) {
+        n = readHeaders(&reader);
+        if(n < 0)
+            break;
+        reader.buf[reader.start + n - 2] = '\0';
+        id = -1;
+        p = strstr(reader.buf + reader.start, " /obj/");
+        if(p)
+            id = atoi(p + 6);
+        inm = -1;
+        p = findHeader(reader.buf + reader.start, "If-None-Match");
+        if(p && *p == '"')
+            inm = atoi(p + 1);
+        reader.start += n;
+        if(id < 0) {
+            static const char notFound[] =
+                "HTTP/1.1 404 Not found\r\nContent-Length: 0\r\n\r\n";
+            writeAll(fd, notFound, sizeof(notFound) - 1);
+            continue;
+        }
+        originReply(fd, id, inm);
+    }
+    close(fd);
+}
+
+static int
+listenLoopback(int *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int fd, one = 1;
+
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(*port);
+    if(bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0 ||
+       listen(fd, 128) < 0 ||
+       getsockname(fd, (struct sockaddr*)&sin, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* Polipo must not inherit the origin's listening socket. */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    *port = ntohs(sin.sin_port);
+    return fd;
+}
+
+static void
+runOrigin(int fd)
+{
+    int s;
+    pid_t pid;
+
+    signal(SIGCHLD, SIG_IGN);
+    while(1) {
+        s = accept(fd, NULL, NULL);
+        if(s < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            exit(1);
+        }
+        pid = fork();
+        if(pid == 0) {
+            close(fd);
+            originConnection(s);
+            exit(0);
+        }
+        close(s);
+    }
+}
+
+static int
+connectLoopback(int port)
+{
+    struct sockaddr_in sin;
+    struct timeval tv;
+    int fd, one = 1;
+
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    if(connect(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one));
+    tv.tv_sec = 30;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    return fd;
+}
+
+/* Performs a single request through the proxy.  Returns the number
+   of body bytes, or -1 on failure, in which case the connection must
+   be dropped; *keep is set to 0 if the server closed it. */
+static long long
+clientRequest(ReaderPtr reader, int originPort, int id, int *keep)
+{
+    char buf[512], line[128];
+    int n, code, chunked = 0;
+    long long length = -1, total = 0;
+    char *p;
+
+    n = snprintf(buf, 512,
+                 "GET http://127.0.0.1:%d/obj/%d HTTP/1.1\r\n"
+                 "Host: 127.0.0.1:%d\r\n\r\n", originPort, id, originPort);
+    if(writeAll(reader->fd, buf, n) < 0)
+        return -1;
+
+    n = readHeaders(reader);
+    if(n < 0)
+        return -1;
+    reader->buf[reader->start + n - 2] = '\0';
+    p = reader->buf + reader->start;
+    if(strncmp(p, "HTTP/1.", 7) != 0)
+        return -1;
+    code = atoi(p + 9);
+    *keep = strncmp(p, "HTTP/1.1", 8) == 0;
+    if((p = findHeader(reader->buf + reader->start, "Connection")) &&
+       strncasecmp(p, "close", 5) == 0)
+        *keep = 0;
+    if((p = findHeader(reader->buf + reader->start, "Content-Length")))
+        length = atoll(p);
+    if((p = findHeader(reader->buf + reader->start, "Transfer-Encoding")) &&
+       strncasecmp(p, "chunked", 7) == 0)
+        chunked = 1;
+    reader->start += n;
+
+    if(code != 200)
+        return -1;
+
+    if(chunked) {
+        while(1) {
+            long long len;
+            if(readLine(reader, line, 128) < 0)
+                return -1;
+            len = strtoll(line, NULL, 16);
+            if(len == 0)
+                break;
+            if(skipBytes(reader, len + 2) < 0)
+                return -1;
+            total += len;
+        }
+        /* Trailers */
+        do {
+            if(readLine(reader, line, 128) < 0)
+                return -1;
+        } while(line[0] != '\r' && line[0] != '\n');
+    } else if(length >= 0) {
+        if(skipBytes(reader, length) < 0)
+            return -1;
+        total = length;
+    } else {
+        while(1) {
+            total += reader->end - reader->start;
+            reader->start = reader->end = 0;
+            if(fillReader(reader) < 0)
+                break;
+        }
+        *keep = 0;
+    }
+    return total;
+}
+
+/* Performs a request through the proxy on a fresh connection and
+   returns the status code, or -1 if no complete reply arrived. */
+static int
+simpleRequest(int originPort, const char *path, const char *headers)
+{
+    ReaderRec *reader;
+    char buf[512];
+    char *p;
+    int n, status, code = -1;
+    long long length = 0;
+
+    reader = malloc(sizeof(ReaderRec));
+    if(reader == NULL)
+        return -1;
+    reader->start = reader->end = 0;
+    reader->fd = connectLoopback(proxyPort);
+    if(reader->fd < 0)
+        goto done;
+    n = snprintf(buf, 512,
+                 "GET http://127.0.0.1:%d%s HTTP/1.1\r\n"
+                 "Host: 127.0.0.1:%d\r\n%sConnection: close\r\n\r\n",
+                 originPort, path, originPort, headers);
+    if(writeAll(reader->fd, buf, n) < 0)
+        goto done;
+    n = readHeaders(reader);
+    if(n < 0)
+        goto done;
+    reader->buf[reader->start + n - 2] = '\0';
+    p = reader->buf + reader->start;
+    if(strncmp(p, "HTTP/1.", 7) != 0)
+        goto done;
+    status = atoi(p + 9);
+    if((p = findHeader(reader->buf + reader->start, "Content-Length")))
+        length = atoll(p);
+    reader->start += n;
+    if(skipBytes(reader, length) < 0)
+        goto done;
+    code = status;
+
+ done:
+    if(reader->fd >= 0)
+        close(reader->fd);
+    free(reader);
+    return code;
+}
+
+/* Regression scenario for background range fills: the origin serves a
+   single 206 reply and goes away, so that the fill scheduled by Polipo
+   is refused.  Polipo must then drop the fill and keep serving. */
+static int
+runFillFailure(int fd, int originPort, pid_t polipo)
+{
+    ReaderRec *reader;
+    pid_t pid;
+    int s, code, rc = 1;
+    char reply[512];
+
+    pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0) {
+        s = accept(fd, NULL, NULL);
+        close(fd);
+        if(s < 0)
+            _exit(1);
+        reader = malloc(sizeof(ReaderRec));
+        if(reader == NULL)
+            _exit(1);
+        reader->fd = s;
+        reader->start = reader->end = 0;
+        readHeaders(reader);
+        snprintf(reply, 512,
+                 "HTTP/1.1 206 Partial content\r\n"
+                 "Content-Range: bytes 0-1023/%d\r\n"
+                 "Content-Length: 1024\r\nETag: \"fill\"\r\n"
+                 "Cache-Control: max-age=3600\r\n"
+                 "Connection: close\r\n\r\n", 1024 * 1024);
+        writeAll(s, reply, strlen(reply));
+        writeAll(s, body, 1024);
+        close(s);
+        _exit(0);
+    }
+    /* Once the origin has accepted, nobody is listening any more. */
+    close(fd);
+
+    code = simpleRequest(originPort, "/fill", "Range: bytes=0-1023\r\n");
+    waitpid(pid, NULL, 0);
+    printf("range request          %d\n", code);
+    if(code != 206)
+        rc = 0;
+
+    sleep(2);
+    if(polipo > 0 && waitpid(polipo, NULL, WNOHANG) == polipo) {
+        printf("polipo                 died\n");
+        return 0;
+    }
+    code = simpleRequest(originPort, "/fill", "Range: bytes=0-1023\r\n");
+    printf("cached range request   %d\n", code);
+    if(code != 206)
+        rc = 0;
+    code = simpleRequest(originPort, "/other", "");
+    printf("request to dead origin %d\n", code);
+    if(code < 500)
+        rc = 0;
+    printf("fill failure           %s\n", rc ? "ok" : "FAILED");
+    return rc;
+}
+
+static void
+runClient(int worker, int originPort, double start, double end)
+{
+    ReaderPtr reader;
+    unsigned int state = worker * 7919 + 1;
+    int *samples = shared->samples + worker * (MAX_SAMPLES / concurrency);
+    int maxSamples = MAX_SAMPLES / concurrency;
+    int keep = 0, k = 0;
+    long long bytes;
+    double t0, t1;
+
+    reader = malloc(sizeof(ReaderRec));
+    if(reader == NULL)
+        exit(1);
+    reader->fd = -1;
+
+    while(1) {
+        if(rate > 0) {
+            /* Open loop: requests are due at fixed times whether or not
+               the previous one completed, and latency is measured from
+               the time a request was due. */
+            t0 = start + (worker + (double)k * concurrency) / rate;
+            k++;
+            if(t0 >= end)
+                break;
+            t1 = now();
+            if(t1 < t0)
+                usleep((t0 - t1) * 1.0E6);
+        } else {
+            t0 = now();
+            if(t0 >= end)
+                break;
+        }
+
+        if(reader->fd < 0) {
+            reader->fd = connectLoopback(proxyPort);
+            reader->start = reader->end = 0;
+            if(reader->fd < 0) {
+                shared->errors[worker]++;
+                usleep(100000);
+                continue;
+            }
+        }
+
+        keep = 1;
+        bytes = clientRequest(reader, originPort,
+                              randomObject(&state), &keep);
+        t1 = now();
+        if(bytes < 0) {
+            shared->errors[worker]++;
+            keep = 0;
+        } else {
+            shared->requests[worker]++;
+            shared->bytes[worker] += bytes;
+            if(shared->nsamples[worker] < maxSamples)
+                samples[shared->nsamples[worker]++] = (t1 - t0) * 1.0E6;
+        }
+        if(!keep) {
+            close(reader->fd);
+            reader->fd = -1;
+        }
+    }
+    exit(0);
+}
+
+static int
+compareInts(const void *a, const void *b)
+{
+    int i = *(const int*)a, j = *(const int*)b;
+    return i < j ? -1 : i > j ? 1 : 0;
+}
+
+static long
+procStatus(pid_t pid, const char *field)
+{
+    char buf[256];
+    FILE *f;
+    long value = -1;
+    int n = strlen(field);
+
+    snprintf(buf, 256, "/proc/%d/status", (int)pid);
+    f = fopen(buf, "r");
+    if(f == NULL)
+        return -1;
+    while(fgets(buf, 256, f)) {
+        if(strncmp(buf, field, n) == 0 && buf[n] == ':') {
+            value = atol(buf + n + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static void
+report(double elapsed, pid_t polipo)
+{
+    long requests = 0, errors = 0, origin;
+    long long bytes = 0;
+    int *all;
+    int i, n = 0;
+    int perWorker = MAX_SAMPLES / concurrency;
+
+    for(i = 0; i < concurrency; i++) {
+        requests += shared->requests[i];
+        errors += shared->errors[i];
+        bytes += shared->bytes[i];
+        n += shared->nsamples[i];
+    }
+    origin = shared->originReplies + shared->originNotModified;
+
+    printf("requests     %ld in %.1f s (%.1f/s), %ld errors\n",
+           requests, elapsed, requests / elapsed, errors);
+    printf("throughput   %.2f MB/s\n", bytes / elapsed / 1.0E6);
+    if(requests > 0)
+        printf("hit ratio    %.1f%% of requests, %.1f%% of bytes "
+               "(%ld replies and %ld revalidations from the origin)\n",
+               100.0 * (1.0 - (double)origin / requests),
+               bytes > 0 ?
+               100.0 * (1.0 - (double)shared->originBytes / bytes) : 0.0,
+               shared->originReplies, shared->originNotModified);
+
+    all = malloc(n * sizeof(int));
+    if(all && n > 0) {
+        n = 0;
+        for(i = 0; i < concurrency; i++) {
+            memcpy(all + n, shared->samples + i * perWorker,
+                   shared->nsamples[i] * sizeof(int));
+            n += shared->nsamples[i];
+        }
+        qsort(all, n, sizeof(int), compareInts);
+        printf("latency      p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               all[n / 2] / 1000.0, all[(int)(n * 0.99)] / 1000.0,
+               all[n - 1] / 1000.0);
+    }
+    free(all);
+
+    if(polipo > 0) {
+        long rss = procStatus(polipo, "VmRSS");
+        long hwm = procStatus(polipo, "VmHWM");
+        if(rss >= 0)
+            printf("polipo RSS   %ld kB (peak %ld kB)\n", rss, hwm);
+        else
+            printf("polipo RSS   unknown\n");
+    }
+}
+
+static pid_t
+runPolipo(int argc, char **argv)
+{
+    char **args;
+    char port[40];
+    pid_t pid;
+    int i, fd;
+
+    args = malloc((argc + 8) * sizeof(char*));
+    if(args == NULL)
+        return -1;
+    snprintf(port, 40, "proxyPort=%d", proxyPort);
+    i = 0;
+    args[i++] = polipoPath;
+    args[i++] = "-c";
+    args[i++] = "/dev/null";
+    args[i++] = port;
+    args[i++] = "diskCacheRoot=";
+    args[i++] = "localDocumentRoot=";
+    memcpy(args + i, argv, argc * sizeof(char*));
+    args[i + argc] = NULL;
+
+    pid = fork();
+    if(pid < 0)
+        return -1;
+    if(pid == 0) {
+        execv(polipoPath, args);
+        perror("exec polipo");
+        _exit(1);
+    }
+    free(args);
+
+    for(i = 0; i < 50; i++) {
+        usleep(100000);
+        fd = connectLoopback(proxyPort);
+        if(fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    pid_t origin, polipo = -1, workers[MAX_WORKERS];
+    int opt, fd, originPort = 0, i;
+    double start, end;
+    char *p;
+
+    while((opt = getopt(argc, argv, "c:r:d:n:z:s:S:l:m:C:p:P:xFh")) != -1) {
+        switch(opt) {
+        case 'c': concurrency = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'n': numObjects = atoi(optarg); break;
+        case 'z': zipfExponent = atof(optarg); break;
+        case 's': minSize = atoi(optarg); break;
+        case 'S': maxSize = atoi(optarg); break;
+        case 'l': originLatency = atoi(optarg); break;
+        case 'm':
+            freshPercent = atoi(optarg);
+            p = strchr(optarg, ',');
+            revalidatePercent = p ? atoi(p + 1) : 0;
+            break;
+        case 'C': chunkedPercent = atoi(optarg); break;
+        case 'p': proxyPort = atoi(optarg); break;
+        case 'P': polipoPath = optarg; break;
+        case 'x': startPolipo = 0; break;
+        case 'F': fillScenario = 1; break;
+        default: usage(argv[0]); exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if(concurrency < 1 || concurrency > MAX_WORKERS || numObjects < 1 ||
+       duration < 1 || minSize < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    shared = mmap(NULL, sizeof(SharedRec) + MAX_SAMPLES * sizeof(int),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(body, 'x', BUF_SIZE);
+    if(makeZipf() < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = listenLoopback(&originPort);
+    if(fd < 0) {
+        perror("origin");
+        exit(1);
+    }
+    if(fillScenario) {
+        char **args = malloc((argc - optind + 1) * sizeof(char*));
+        if(args == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        args[0] = "rangeFillPercent=0";
+        memcpy(args + 1, argv + optind, (argc - optind) * sizeof(char*));
+        if(startPolipo) {
+            polipo = runPolipo(argc - optind + 1, args);
+            if(polipo < 0) {
+                fprintf(stderr, "Couldn't start %s.\n", polipoPath);
+                exit(1);
+            }
+        }
+        i = runFillFailure(fd, originPort, polipo);
+        if(polipo > 0) {
+            kill(polipo, SIGKILL);
+            waitpid(polipo, NULL, 0);
+        }
+        return i > 0 ? 0 : 1;
+    }
+
+    origin = fork();
+    if(origin < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if(origin == 0) {
+        setpgid(0, 0);
+        runOrigin(fd);
+    }
+    setpgid(origin, origin);
+    close(fd);
+
+    if(startPolipo) {
+        polipo = runPolipo(argc - optind, argv + optind);
+        if(polipo < 0) {
+            fprintf(stderr, "Couldn't start %s.\n", polipoPath);
+            kill(-origin, SIGTERM);
+            exit(1);
+        }
+    }
+
+    printf("%d %s clients, %d objects of %d to %d bytes, "
+           "origin latency %d ms.\n",
+           concurrency, rate > 0 ? "open-loop" : "closed-loop",
+           numObjects, minSize, maxSize, originLatency);
+    fflush(stdout);
+
+    start = now();
+    end = start + duration;
+    for(i = 0; i < concurrency; i++) {
+        workers[i] = fork();
+        if(workers[i] == 0)
+            runClient(i, originPort, start, end);
+    }
+    for(i = 0; i < concurrency; i++)
+        if(workers[i] > 0)
+            waitpid(workers[i], NULL, 0);
+
+    report(now() - start, polipo);
+
+    if(polipo > 0) {
+        kill(polipo, SIGTERM);
+        waitpid(polipo, NULL, 0);
+    }
+    kill(-origin, SIGTERM);
+    waitpid(origin, NULL, 0);
+    return 0;
+}
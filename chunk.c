@@ -26,6 +26,7 @@ THE SOFTWARE.
 int chunkLowMark = 0, 
     chunkCriticalMark = 0,
     chunkHighMark = 0;
+AtomPtr chunkArenaFile = NULL;
 
 void
 preinitChunks()
@@ -36,6 +37,8 @@ preinitChunks()
                     "Critical mark for chunk memory (0 = auto).");
     CONFIG_VARIABLE(chunkHighMark, CONFIG_INT,
                     "High mark for chunk memory.");
+    CONFIG_VARIABLE(chunkArenaFile, CONFIG_ATOM,
+                    "File backing chunk memory across restarts.");
 }
 
 static void
@@ -121,6 +124,8 @@ void
 initChunks(void)
 {
     do_log(L_WARN, "Warning: using malloc(3) for chunk allocation.\n");
+    if(chunkArenaFile && chunkArenaFile->length > 0)
+        do_log(L_WARN, "Ignoring chunkArenaFile with malloc(3) chunks.\n");
     used_chunks = 0;
     initChunksCommon();
 }
@@ -182,6 +187,24 @@ totalChunkArenaSize()
 {
     return used_chunks * CHUNK_SIZE;
 }
+
+int
+chunkArenaSlots()
+{
+    return 0;
+}
+
+int
+chunkNumber(void *chunk)
+{
+    return -1;
+}
+
+void *
+attachChunk(int n)
+{
+    return NULL;
+}
 #else
 
 #ifdef WIN32 /*MINGW*/
@@ -218,6 +241,24 @@ free_arena(void *addr, size_t size)
 }
 #endif
 
+/* If chunkArenaFile is set, arena i is mapped from the region of the
+   file starting at i * ARENA_CHUNKS * CHUNK_SIZE, so that chunk n
+   always lives at offset n * CHUNK_SIZE.  The kernel writes the data
+   back to the file, and the object table saved on exit (see object.c)
+   allows the chunks to be reattached on the next run. */
+static int chunkArenaFd = -1;
+
+static void *
+map_arena(int i, size_t size)
+{
+#ifndef WIN32
+    if(chunkArenaFd >= 0)
+        return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    chunkArenaFd, (off_t)i * size);
+#endif
+    return alloc_arena(size);
+}
+
 /* Memory is organised into a number of chunks of ARENA_CHUNKS chunks
    each.  Every arena is pointed at by a struct _ChunkArena. */
 /* If currentArena is not NULL, it points at the last arena used,
@@ -327,6 +368,34 @@ initChunks(void)
         chunkArenas[i].chunks = NULL;
     }
     currentArena = NULL;
+
+    if(chunkArenaFile && chunkArenaFile->length > 0) {
+#ifdef WIN32
+        do_log(L_WARN, "Ignoring chunkArenaFile on this platform.\n");
+#else
+        int rc;
+        chunkArenaFile = expandTilde(chunkArenaFile);
+        if(chunkArenaFile == NULL) {
+            do_log(L_ERROR, "Couldn't expand chunkArenaFile.\n");
+            return;
+        }
+        chunkArenaFd = open(chunkArenaFile->string,
+                            O_RDWR | O_CREAT | O_BINARY, 0600);
+        if(chunkArenaFd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't open chunk arena file %s",
+                         chunkArenaFile->string);
+            return;
+        }
+        rc = ftruncate(chunkArenaFd,
+                       (off_t)numArenas * ARENA_CHUNKS * CHUNK_SIZE);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't size chunk arena file %s",
+                         chunkArenaFile->string);
+            close(chunkArenaFd);
+            chunkArenaFd = -1;
+        }
+#endif
+    }
 }
 
 static ChunkArenaPtr
@@ -347,7 +416,7 @@ findArena()
 
     if(!arena->chunks) {
         void *p;
-        p = alloc_arena(CHUNK_SIZE * ARENA_CHUNKS);
+        p = map_arena(arena - chunkArenas, CHUNK_SIZE * ARENA_CHUNKS);
         if(p == MAP_FAILED) {
             do_log_error(L_ERROR, errno, "Couldn't allocate chunk");
             maybe_free_chunks(1, 1);
@@ -466,4 +535,63 @@ totalChunkArenaSize()
     }
     return size;
 }
+
+/* The number of chunks that can be named by chunkNumber, or 0 if chunk
+   memory is not backed by a file. */
+int
+chunkArenaSlots()
+{
+    if(chunkArenaFd < 0)
+        return 0;
+    return numArenas * ARENA_CHUNKS;
+}
+
+int
+chunkNumber(void *chunk)
+{
+    int i;
+
+    if(chunkArenaFd < 0)
+        return -1;
+
+    for(i = 0; i < numArenas; i++) {
+        if(CHUNK_IN_ARENA(chunk, &chunkArenas[i]))
+            return i * ARENA_CHUNKS + CHUNK_ARENA_INDEX(chunk, &chunkArenas[i]);
+    }
+    return -1;
+}
+
+/* Claim chunk number n, whose contents were left in the arena file by
+   a previous run.  Returns NULL if the chunk is already in use. */
+void *
+attachChunk(int n)
+{
+    ChunkArenaPtr arena;
+    unsigned i;
+
+    if(chunkArenaFd < 0 || n < 0 || n >= numArenas * ARENA_CHUNKS)
+        return NULL;
+
+    if(used_chunks >= CHUNKS(chunkHighMark))
+        return NULL;
+
+    arena = &chunkArenas[n / ARENA_CHUNKS];
+    i = n % ARENA_CHUNKS;
+
+    if(!(arena->bitmap & BITMAP_BIT(i)))
+        return NULL;
+
+    if(!arena->chunks) {
+        void *p;
+        p = map_arena(n / ARENA_CHUNKS, CHUNK_SIZE * ARENA_CHUNKS);
+        if(p == MAP_FAILED) {
+            do_log_error(L_ERROR, errno, "Couldn't map chunk arena");
+            return NULL;
+        }
+        arena->chunks = p;
+    }
+    arena->bitmap &= ~BITMAP_BIT(i);
+    used_chunks++;
+    return arena->chunks + CHUNK_SIZE * i;
+}
 #endif
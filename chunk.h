@@ -40,6 +40,7 @@ THE SOFTWARE.
 
 extern int chunkLowMark, chunkHighMark, chunkCriticalMark;
 extern int used_chunks;
+extern AtomPtr chunkArenaFile;
 
 void preinitChunks(void);
 void initChunks(void);
@@ -49,3 +50,6 @@ void *maybe_get_chunk(void) ATTRIBUTE ((malloc));
 void dispose_chunk(void *chunk);
 void free_chunk_arenas(void);
 int totalChunkArenaSize(void);
+int chunkArenaSlots(void);
+int chunkNumber(void *chunk);
+void *attachChunk(int n);
@@ -22,6 +22,9 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+int cacheHits = 0, cacheMisses = 0, cacheRevalidations = 0;
+int clientConnections = 0, clientConnectionsAccepted = 0;
+
 static int 
 httpAcceptAgain(TimeEventHandlerPtr event)
 {
@@ -104,6 +107,10 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
 
     connection->fd = fd;
     connection->timeout = timeout;
+    if(accessLogMask & ACCESS_LOG_CLIENT)
+        connection->peer = peerAddress(fd);
+    clientConnections++;
+    clientConnectionsAccepted++;
 
     do_log(D_CLIENT_CONN, "Accepted client connection 0x%lx\n",
            (unsigned long)connection);
@@ -139,6 +146,76 @@ httpClientAbort(HTTPConnectionPtr connection, int closed)
 
 /* s != 0 specifies that the connection must be shut down.  It is 1 in
    order to linger the connection, 2 to close it straight away. */
+static void
+httpClientLogRequest(HTTPConnectionPtr connection, HTTPRequestPtr request)
+{
+    static const char *methods[] = {"GET", "HEAD", "GET", "CONNECT",
+                                    "POST", "PUT"};
+    static const char *results[] = {"none", "hit", "miss", "revalidate",
+                                    "local"};
+    char buf[1536];
+    int n = 0, i;
+    struct timeval *last = NULL;
+    ObjectPtr object = request->object;
+
+    if(accessLogMask & ACCESS_LOG_TIME)
+        n = snnprintf(buf, n, 1536, " time=%ld.%03d",
+                      (long)current_time.tv_sec,
+                      (int)(current_time.tv_usec / 1000));
+    if(accessLogMask & ACCESS_LOG_CLIENT)
+        n = snnprintf(buf, n, 1536, " client=%s",
+                      connection->peer ? connection->peer->string : "-");
+    if(accessLogMask & ACCESS_LOG_METHOD)
+        n = snnprintf(buf, n, 1536, " method=%s",
+                      request->method >= METHOD_GET &&
+                      request->method <= METHOD_PUT ?
+                      methods[request->method] : "-");
+    if(accessLogMask & ACCESS_LOG_URL) {
+        n = snnprintf(buf, n, 1536, " url=");
+        if(object && !scrubLogs)
+            n = snnprint_n(buf, n, 1536, object->key,
+                           MIN(object->key_size, 1024));
+        else
+            n = snnprintf(buf, n, 1536, "%s", object ? "(scrubbed)" : "-");
+    }
+    if(accessLogMask & ACCESS_LOG_STATUS)
+        n = snnprintf(buf, n, 1536, " status=%d",
+                      request->error_code ? request->error_code :
+                      object ? object->code : 0);
+    if(accessLogMask & ACCESS_LOG_BYTES)
+        n = snnprintf(buf, n, 1536, " bytes=%lld",
+                      MAX(connection->offset - request->from, 0));
+    if(accessLogMask & ACCESS_LOG_CACHE) {
+        n = snnprintf(buf, n, 1536, " cache=%s", results[request->result]);
+        /* Objects that we will never serve without asking the server. */
+        if(object && request->result != RESULT_LOCAL &&
+           (!(object->flags & OBJECT_PUBLIC) ||
+            (object->cache_control & (CACHE_NO_STORE | CACHE_NO_HIDDEN))))
+            n = snnprintf(buf, n, 1536, " cacheable=0");
+    }
+    if(accessLogMask & ACCESS_LOG_TIMINGS) {
+        /* Same accounting as httpRecordRequestTimes, in microseconds. */
+        for(i = 0; i < NUM_REQUEST_TIMES; i++) {
+            if(request->times[i].tv_sec == null_time.tv_sec)
+                continue;
+            if(last)
+                n = snnprintf(buf, n, 1536, " %s=%d", requestTimeNames[i],
+                              MAX(timeval_minus_usec(&request->times[i],
+                                                     last), 0));
+            last = &request->times[i];
+        }
+        if(request->times[TIME_PARSED].tv_sec != null_time.tv_sec &&
+           request->times[TIME_DONE].tv_sec != null_time.tv_sec)
+            n = snnprintf(buf, n, 1536, " total=%d",
+                          timeval_minus_usec(&request->times[TIME_DONE],
+                                             &request->times[TIME_PARSED]));
+    }
+    n = snnprintf(buf, n, 1536, "\n");
+    if(n < 1)
+        return;
+    logAccess(buf + 1, n - 1);
+}
+
 void
 httpClientFinish(HTTPConnectionPtr connection, int s)
 {
@@ -188,7 +265,14 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
             abortConditionHandler(request->chandler);
             request->chandler = NULL;
         }
-            
+
+        if(request->times[TIME_REPLY].tv_sec != null_time.tv_sec) {
+            httpRequestTime(request, TIME_DONE);
+            httpRecordRequestTimes(request);
+        }
+        if(accessLogMask)
+            httpClientLogRequest(connection, request);
+
         if(request->object) {
             if(request->object->requestor == request)
                 request->object->requestor = NULL;
@@ -279,6 +363,8 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
             lingeringClose(connection->fd);
     }
     connection->fd = -1;
+    clientConnections--;
+    releaseAtom(connection->peer);
     free(connection);
 }
 
@@ -472,11 +558,15 @@ httpClientRawErrorHeaders(HTTPConnectionPtr connection,
     }
 
     httpSetTimeout(connection, clientTimeout);
-    do_stream(IO_WRITE, fd, 0, connection->buf, n, 
-              close > 0 ? httpErrorStreamHandler :
-              close == 0 ? httpErrorNocloseStreamHandler :
-              httpErrorNofinishStreamHandler,
-              connection);
+    if(close > 0)
+        do_stream(IO_WRITE, fd, 0, connection->buf, n,
+                  httpErrorStreamHandler, connection);
+    else if(close == 0)
+        do_stream(IO_WRITE, fd, 0, connection->buf, n,
+                  httpErrorNocloseStreamHandler, connection);
+    else
+        do_stream(IO_WRITE, fd, 0, connection->buf, n,
+                  httpErrorNofinishStreamHandler, connection);
 
     return 1;
 }
@@ -661,6 +751,9 @@ httpClientHandlerHeaders(FdEventHandlerPtr event, StreamRequestPtr srequest,
     request->flags = REQUEST_PERSISTENT;
     request->method = method;
     request->cache_control = no_cache_control;
+    if(connection->serviced == 0 && connection->request == NULL)
+        request->times[TIME_ACCEPT] = connection->start;
+    httpRequestTime(request, TIME_PARSED);
     httpQueueRequest(connection, request);
     connection->reqbegin = rc;
     return httpClientRequest(request, url);
@@ -708,7 +801,8 @@ httpClientRequest(HTTPRequestPtr request, AtomPtr url)
 {
     HTTPConnectionPtr connection = request->connection;
     int i, rc;
-    int body_len, body_te;
+    long long body_len;
+    int body_te;
     AtomPtr headers;
     CacheControlRec cache_control;
     AtomPtr via, expect, auth;
@@ -741,7 +835,8 @@ httpClientRequest(HTTPRequestPtr request, AtomPtr url)
         if(request->method == METHOD_GET || request->method == METHOD_HEAD)
             body_len = 0;
     }
-    connection->bodylen = body_len;
+    /* We don't track request bodies larger than an int. */
+    connection->bodylen = body_len <= INT_MAX ? body_len : -1;
     connection->reqte = body_te;
 
     if(authRealm) {
@@ -790,6 +885,13 @@ httpClientRequest(HTTPRequestPtr request, AtomPtr url)
     request->condition = condition;
     request->object = NULL;
 
+    if(body_len > INT_MAX) {
+        httpClientDiscardBody(connection);
+        httpClientNoticeError(request, 413,
+                              internAtom("Request body too large"));
+        return 1;
+    }
+
     if(connection->serviced > 500)
         request->flags &= ~REQUEST_PERSISTENT;
 
@@ -1130,6 +1232,8 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     }
 
     local = urlIsLocal(object->key, object->key_size);
+    if(local)
+        request->result = RESULT_LOCAL;
     objectFillFromDisk(object, request->from,
                        request->method == METHOD_HEAD ? 0 : 1);
 
@@ -1185,6 +1289,8 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     else
         validate = 0;
 
+    httpRequestTime(request, TIME_LOOKUP);
+
     if(request->cache_control.flags & CACHE_ONLY_IF_CACHED) {
         validate = 0;
         if(!haveData) {
@@ -1201,6 +1307,12 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     if(!(request->object->flags & OBJECT_VALIDATING) &&
        ((!validate && haveData) ||
         (request->object->flags & OBJECT_FAILED))) {
+        if(!validate && !local && !(request->flags & REQUEST_REQUESTED)) {
+            cacheHits++;
+            request->result = RESULT_HIT;
+            if(NEGATIVE_CODE(object->code))
+                negativeCacheHits++;
+        }
         if(serveNow) {
             connection->flags |= CONN_WRITER;
             lockChunk(request->object, request->from / CHUNK_SIZE);
@@ -1246,6 +1358,16 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     conditional =
         conditional && !(request->object->cache_control & CACHE_MISMATCH);
 
+    if(!local) {
+        if(conditional) {
+            cacheRevalidations++;
+            request->result = RESULT_REVALIDATE;
+        } else {
+            cacheMisses++;
+            request->result = RESULT_MISS;
+        }
+    }
+
     if(!(request->object->flags & OBJECT_INPROGRESS))
         request->object->flags |= OBJECT_VALIDATING;
     rc = request->object->request(request->object,
@@ -1576,6 +1698,7 @@ httpServeObject(HTTPConnectionPtr connection)
     int n, len, rc;
     int bufsize = CHUNK_SIZE;
     int condition_result;
+    long long identity_length = 0;
 
     object->atime = current_time.tv_sec;
     objectMetadataChanged(object, 0);
@@ -1610,6 +1733,19 @@ httpServeObject(HTTPConnectionPtr connection)
         }
     }
 
+    if(i == 0) {
+        ObjectPtr variant = compressedObject(request, object);
+        identity_length = object->length;
+        if(variant) {
+            lockChunk(variant, 0);
+            unlockChunk(object, 0);
+            if(object->requestor == request)
+                object->requestor = NULL;
+            releaseObject(object);
+            request->object = object = variant;
+        }
+    }
+
     condition_result = httpCondition(object, request->condition);
 
     if(condition_result == CONDITION_FAILED) {
@@ -1622,6 +1758,8 @@ httpServeObject(HTTPConnectionPtr connection)
                                   internAtom("Not modified"), 0);
     }
 
+    connection->readahead = 0;
+    connection->readahead_offset = -1;
     objectFillFromDisk(object, request->from,
                        (request->method == METHOD_HEAD ||
                         condition_result != CONDITION_MATCH) ? 0 : 1);
@@ -1674,6 +1812,12 @@ httpServeObject(HTTPConnectionPtr connection)
         return 1;
     }
 
+    /* Variants are only served to GET without a range, with a body. */
+    if(object->type == OBJECT_COMPRESSED) {
+        compressedResponses++;
+        compressedBytesSaved += identity_length - object->length;
+    }
+
     if(object->length >= 0 && request->to >= object->length)
         request->to = object->length;
 
@@ -1714,6 +1858,10 @@ httpServeObject(HTTPConnectionPtr connection)
     if(n < 0)
         goto fail;
 
+    if(object->type == OBJECT_HTTP && compressCandidate(request, object))
+        n = snnprintf(connection->buf, n, bufsize,
+                      "\r\nVary: Accept-Encoding");
+
     if(request->method != METHOD_HEAD && 
        condition_result != CONDITION_NOT_MODIFIED &&
        request->to < 0 && object->length < 0) {
@@ -1790,7 +1938,8 @@ httpServeObject(HTTPConnectionPtr connection)
 
     connection->offset = request->from;
     httpSetTimeout(connection, clientTimeout);
-    do_log(D_CLIENT_DATA, "Serving on 0x%lx for 0x%lx: offset %d len %d\n",
+    httpRequestTime(request, TIME_REPLY);
+    do_log(D_CLIENT_DATA, "Serving on 0x%lx for 0x%lx: offset %lld len %d\n",
            (unsigned long)connection, (unsigned long)object,
            connection->offset, len);
     do_stream_h(IO_WRITE |
@@ -1864,14 +2013,85 @@ httpServeObjectFinishHandler(int status,
     return 1;
 }
 
+/* Returns the number of chunks that should be read from disk for
+   connection at offset.  The window starts at two chunks, and doubles
+   every time a client comes back for the data just after the previous
+   window, up to maxDiskReadAhead.  Any other offset (a Range request,
+   a seek) brings it back to the minimum, as does a shortage of chunk
+   memory. */
+static int
+httpClientReadAheadWindow(HTTPConnectionPtr connection,
+                          long long offset, long long to)
+{
+    int window, max, room;
+
+    max = MAX(2, CHUNKS(maxDiskReadAhead));
+
+    if(offset != connection->readahead_offset || connection->readahead < 2)
+        window = 2;
+    else
+        window = MIN(max, connection->readahead * 2);
+
+    room = (int)CHUNKS(chunkLowMark) - used_chunks;
+    if(room < 2 * window)
+        window = MAX(2, room / 2);
+
+    if(to >= 0)
+        window = MIN(window, (to - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+    return MAX(window, 1);
+}
+
+/* Make sure that the data at offset is in memory if it's available on
+   disk, reading a whole read-ahead window at a time. */
+static void
+httpClientFillFromDisk(HTTPConnectionPtr connection,
+                       long long offset, long long to)
+{
+    ObjectPtr object = connection->request->object;
+    int i = offset / CHUNK_SIZE;
+    int window, rc;
+    long long end;
+
+    if(object->length >= 0 && offset >= object->length)
+        return;
+
+    if(i < object->numchunks) {
+        int s = CHUNK_SIZE;
+        if(object->length >= 0)
+            s = MIN(s, object->length - (long long)i * CHUNK_SIZE);
+        if(object->chunks[i].size >= s)
+            return;
+    }
+
+    window = httpClientReadAheadWindow(connection, offset, to);
+    rc = objectFillFromDisk(object, offset, window);
+    if(rc <= 0) {
+        /* Not on disk, or not yet -- don't let the window grow. */
+        connection->readahead = 0;
+        connection->readahead_offset = -1;
+        return;
+    }
+
+    end = (offset / CHUNK_SIZE + window) * (long long)CHUNK_SIZE;
+    connection->readahead = window;
+    connection->readahead_offset = end;
+
+    if(window > 2 && (to < 0 || end < to))
+        objectAdviseDisk(object, end,
+                         MIN(2 * window, CHUNKS(maxDiskReadAhead)) *
+                         CHUNK_SIZE);
+}
+
 int
 httpServeChunk(HTTPConnectionPtr connection)
 {
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
     int i = connection->offset / CHUNK_SIZE;
-    int j = connection->offset - (i * CHUNK_SIZE);
-    int to, len, len2, end;
+    int j = connection->offset - ((long long)i * CHUNK_SIZE);
+    long long to;
+    int len, len2, end;
     int rc;
 
     /* This must be called with chunk i locked. */
@@ -1895,7 +2115,7 @@ httpServeChunk(HTTPConnectionPtr connection)
 
     if(request->method != METHOD_HEAD && 
        len < CHUNK_SIZE && connection->offset + len < to) {
-        objectFillFromDisk(object, connection->offset + len, 2);
+        httpClientFillFromDisk(connection, connection->offset + len, to);
         len = object->chunks[i].size - j;
     }
 
@@ -1940,13 +2160,17 @@ httpServeChunk(HTTPConnectionPtr connection)
                                      connection->offset, -1, request,
                                      object->request_closure);
                 if(rc <= 0) goto fail;
+            } else if(object->request == httpServerRequest &&
+                      !REQUEST_SIDE(request)) {
+                httpServerCoalesceRange(object, connection->offset, to);
             }
             return 1;
         }
     } else {
         /* len > 0 */
         if(request->method != METHOD_HEAD)
-            objectFillFromDisk(object, (i + 1) * CHUNK_SIZE, 1);
+            httpClientFillFromDisk(connection,
+                                   (long long)(i + 1) * CHUNK_SIZE, to);
         if(request->chandler) {
             unregisterConditionHandler(request->chandler);
             request->chandler = NULL;
@@ -1955,7 +2179,7 @@ httpServeChunk(HTTPConnectionPtr connection)
         if(j + len == CHUNK_SIZE && object->numchunks > i + 1) {
             len2 = object->chunks[i + 1].size;
             if(to >= 0)
-                len2 = MIN(len2, to - (i + 1) * CHUNK_SIZE);
+                len2 = MIN(len2, to - (long long)(i + 1) * CHUNK_SIZE);
         }
         /* Lock early -- httpServerRequest may get_chunk */
         if(len2 > 0)
@@ -1974,15 +2198,15 @@ httpServeChunk(HTTPConnectionPtr connection)
                                 object->request_closure);
             else if(i + 1 < object->numchunks &&
                     object->chunks[i + 1].size == 0 &&
-                    to >= 0 && (i + 1) * CHUNK_SIZE + 1 < to)
+                    to >= 0 && (long long)(i + 1) * CHUNK_SIZE + 1 < to)
                 object->request(object, request->method,
-                                (i + 1) * CHUNK_SIZE, -1, request,
+                                (long long)(i + 1) * CHUNK_SIZE, -1, request,
                                 object->request_closure);
         }
         if(len2 == 0) {
             httpSetTimeout(connection, clientTimeout);
             do_log(D_CLIENT_DATA, 
-                   "Serving on 0x%lx for 0x%lx: offset %d len %d\n",
+                   "Serving on 0x%lx for 0x%lx: offset %lld len %d\n",
                    (unsigned long)connection, (unsigned long)object,
                    connection->offset, len);
             /* IO_NOTNOW in order to give other clients a chance to run. */
@@ -1995,7 +2219,7 @@ httpServeChunk(HTTPConnectionPtr connection)
         } else {
             httpSetTimeout(connection, clientTimeout);
             do_log(D_CLIENT_DATA, 
-                   "Serving on 0x%lx for 0x%lx: offset %d len %d + %d\n",
+                   "Serving on 0x%lx for 0x%lx: offset %lld len %d + %d\n",
                    (unsigned long)connection, (unsigned long)object,
                    connection->offset, len, len2);
             do_stream_2(IO_WRITE | IO_NOTNOW |
@@ -20,6 +20,9 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+extern int cacheHits, cacheMisses, cacheRevalidations;
+extern int clientConnections, clientConnectionsAccepted;
+
 int httpAccept(int, FdEventHandlerPtr, AcceptRequestPtr);
 void httpClientFinish(HTTPConnectionPtr connection, int s);
 int httpClientHandler(int, FdEventHandlerPtr, StreamRequestPtr);
@@ -0,0 +1,437 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "polipo.h"
+
+int compressedResponses = 0, compressedObjects = 0;
+long long compressedBytesSaved = 0;
+
+#ifdef NO_COMPRESSION
+
+void
+preinitCompress(void)
+{
+    return;
+}
+
+int
+compressCandidate(HTTPRequestPtr request, ObjectPtr object)
+{
+    return 0;
+}
+
+ObjectPtr
+compressedObject(HTTPRequestPtr request, ObjectPtr object)
+{
+    return NULL;
+}
+
+#else
+
+#include <zlib.h>
+
+int compressReplies = 0;
+int compressLevel = 6;
+int compressMinSize = 1024;
+int compressMaxSize = 1024 * 1024;
+static AtomListPtr compressTypes;
+
+static AtomPtr atomAcceptEncoding;
+
+static const char *defaultCompressTypes[] = {
+    "text/*", "application/javascript", "application/x-javascript",
+    "application/json", "application/xml", "application/xhtml+xml",
+    "application/rss+xml", "application/atom+xml", "image/svg+xml", NULL
+};
+
+void
+preinitCompress(void)
+{
+    int i;
+
+    compressTypes = makeAtomList(NULL, 0);
+    if(compressTypes == NULL) {
+        do_log(L_ERROR, "Couldn't allocate compressed types.\n");
+        exit(1);
+    }
+    for(i = 0; defaultCompressTypes[i]; i++)
+        atomListCons(internAtom(defaultCompressTypes[i]), compressTypes);
+    atomAcceptEncoding = internAtom("accept-encoding");
+
+    CONFIG_VARIABLE_SETTABLE(compressReplies, CONFIG_BOOLEAN, configIntSetter,
+                             "Compress text replies to clients with gzip.");
+    CONFIG_VARIABLE_SETTABLE(compressLevel, CONFIG_INT, configIntSetter,
+                             "Compression level, from 1 to 9.");
+    CONFIG_VARIABLE_SETTABLE(compressMinSize, CONFIG_INT, configIntSetter,
+                             "Smallest reply that will be compressed.");
+    CONFIG_VARIABLE_SETTABLE(compressMaxSize, CONFIG_INT, configIntSetter,
+                             "Largest reply that will be compressed.");
+    CONFIG_VARIABLE(compressTypes, CONFIG_ATOM_LIST_LOWER,
+                    "Content types that will be compressed.");
+}
+
+/* Whether an Accept-Encoding header accepts gzip.  We only care about
+   an explicit gzip with a non-zero quality. */
+static int
+acceptsGzip(const char *buf, int start, int end)
+{
+    int i = start, j, k, q;
+
+    while(i < end) {
+        while(i < end && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ','))
+            i++;
+        j = i;
+        while(i < end && buf[i] != ';' && buf[i] != ',' &&
+              buf[i] != ' ' && buf[i] != '\t')
+            i++;
+        k = i;
+        q = 1;
+        while(i < end && buf[i] != ',') {
+            if(buf[i] == '=' && i > start && lwr(buf[i - 1]) == 'q') {
+                int l = i + 1;
+                while(l < end && buf[l] == ' ')
+                    l++;
+                if(l < end && buf[l] == '0') {
+                    q = 0;
+                    for(l++; l < end && buf[l] != ',' && buf[l] != ';'; l++) {
+                        if(buf[l] != '.' && buf[l] != '0' && buf[l] != ' ')
+                            q = 1;
+                    }
+                }
+            }
+            i++;
+        }
+        if(q && (strcasecmp_n("gzip", buf + j, k - j) == 0 ||
+                 strcasecmp_n("x-gzip", buf + j, k - j) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+static int
+compressibleType(AtomPtr headers)
+{
+    int i, j, k, n;
+
+    if(headers == NULL ||
+       !httpFindHeader(atomContentType, headers->string, headers->length,
+                       &j, &k))
+        return 0;
+    for(n = j; n < k; n++)
+        if(headers->string[n] == ';' || headers->string[n] == ' ')
+            break;
+    n -= j;
+
+    for(i = 0; i < compressTypes->length; i++) {
+        AtomPtr type = compressTypes->list[i];
+        if(type->length >= 2 && type->string[type->length - 1] == '*') {
+            if(n >= type->length - 1 &&
+               lwrcmp(headers->string + j, type->string,
+                      type->length - 1) == 0)
+                return 1;
+        } else if(n == type->length &&
+                  lwrcmp(headers->string + j, type->string, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the reply to request would be compressed if the client
+   accepted gzip.  Identity replies then carry Vary: Accept-Encoding. */
+int
+compressCandidate(HTTPRequestPtr request, ObjectPtr object)
+{
+    int j, k;
+
+    if(!compressReplies || alwaysAddNoTransform)
+        return 0;
+
+    if(request->method != METHOD_GET || request->from > 0 || request->to >= 0)
+        return 0;
+    if(request->cache_control.flags & CACHE_NO_TRANSFORM)
+        return 0;
+
+    if(object->type != OBJECT_HTTP || object->code != 200)
+        return 0;
+    /* The variant is public, so it may only be made from a public object. */
+    if(!(object->flags & OBJECT_PUBLIC))
+        return 0;
+    if(object->flags & (OBJECT_INITIAL | OBJECT_INPROGRESS |
+                        OBJECT_SUPERSEDED | OBJECT_LINEAR | OBJECT_ABORTED |
+                        OBJECT_FAILED | OBJECT_LOCAL | OBJECT_DYNAMIC))
+        return 0;
+    if(object->cache_control & (CACHE_NO_TRANSFORM | CACHE_VARY |
+                                CACHE_PRIVATE | CACHE_NO_STORE))
+        return 0;
+    if(object->length < compressMinSize || object->length > compressMaxSize)
+        return 0;
+    if(object->headers &&
+       httpFindHeader(atomContentEncoding, object->headers->string,
+                      object->headers->length, &j, &k))
+        return 0;
+
+    return compressibleType(object->headers);
+}
+
+static int
+compressEligible(HTTPRequestPtr request, ObjectPtr object)
+{
+    int j, k;
+
+    if(!compressCandidate(request, object))
+        return 0;
+    return request->headers != NULL &&
+        httpFindHeader(atomAcceptEncoding, request->headers->string,
+                       request->headers->length, &j, &k) &&
+        acceptsGzip(request->headers->string, j, k);
+}
+
+/* Compressed data is never refetched: if some of it was discarded
+   under memory pressure, drop the variant, which will be rebuilt by
+   the next client. */
+static int
+compressedRequest(ObjectPtr object, int method, long long from, long long to,
+                  HTTPRequestPtr requestor, void *closure)
+{
+    privatiseObject(object, 0);
+    return -1;
+}
+
+/* Whether variant was built from the current instance of object.
+   Without a validator, only the same fetch will do. */
+static int
+compressedMatches(ObjectPtr variant, ObjectPtr object)
+{
+    int n;
+
+    if(variant->last_modified != object->last_modified)
+        return 0;
+    if(object->etag) {
+        n = strlen(object->etag);
+        return variant->etag && strncmp(variant->etag, object->etag, n) == 0 &&
+            strcmp(variant->etag + n, "-gzip") == 0;
+    }
+    if(variant->etag)
+        return 0;
+    return object->last_modified >= 0 || variant->date == object->date;
+}
+
+static void
+compressedUpdate(ObjectPtr variant, ObjectPtr object)
+{
+    if(variant->date != object->date || variant->age != object->age ||
+       variant->expires != object->expires ||
+       variant->max_age != object->max_age ||
+       variant->s_maxage != object->s_maxage ||
+       variant->cache_control != object->cache_control) {
+        variant->date = object->date;
+        variant->age = object->age;
+        variant->expires = object->expires;
+        variant->max_age = object->max_age;
+        variant->s_maxage = object->s_maxage;
+        variant->cache_control = object->cache_control;
+        discardObjectHeaderCache(variant);
+    }
+}
+
+/* Deflate all of object into variant.  Returns 1 on success, 0 if the
+   result is no smaller than the original, -1 on error. */
+static int
+compressData(ObjectPtr variant, ObjectPtr object)
+{
+    z_stream zs;
+    char *buf;
+    long long offset = 0;
+    int i, rc, n, done = 0;
+
+    buf = get_chunk();
+    if(buf == NULL)
+        return -1;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 selects the gzip wrapper. */
+    rc = deflateInit2(&zs, MAX(1, MIN(9, compressLevel)), Z_DEFLATED,
+                      15 + 16, 8, Z_DEFAULT_STRATEGY);
+    if(rc != Z_OK) {
+        dispose_chunk(buf);
+        return -1;
+    }
+
+    i = 0;
+    while(!done) {
+        if(zs.avail_in == 0 && i < object->numchunks &&
+           (long long)i * CHUNK_SIZE < object->length) {
+            zs.next_in = (unsigned char*)object->chunks[i].data;
+            zs.avail_in = object->chunks[i].size;
+            i++;
+        }
+        zs.next_out = (unsigned char*)buf;
+        zs.avail_out = CHUNK_SIZE;
+        rc = deflate(&zs, zs.avail_in > 0 ? Z_NO_FLUSH : Z_FINISH);
+        if(rc == Z_STREAM_END)
+            done = 1;
+        else if(rc != Z_OK && rc != Z_BUF_ERROR) {
+            rc = -1;
+            goto fail;
+        }
+        n = CHUNK_SIZE - zs.avail_out;
+        if(offset + n >= object->length) {
+            rc = 0;
+            goto fail;
+        }
+        if(n > 0) {
+            if(objectAddData(variant, buf, offset, n) < 0) {
+                rc = -1;
+                goto fail;
+            }
+            offset += n;
+        }
+    }
+
+    deflateEnd(&zs);
+    dispose_chunk(buf);
+    variant->length = offset;
+    return 1;
+
+ fail:
+    deflateEnd(&zs);
+    dispose_chunk(buf);
+    return rc;
+}
+
+/* Make a compressed variant of object.  A variant that turned out to be
+   incompressible is kept with a code of 0, so that we don't try again. */
+static ObjectPtr
+makeCompressedObject(ObjectPtr object)
+{
+    ObjectPtr variant;
+    int i, n, rc, complete;
+
+    /* Don't let the variant evict the object it was made from. */
+    if(hash(OBJECT_COMPRESSED, object->key, object->key_size,
+            log2ObjectHashTableSize) ==
+       hash(OBJECT_HTTP, object->key, object->key_size,
+            log2ObjectHashTableSize))
+        return NULL;
+
+    n = (object->length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if(objectSetChunks(object, n) < 0)
+        return NULL;
+    for(i = 0; i < n; i++)
+        lockChunk(object, i);
+    objectFillFromDisk(object, 0, n);
+    complete = 1;
+    for(i = 0; i < n; i++) {
+        if(object->chunks[i].size <
+           MIN(CHUNK_SIZE, object->length - (long long)i * CHUNK_SIZE)) {
+            complete = 0;
+            break;
+        }
+    }
+
+    variant = NULL;
+    if(!complete)
+        goto done;
+
+    variant = makeObject(OBJECT_COMPRESSED, object->key, object->key_size,
+                         1, 0, compressedRequest, NULL);
+    if(variant == NULL)
+        goto done;
+
+    variant->flags &= ~OBJECT_INITIAL;
+    variant->last_modified = object->last_modified;
+    if(object->etag) {
+        variant->etag = malloc(strlen(object->etag) + 6);
+        if(variant->etag)
+            sprintf(variant->etag, "%s-gzip", object->etag);
+    }
+    compressedUpdate(variant, object);
+
+    rc = compressData(variant, object);
+    if(rc <= 0) {
+        for(i = 0; i < variant->numchunks; i++) {
+            if(variant->chunks[i].data && !variant->chunks[i].locked) {
+                dispose_chunk(variant->chunks[i].data);
+                variant->chunks[i].data = NULL;
+                variant->chunks[i].size = 0;
+            }
+        }
+        variant->size = 0;
+        variant->length = 0;
+        if(rc < 0) {
+            privatiseObject(variant, 0);
+            releaseObject(variant);
+            variant = NULL;
+        }
+        goto done;
+    }
+
+    variant->code = 200;
+    if(object->message)
+        variant->message = retainAtom(object->message);
+    variant->headers =
+        internAtomF("%s\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding",
+                    object->headers ? object->headers->string : "");
+    if(object->via)
+        variant->via = retainAtom(object->via);
+    compressedObjects++;
+
+ done:
+    for(i = 0; i < n; i++)
+        unlockChunk(object, i);
+    return variant;
+}
+
+/* Returns a compressed variant of object suitable for request, or
+   NULL if the identity should be served. */
+ObjectPtr
+compressedObject(HTTPRequestPtr request, ObjectPtr object)
+{
+    ObjectPtr variant;
+
+    if(!compressEligible(request, object))
+        return NULL;
+
+    variant = findObject(OBJECT_COMPRESSED, object->key, object->key_size);
+    if(variant && !(variant->flags & OBJECT_INITIAL) &&
+       compressedMatches(variant, object)) {
+        compressedUpdate(variant, object);
+    } else {
+        if(variant) {
+            privatiseObject(variant, 0);
+            releaseObject(variant);
+        }
+        variant = makeCompressedObject(object);
+        if(variant == NULL)
+            return NULL;
+    }
+
+    if(variant->code == 0) {
+        releaseObject(variant);
+        return NULL;
+    }
+
+    return variant;
+}
+
+#endif
@@ -36,6 +36,7 @@ AtomPtr localDocumentRoot;
 
 DiskCacheEntryPtr diskEntries = NULL, diskEntriesLast = NULL;
 int numDiskEntries = 0;
+long long diskCacheWritten = 0;
 int diskCacheDirectoryPermissions = 0700;
 int diskCacheFilePermissions = 0600;
 int diskCacheWriteoutOnClose = (64 * 1024);
@@ -62,7 +63,7 @@ static DiskCacheEntryRec negativeEntry = {
 
 static int maxDiskEntriesSetter(ConfigVariablePtr, void*);
 static int atomSetterFlush(ConfigVariablePtr, void*);
-static int reallyWriteoutToDisk(ObjectPtr object, int upto, int max);
+static int reallyWriteoutToDisk(ObjectPtr object, long long upto, int max);
 
 void 
 preinitDiskcache()
@@ -231,7 +232,7 @@ check_entry(DiskCacheEntryPtr entry)
 #define CHECK_ENTRY(entry) do {} while(0)
 #endif
 
-int
+long long
 diskEntrySize(ObjectPtr object)
 {
     struct stat buf;
@@ -513,7 +514,7 @@ createFile(const char *name, int path_start)
 static int
 chooseBodyOffset(int n, ObjectPtr object)
 {
-    int length = MAX(object->size, object->length);
+    long long length = MAX(object->size, object->length);
     int body_offset;
 
     if(object->length >= 0 && object->length + n < 4096 - 4)
@@ -857,7 +858,7 @@ validateEntry(ObjectPtr object, int fd,
     int code;
     AtomPtr headers;
     time_t date, last_modified, expires, polipo_age, polipo_access;
-    int length;
+    long long length;
     off_t offset = -1;
     int body_offset;
     char *etag;
@@ -1159,6 +1160,10 @@ makeDiskEntry(ObjectPtr object, int create)
     if(!local && !(object->flags & OBJECT_PUBLIC))
         return NULL;
 
+    /* Compressed variants share the key of the HTTP object. */
+    if(object->type != OBJECT_HTTP)
+        return NULL;
+
     if(maxDiskCacheEntrySize >= 0) {
         if(object->length > 0) {
             if(object->length > maxDiskCacheEntrySize)
@@ -1328,7 +1333,7 @@ rewriteEntry(ObjectPtr object)
     DiskCacheEntryPtr entry;
     char* buf;
     int buf_is_chunk, bufsize;
-    int offset;
+    long long offset;
 
     fd = dup(object->disk_entry->fd);
     if(fd < 0) {
@@ -1489,7 +1494,7 @@ objectGetFromDisk(ObjectPtr object)
 
 
 int 
-objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+objectFillFromDisk(ObjectPtr object, long long offset, int chunks)
 {
     DiskCacheEntryPtr entry;
     int rc, result;
@@ -1507,7 +1512,7 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
                      (object->length - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
     }
 
-    rc = objectSetChunks(object, offset / CHUNK_SIZE + chunks);
+    rc = objectSetChunks(object, (int)(offset / CHUNK_SIZE) + chunks);
     if(rc < 0)
         return 0;
 
@@ -1515,13 +1520,14 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     if(object->flags & OBJECT_INITIAL) {
         complete = 0;
     } else if((object->length < 0 || object->size < object->length) &&
-              object->size < (offset / CHUNK_SIZE + chunks) * CHUNK_SIZE) {
+              object->size <
+              (offset / CHUNK_SIZE + chunks) * (long long)CHUNK_SIZE) {
         complete = 0;
     } else {
         for(k = 0; k < chunks; k++) {
             int s;
             i = offset / CHUNK_SIZE + k;
-            s = MIN(CHUNK_SIZE, object->size - i * CHUNK_SIZE);
+            s = MIN(CHUNK_SIZE, object->size - (long long)i * CHUNK_SIZE);
             if(object->chunks[i].size < s) {
                 complete = 0;
                 break;
@@ -1552,10 +1558,10 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     result = 0;
 
     for(k = 0; k < chunks; k++) {
-        int o;
+        long long o;
         i = offset / CHUNK_SIZE + k;
         j = object->chunks[i].size;
-        o = i * CHUNK_SIZE + j;
+        o = (long long)i * CHUNK_SIZE + j;
 
         if(object->chunks[i].size == CHUNK_SIZE)
             continue;
@@ -1605,9 +1611,9 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
                    entry->size < entry->offset - entry->body_offset) {
                     do_log(L_WARN,
                            "Disk entry size changed behind our back: "
-                           "%ld -> %ld (%d).\n",
-                           (long)entry->size,
-                           (long)entry->offset - entry->body_offset,
+                           "%lld -> %lld (%lld).\n",
+                           (long long)entry->size,
+                           (long long)entry->offset - entry->body_offset,
                            object->size);
                     entry->size = -1;
                 }
@@ -1633,8 +1639,34 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     }
 }
 
+/* Tell the kernel that we're about to read len bytes of the body of
+   object starting at offset, so that it can start reading them in
+   while we're busy serving the data we've already got. */
+void
+objectAdviseDisk(ObjectPtr object, long long offset, int len)
+{
+#if defined(POSIX_FADV_WILLNEED) && !defined(WIN32)
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int rc;
+
+    if(!entry || entry == &negativeEntry || len <= 0)
+        return;
+
+    if(object->length >= 0) {
+        if(offset >= object->length)
+            return;
+        len = MIN(len, object->length - offset);
+    }
+
+    rc = posix_fadvise(entry->fd, entry->body_offset + offset, len,
+                       POSIX_FADV_WILLNEED);
+    if(rc != 0)
+        do_log_error(D_IO, rc, "Couldn't advise disk entry");
+#endif
+}
+
 int 
-writeoutToDisk(ObjectPtr object, int upto, int max)
+writeoutToDisk(ObjectPtr object, long long upto, int max)
 {
     if(maxDiskCacheEntrySize >= 0 && object->size > maxDiskCacheEntrySize) {
         /* An object was created with an unknown length, and then grew
@@ -1647,12 +1679,12 @@ writeoutToDisk(ObjectPtr object, int upto, int max)
 }
         
 static int 
-reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
+reallyWriteoutToDisk(ObjectPtr object, long long upto, int max)
 {
     DiskCacheEntryPtr entry;
     int rc;
     int i, j;
-    int offset;
+    long long offset;
     int bytes = 0;
 
     if(upto < 0)
@@ -1722,6 +1754,7 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
         entry->offset += rc;
         offset += rc;
         bytes += rc;
+        diskCacheWritten += rc;
         if(entry->size < offset)
             entry->size = offset;
     } while(j + rc >= CHUNK_SIZE);
@@ -1798,7 +1831,7 @@ DiskObjectPtr
 readDiskObject(char *filename, struct stat *sb)
 {
     int fd, rc, n, dummy, code;
-    int length, size;
+    long long length, size;
     time_t date, last_modified, age, atime, expires;
     char *location = NULL, *fn = NULL;
     DiskObjectPtr dobject;
@@ -2198,13 +2231,14 @@ indexDiskObjects(FILE *out, const char *root, int recursive)
                 fprintf(out, "</tt></a></td> ");
                 if(dobject->length >= 0) {
                     if(dobject->size == dobject->length)
-                        fprintf(out, "<td>%d</td> ", dobject->length);
+                        fprintf(out, "<td>%lld</td> ", dobject->length);
                     else
-                        fprintf(out, "<td>%d/%d</td> ",
+                        fprintf(out, "<td>%lld/%lld</td> ",
                                dobject->size, dobject->length);
                 } else {
                     /* Avoid a trigraph. */
-                    fprintf(out, "<td>%d/<em>??" "?</em></td> ", dobject->size);
+                    fprintf(out, "<td>%lld/<em>??" "?</em></td> ",
+                            dobject->size);
                 }
                 if(dobject->last_modified >= 0) {
                     struct tm *tm = gmtime(&dobject->last_modified);
@@ -2516,7 +2550,7 @@ initDiskcache()
 }
 
 int
-writeoutToDisk(ObjectPtr object, int upto, int max)
+writeoutToDisk(ObjectPtr object, long long upto, int max)
 {
     return 0;
 }
@@ -2534,11 +2568,17 @@ objectGetFromDisk(ObjectPtr object)
 }
 
 int
-objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+objectFillFromDisk(ObjectPtr object, long long offset, int chunks)
 {
     return 0;
 }
 
+void
+objectAdviseDisk(ObjectPtr object, long long offset, int len)
+{
+    return;
+}
+
 int
 revalidateDiskEntry(ObjectPtr object)
 {
@@ -2557,7 +2597,7 @@ expireDiskObjects()
     do_log(L_ERROR, "Disk cache not supported in this version.\n");
 }
 
-int
+long long
 diskEntrySize(ObjectPtr object)
 {
     return -1;
@@ -20,7 +20,8 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-extern int maxDiskEntries;
+extern int maxDiskEntries, numDiskEntries;
+extern long long diskCacheWritten;
 
 extern AtomPtr diskCacheRoot;
 extern AtomPtr additionalDiskCacheRoot;
@@ -42,8 +43,8 @@ typedef struct _DiskObject {
     char *location;
     char *filename;
     int body_offset;
-    int length;
-    int size;
+    long long length;
+    long long size;
     time_t age;
     time_t access;
     time_t date;
@@ -59,11 +60,12 @@ extern int maxDiskCacheEntrySize;
 void preinitDiskcache(void);
 void initDiskcache(void);
 int destroyDiskEntry(ObjectPtr object, int);
-int diskEntrySize(ObjectPtr object);
+long long diskEntrySize(ObjectPtr object);
 ObjectPtr objectGetFromDisk(ObjectPtr);
-int objectFillFromDisk(ObjectPtr object, int offset, int chunks);
+int objectFillFromDisk(ObjectPtr object, long long offset, int chunks);
+void objectAdviseDisk(ObjectPtr object, long long offset, int len);
 int writeoutMetadata(ObjectPtr object);
-int writeoutToDisk(ObjectPtr object, int upto, int max);
+int writeoutToDisk(ObjectPtr object, long long upto, int max);
 void dirtyDiskEntry(ObjectPtr object);
 int revalidateDiskEntry(ObjectPtr object);
 DiskObjectPtr readDiskObject(char *filename, struct stat *sb);
@@ -37,8 +37,9 @@ const int dnsUseGethostbyname = 0;
 #endif
 
 #ifndef NO_FANCY_RESOLVER
-AtomPtr dnsNameServer = NULL;
+AtomListPtr dnsNameServer = NULL;
 int dnsMaxTimeout = 60;
+int dnsHedgePercentile = 95;
 #endif
 
 #ifndef NO_STANDARD_RESOLVER
@@ -46,6 +47,12 @@ int dnsGethostbynameTtl = 1200;
 #endif
 
 int dnsNegativeTtl = 120;
+int dnsRefreshAhead = 10;
+
+int dnsHits = 0, dnsMisses = 0, dnsRefreshes = 0;
+int dnsQueries = 0, dnsMaxQueryTime = 0;
+long long dnsQueryTime = 0;
+HistogramRec dnsLatency, dnsRefreshLatency;
 
 #ifdef HAVE_IPv6
 int dnsQueryIPv6 = 2;
@@ -53,6 +60,9 @@ int dnsQueryIPv6 = 2;
 const int dnsQueryIPv6 = 0;
 #endif
 
+#define DNS_MAX_SERVERS 8
+#define DNS_RTT_SAMPLES 32
+
 typedef struct _DnsQuery {
     unsigned id;
     AtomPtr name;
@@ -62,24 +72,45 @@ typedef struct _DnsQuery {
     time_t time;
     int timeout;
     TimeEventHandlerPtr timeout_handler;
-    struct _DnsQuery *next;
+    TimeEventHandlerPtr hedge_handler;
+    int refresh;
+    struct timeval start;
+    /* Bitmaps of the servers the query was sent to, sent to more than
+       once, and that replied. */
+    unsigned sent, resent, answered;
+    struct timeval sent_time[DNS_MAX_SERVERS];
+    struct _DnsQuery *next, *name_next;
 } DnsQueryRec, *DnsQueryPtr;
 
-union {
-    struct sockaddr sa;
-    struct sockaddr_in sin;
+typedef struct _DnsServer {
+    AtomPtr name;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
 #ifdef HAVE_IPv6
-    struct sockaddr_in6 sin6;
+        struct sockaddr_in6 sin6;
 #endif
-} nameserverAddress_storage;
+    } address;
+    int fd;
+    FdEventHandlerPtr handler;
+    int rtt;                    /* smoothed, in microseconds */
+    int failures;               /* decaying failure rate, per mille */
+    int samples[DNS_RTT_SAMPLES];
+    int numsamples;
+    int queries, replies, timeouts, errors, hedges;
+} DnsServerRec, *DnsServerPtr;
 
 #ifndef NO_FANCY_RESOLVER
 static AtomPtr atomLocalhost, atomLocalhostDot;
 
-#define nameserverAddress nameserverAddress_storage.sa
+static DnsServerRec dnsServers[DNS_MAX_SERVERS];
+static int numDnsServers = 0;
 
-static DnsQueryPtr inFlightDnsQueries;
-static DnsQueryPtr inFlightDnsQueriesLast;
+/* In-flight queries are hashed both by id and by name. */
+#define DNS_QUERY_HASH_SIZE 256
+static DnsQueryPtr inFlightDnsQueries[DNS_QUERY_HASH_SIZE];
+static DnsQueryPtr inFlightDnsQueriesByName[DNS_QUERY_HASH_SIZE];
+static int numInFlightDnsQueries;
 #endif
 
 static int really_do_gethostbyname(AtomPtr name, ObjectPtr object);
@@ -99,7 +130,12 @@ static int dnsDecodeReply(char *buf, int offset, int n,
                           int *af_return, unsigned *ttl_return);
 static int dnsHandler(int status, ConditionHandlerPtr chandler);
 static int dnsGethostbynameFallback(int id, AtomPtr message);
+static int dnsQueryFallback(DnsQueryPtr query, AtomPtr message);
 static int sendQuery(DnsQueryPtr query);
+static int sendQueryTo(DnsQueryPtr query, int i);
+static void cancelQueryTimers(DnsQueryPtr query);
+static void dnsServerFailed(int i);
+static void dnsRefresh(AtomPtr name, ObjectPtr object);
 
 static int idSeed;
 #endif
@@ -112,7 +148,7 @@ parseResolvConf(char *filename)
     char buf[512];
     char *p, *q;
     int n;
-    AtomPtr nameserver = NULL;
+    AtomListPtr nameservers;
 
     f = fopen(filename, "r");
     if(f == NULL) {
@@ -120,6 +156,12 @@ parseResolvConf(char *filename)
         return 0;
     }
 
+    nameservers = makeAtomList(NULL, 0);
+    if(nameservers == NULL) {
+        fclose(f);
+        return 0;
+    }
+
     while(1) {
         p = fgets(buf, 512, f);
         if(p == NULL)
@@ -154,15 +196,15 @@ parseResolvConf(char *filename)
                    filename);
             continue;
         }
-        nameserver = internAtomLowerN(p, q - p);
-        break;
+        atomListCons(internAtomLowerN(p, q - p), nameservers);
     }
 
     fclose(f);
-    if(nameserver) {
-        dnsNameServer = nameserver;
+    if(nameservers->length > 0) {
+        dnsNameServer = nameservers;
         return 1;
     } else {
+        destroyAtomList(nameservers);
         return 0;
     }
 }
@@ -200,14 +242,21 @@ preinitDns()
 
 #ifndef NO_FANCY_RESOLVER
     parseResolvConf("/etc/resolv.conf");
-    if(dnsNameServer == NULL || dnsNameServer->string[0] == '\0')
-        dnsNameServer = internAtom("127.0.0.1");
+    if(dnsNameServer == NULL || dnsNameServer->length == 0) {
+        AtomPtr localhost = internAtom("127.0.0.1");
+        dnsNameServer = makeAtomList(&localhost, 1);
+    }
     CONFIG_VARIABLE(dnsMaxTimeout, CONFIG_TIME,
                     "Max timeout for DNS queries.");
     CONFIG_VARIABLE(dnsNegativeTtl, CONFIG_TIME,
                     "TTL for negative DNS replies with no TTL.");
-    CONFIG_VARIABLE(dnsNameServer, CONFIG_ATOM_LOWER,
-                    "The name server to use.");
+    CONFIG_VARIABLE_SETTABLE(dnsRefreshAhead, CONFIG_INT, configIntSetter,
+                             "Refresh names used in the last n% of their TTL.");
+    CONFIG_VARIABLE(dnsNameServer, CONFIG_ATOM_LIST_LOWER,
+                    "The name servers to use.");
+    CONFIG_VARIABLE_SETTABLE(dnsHedgePercentile, CONFIG_INT, configIntSetter,
+                             "Percentile of the name server's RTT after "
+                             "which to ask another one (0 to disable).");
 #ifndef NO_STANDARD_RESOLVER
     CONFIG_VARIABLE(dnsUseGethostbyname, CONFIG_TETRASTATE,
                     "Use the system resolver.");
@@ -220,37 +269,72 @@ preinitDns()
 #endif
 }
 
-void
-initDns()
-{
 #ifndef NO_FANCY_RESOLVER
-    int rc;
-    struct timeval t;
-    struct sockaddr_in *sin = (struct sockaddr_in*)&nameserverAddress;
+static int
+parseNameServer(DnsServerPtr server, AtomPtr name)
+{
+    struct sockaddr_in *sin = &server->address.sin;
 #ifdef HAVE_IPv6
-    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&nameserverAddress;
+    struct sockaddr_in6 *sin6 = &server->address.sin6;
 #endif
+    int rc;
 
-    atomLocalhost = internAtom("localhost");
-    atomLocalhostDot = internAtom("localhost.");
-    inFlightDnsQueries = NULL;
-    inFlightDnsQueriesLast = NULL;
+    memset(server, 0, sizeof(*server));
+    server->name = retainAtom(name);
+    server->fd = -1;
+    server->handler = NULL;
+    server->rtt = -1;
 
-    gettimeofday(&t, NULL);
-    idSeed = t.tv_usec & 0xFFFF;
     sin->sin_family = AF_INET;
     sin->sin_port = htons(53);
-    rc = inet_aton(dnsNameServer->string, &sin->sin_addr);
+    rc = inet_aton(server->name->string, &sin->sin_addr);
 #ifdef HAVE_IPv6
     if(rc != 1) {
         sin6->sin6_family = AF_INET6;
         sin6->sin6_port = htons(53);
-        rc = inet_pton(AF_INET6, dnsNameServer->string, &sin6->sin6_addr);
+        rc = inet_pton(AF_INET6, server->name->string, &sin6->sin6_addr);
     }
 #endif
-    if(rc != 1) {
-        do_log(L_ERROR, "DNS: couldn't parse name server %s.\n",
-               dnsNameServer->string);
+    return rc == 1 ? 1 : -1;
+}
+#endif
+
+void
+initDns()
+{
+#ifndef NO_FANCY_RESOLVER
+    int i, rc;
+    struct timeval t;
+
+    atomLocalhost = internAtom("localhost");
+    atomLocalhostDot = internAtom("localhost.");
+    memset(inFlightDnsQueries, 0, sizeof(inFlightDnsQueries));
+    memset(inFlightDnsQueriesByName, 0, sizeof(inFlightDnsQueriesByName));
+    numInFlightDnsQueries = 0;
+
+    gettimeofday(&t, NULL);
+    idSeed = t.tv_usec & 0xFFFF;
+
+    numDnsServers = 0;
+    for(i = 0; dnsNameServer && i < dnsNameServer->length; i++) {
+        AtomPtr name = dnsNameServer->list[i];
+        if(name == NULL || name->length == 0)
+            continue;
+        if(numDnsServers >= DNS_MAX_SERVERS) {
+            do_log(L_WARN, "DNS: too many name servers, ignoring %s.\n",
+                   name->string);
+            break;
+        }
+        rc = parseNameServer(&dnsServers[numDnsServers], name);
+        if(rc < 0) {
+            do_log(L_ERROR, "DNS: couldn't parse name server %s.\n",
+                   name->string);
+            exit(1);
+        }
+        numDnsServers++;
+    }
+    if(numDnsServers == 0) {
+        do_log(L_ERROR, "DNS: no name server.\n");
         exit(1);
     }
 #endif
@@ -315,6 +399,7 @@ do_gethostbyname(char *origname,
 
     object = findObject(OBJECT_DNS, name->string, name->length);
     if(object == NULL || objectMustRevalidate(object, NULL)) {
+        dnsMisses++;
         if(object) {
             privatiseObject(object, 0);
             releaseObject(object);
@@ -330,6 +415,15 @@ do_gethostbyname(char *origname,
             releaseAtom(request.error_message);
             return 1;
         }
+    } else if(!(object->flags & OBJECT_INITIAL)) {
+        dnsHits++;
+#ifndef NO_FANCY_RESOLVER
+        if(dnsRefreshAhead > 0 && dnsUseGethostbyname < 3 &&
+           object->headers && object->expires > object->age &&
+           current_time.tv_sec >= object->expires -
+           (object->expires - object->age) * dnsRefreshAhead / 100)
+            dnsRefresh(name, object);
+#endif
     }
 
     if((object->flags & (OBJECT_INITIAL | OBJECT_INPROGRESS)) ==
@@ -724,9 +818,6 @@ really_do_gethostbyname(AtomPtr name, ObjectPtr object)
 
 #ifndef NO_FANCY_RESOLVER
 
-static int dnsSocket = -1;
-static FdEventHandlerPtr dnsSocketHandler = NULL;
-
 static int
 dnsHandler(int status, ConditionHandlerPtr chandler)
 {
@@ -751,7 +842,7 @@ static int
 queryInFlight(DnsQueryPtr query)
 {
     DnsQueryPtr other;
-    other = inFlightDnsQueries;
+    other = inFlightDnsQueries[query->id % DNS_QUERY_HASH_SIZE];
     while(other) {
         if(other == query)
             return 1;
@@ -763,40 +854,43 @@ queryInFlight(DnsQueryPtr query)
 static void
 removeQuery(DnsQueryPtr query)
 {
-    DnsQueryPtr previous;
-    if(query == inFlightDnsQueries) {
-        inFlightDnsQueries = query->next;
-        if(inFlightDnsQueries == NULL)
-            inFlightDnsQueriesLast = NULL;
-    } else {
-        previous = inFlightDnsQueries;
-        while(previous->next) {
-            if(previous->next == query)
-                break;
-            previous = previous->next;
-        }
-        assert(previous->next != NULL);
-        previous->next = query->next;
-        if(previous->next == NULL)
-            inFlightDnsQueriesLast = previous;
+    DnsQueryPtr *p;
+
+    p = &inFlightDnsQueries[query->id % DNS_QUERY_HASH_SIZE];
+    while(*p != query) {
+        assert(*p != NULL);
+        p = &(*p)->next;
     }
+    *p = query->next;
+
+    p = &inFlightDnsQueriesByName[query->name->hash % DNS_QUERY_HASH_SIZE];
+    while(*p != query) {
+        assert(*p != NULL);
+        p = &(*p)->name_next;
+    }
+    *p = query->name_next;
+
+    query->next = query->name_next = NULL;
+    numInFlightDnsQueries--;
 }
 
 static void
 insertQuery(DnsQueryPtr query) 
 {
-    if(inFlightDnsQueriesLast)
-        inFlightDnsQueriesLast->next = query;
-    else
-        inFlightDnsQueries = query;
-    inFlightDnsQueriesLast = query;
+    int i = query->id % DNS_QUERY_HASH_SIZE;
+    int j = query->name->hash % DNS_QUERY_HASH_SIZE;
+    query->next = inFlightDnsQueries[i];
+    inFlightDnsQueries[i] = query;
+    query->name_next = inFlightDnsQueriesByName[j];
+    inFlightDnsQueriesByName[j] = query;
+    numInFlightDnsQueries++;
 }
 
 static DnsQueryPtr
 findQuery(int id, AtomPtr name)
 {
     DnsQueryPtr query;
-    query = inFlightDnsQueries;
+    query = inFlightDnsQueries[id % DNS_QUERY_HASH_SIZE];
     while(query) {
         if(query->id == id && (name == NULL || query->name == name))
             return query;
@@ -805,12 +899,51 @@ findQuery(int id, AtomPtr name)
     return NULL;
 }
 
+static DnsQueryPtr
+findQueryByName(AtomPtr name)
+{
+    DnsQueryPtr query;
+    query = inFlightDnsQueriesByName[name->hash % DNS_QUERY_HASH_SIZE];
+    while(query) {
+        if(query->name == name)
+            return query;
+        query = query->name_next;
+    }
+    return NULL;
+}
+
+static DnsQueryPtr
+anyQuery()
+{
+    int i;
+    if(numInFlightDnsQueries <= 0)
+        return NULL;
+    for(i = 0; i < DNS_QUERY_HASH_SIZE; i++)
+        if(inFlightDnsQueries[i])
+            return inFlightDnsQueries[i];
+    return NULL;
+}
+
+/* A refresh query owns a reference to its name, and must not disturb
+   its object, which is still being served from. */
+static void
+discardRefreshQuery(DnsQueryPtr query)
+{
+    assert(query->refresh);
+    cancelQueryTimers(query);
+    releaseAtom(query->name);
+    if(query->inet4) releaseAtom(query->inet4);
+    if(query->inet6) releaseAtom(query->inet6);
+    releaseObject(query->object);
+    free(query);
+}
+
 static int
 dnsTimeoutHandler(TimeEventHandlerPtr event)
 {
     DnsQueryPtr query = *(DnsQueryPtr*)event->data;
     ObjectPtr object = query->object;
-    int rc;
+    int i, rc;
 
     /* People are reporting that this does happen.  And I have no idea why. */
     if(!queryInFlight(query)) {
@@ -820,17 +953,27 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
     }
 
     query->timeout = MAX(10, query->timeout * 2);
+    query->timeout_handler = NULL;
+
+    for(i = 0; i < numDnsServers; i++) {
+        if((query->sent & (1 << i)) && !(query->answered & (1 << i))) {
+            dnsServers[i].timeouts++;
+            dnsServerFailed(i);
+        }
+    }
 
     if(query->timeout > dnsMaxTimeout) {
-        abortObject(object, 501, internAtom("Timeout"));
+        if(!query->refresh)
+            abortObject(object, 501, internAtom("Timeout"));
         goto fail;
     } else {
         rc = sendQuery(query);
         if(rc < 0) {
             if(rc != -EWOULDBLOCK && rc != -EAGAIN && rc != -ENOBUFS) {
-                abortObject(object, 501,
-                            internAtomError(-rc,
-                                            "Couldn't send DNS query"));
+                if(!query->refresh)
+                    abortObject(object, 501,
+                                internAtomError(-rc,
+                                                "Couldn't send DNS query"));
                 goto fail;
             }
             /* else let it timeout */
@@ -840,8 +983,10 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
                               sizeof(query), &query);
         if(query->timeout_handler == NULL) {
             do_log(L_ERROR, "Couldn't schedule DNS timeout handler.\n");
-            abortObject(object, 501,
-                        internAtom("Couldn't schedule DNS timeout handler"));
+            if(!query->refresh)
+                abortObject(object, 501,
+                            internAtom("Couldn't schedule "
+                                       "DNS timeout handler"));
             goto fail;
         }
         return 1;
@@ -849,6 +994,13 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
 
  fail:
     removeQuery(query);
+    if(query->refresh) {
+        do_log(D_DNS, "DNS: couldn't refresh %s.\n",
+               scrub(query->name->string));
+        discardRefreshQuery(query);
+        return 1;
+    }
+    cancelQueryTimers(query);
     object->flags &= ~OBJECT_INPROGRESS;
     if(query->inet4) releaseAtom(query->inet4);
     if(query->inet6) releaseAtom(query->inet6);
@@ -858,11 +1010,12 @@ dnsTimeoutHandler(TimeEventHandlerPtr event)
 }
 
 static int
-establishDnsSocket()
+establishDnsServerSocket(int i)
 {
+    DnsServerPtr server = &dnsServers[i];
     int rc;
 #ifdef HAVE_IPv6
-    int inet6 = (nameserverAddress.sa_family == AF_INET6);
+    int inet6 = (server->address.sa.sa_family == AF_INET6);
     int pf = inet6 ? PF_INET6 : PF_INET;
     int sa_size = 
         inet6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
@@ -871,30 +1024,31 @@ establishDnsSocket()
     int sa_size = sizeof(struct sockaddr_in);
 #endif
 
-    if(dnsSocket < 0) {
-        assert(!dnsSocketHandler);
-        dnsSocket = socket(pf, SOCK_DGRAM, 0);
-        if(dnsSocket < 0) {
+    if(server->fd < 0) {
+        assert(!server->handler);
+        server->fd = socket(pf, SOCK_DGRAM, 0);
+        if(server->fd < 0) {
             do_log_error(L_ERROR, errno, "Couldn't create DNS socket");
             return -errno;
         }
 
-        rc = connect(dnsSocket, &nameserverAddress, sa_size);
+        rc = connect(server->fd, &server->address.sa, sa_size);
         if(rc < 0) {
-            CLOSE(dnsSocket);
-            dnsSocket = -1;
+            CLOSE(server->fd);
+            server->fd = -1;
             do_log_error(L_ERROR, errno, "Couldn't create DNS \"connection\"");
             return -errno;
         }
     }
 
-    if(!dnsSocketHandler) {
-        dnsSocketHandler = 
-            registerFdEvent(dnsSocket, POLLIN, dnsReplyHandler, 0, NULL);
-        if(dnsSocketHandler == NULL) {
+    if(!server->handler) {
+        server->handler = 
+            registerFdEvent(server->fd, POLLIN, dnsReplyHandler,
+                            sizeof(i), &i);
+        if(server->handler == NULL) {
             do_log(L_ERROR, "Couldn't register DNS socket handler.\n");
-            CLOSE(dnsSocket);
-            dnsSocket = -1;
+            CLOSE(server->fd);
+            server->fd = -1;
             return -ENOMEM;
         }
     }
@@ -903,15 +1057,174 @@ establishDnsSocket()
 }
 
 static int
-sendQuery(DnsQueryPtr query)
+establishDnsSocket()
+{
+    int i, rc, ok = 0, error = -ENOTCONN;
+
+    for(i = 0; i < numDnsServers; i++) {
+        rc = establishDnsServerSocket(i);
+        if(rc >= 0)
+            ok = 1;
+        else
+            error = rc;
+    }
+    return ok ? 1 : error;
+}
+
+static void
+dnsServerFailed(int i)
+{
+    DnsServerPtr server = &dnsServers[i];
+    server->failures = server->failures - server->failures / 8 + 1000 / 8;
+}
+
+static void
+dnsServerReplied(DnsQueryPtr query, int i, int ok)
+{
+    DnsServerPtr server = &dnsServers[i];
+    unsigned bit = 1 << i;
+    int rtt;
+
+    if(!(query->sent & bit) || (query->answered & bit))
+        return;
+    query->answered |= bit;
+    server->replies++;
+    if(!ok) {
+        server->errors++;
+        dnsServerFailed(i);
+        return;
+    }
+    server->failures -= server->failures / 8;
+
+    /* Karn's algorithm: don't sample retransmitted queries. */
+    if(query->resent & bit)
+        return;
+    rtt = timeval_minus_usec(&current_time, &query->sent_time[i]);
+    if(rtt < 0)
+        return;
+    if(server->rtt >= 0)
+        server->rtt = (3 * server->rtt + rtt + 2) / 4;
+    else
+        server->rtt = rtt;
+    server->samples[server->numsamples % DNS_RTT_SAMPLES] = rtt;
+    server->numsamples++;
+}
+
+/* Called when a query has been answered: servers that haven't replied
+   yet are at least as slow as the time elapsed since we asked them. */
+
+static void
+dnsServersLate(DnsQueryPtr query)
+{
+    int i, rtt;
+
+    for(i = 0; i < numDnsServers; i++) {
+        DnsServerPtr server = &dnsServers[i];
+        if(!(query->sent & (1 << i)) || (query->answered & (1 << i)))
+            continue;
+        rtt = timeval_minus_usec(&current_time, &query->sent_time[i]);
+        if(rtt > server->rtt)
+            server->rtt = server->rtt >= 0 ?
+                (3 * server->rtt + rtt + 2) / 4 : rtt;
+    }
+}
+
+/* Servers are ranked by their smoothed RTT, penalised by their failure
+   rate; servers that have never replied are assumed to take 100ms. */
+
+static long long
+dnsServerScore(int i)
+{
+    DnsServerPtr server = &dnsServers[i];
+    long long rtt = server->rtt >= 0 ? server->rtt : 100000;
+    return rtt * 1000 / (1001 - MIN(server->failures, 1000));
+}
+
+static int
+dnsChooseServer(unsigned exclude)
 {
+    int i, best = -1;
+    long long score, best_score = 0;
+
+    for(i = 0; i < numDnsServers; i++) {
+        if(dnsServers[i].fd < 0 || (exclude & (1 << i)))
+            continue;
+        score = dnsServerScore(i);
+        if(best < 0 || score < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static int
+intcmp(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* The delay, in milliseconds, after which a query sent to server i is
+   also sent to another server. */
+
+static int
+dnsHedgeDelay(int i)
+{
+    DnsServerPtr server = &dnsServers[i];
+    int samples[DNS_RTT_SAMPLES];
+    int n = MIN(server->numsamples, DNS_RTT_SAMPLES);
+
+    if(n < 4)
+        return server->rtt >= 0 ? MAX(10, server->rtt / 500) : 500;
+
+    memcpy(samples, server->samples, n * sizeof(int));
+    qsort(samples, n, sizeof(int), intcmp);
+    return MAX(10, samples[(n - 1) * MIN(dnsHedgePercentile, 100) / 100] /
+               1000);
+}
+
+static int
+dnsHedgeHandler(TimeEventHandlerPtr event)
+{
+    DnsQueryPtr query = *(DnsQueryPtr*)event->data;
+    int i;
+
+    query->hedge_handler = NULL;
+    i = dnsChooseServer(query->sent);
+    if(i >= 0) {
+        do_log(D_DNS, "DNS: hedging query for %s to %s.\n",
+               scrub(query->name->string), dnsServers[i].name->string);
+        dnsServers[i].hedges++;
+        sendQueryTo(query, i);
+    }
+    return 1;
+}
+
+static void
+cancelQueryTimers(DnsQueryPtr query)
+{
+    if(query->timeout_handler) {
+        cancelTimeEvent(query->timeout_handler);
+        query->timeout_handler = NULL;
+    }
+    if(query->hedge_handler) {
+        cancelTimeEvent(query->hedge_handler);
+        query->hedge_handler = NULL;
+    }
+}
+
+static int
+sendQueryTo(DnsQueryPtr query, int i)
+{
+    DnsServerPtr server = &dnsServers[i];
+    unsigned bit = 1 << i;
     char buf[512];
     int buflen;
     int rc;
     int af[2];
-    int i;
+    int j;
 
-    if(dnsSocket < 0)
+    if(server->fd < 0)
         return -1;
 
     if(dnsQueryIPv6 <= 0) {
@@ -922,21 +1235,28 @@ sendQuery(DnsQueryPtr query)
         af[0] = 6; af[1] = 0;
     }
 
-    for(i = 0; i < 2; i++) {
-        if(af[i] == 0)
+    if(query->sent & bit)
+        query->resent |= bit;
+    query->sent |= bit;
+    query->answered &= ~bit;
+    query->sent_time[i] = current_time;
+    server->queries++;
+
+    for(j = 0; j < 2; j++) {
+        if(af[j] == 0)
             continue;
-        if(af[i] == 4 && query->inet4)
+        if(af[j] == 4 && query->inet4)
             continue;
-        else if(af[i] == 6 && query->inet6)
+        else if(af[j] == 6 && query->inet6)
             continue;
 
-        buflen = dnsBuildQuery(query->id, buf, 0, 512, query->name, af[i]);
+        buflen = dnsBuildQuery(query->id, buf, 0, 512, query->name, af[j]);
         if(buflen <= 0) {
             do_log(L_ERROR, "Couldn't build DNS query.\n");
             return buflen;
         }
 
-        rc = send(dnsSocket, buf, buflen, 0);
+        rc = send(server->fd, buf, buflen, 0);
         if(rc < buflen) {
             if(rc >= 0) {
                 do_log(L_ERROR, "Couldn't send DNS query: partial send.\n");
@@ -950,6 +1270,52 @@ sendQuery(DnsQueryPtr query)
     return 1;
 }
 
+/* Send a query to the best server it hasn't been sent to yet, falling
+   back to the others if sending fails, and arrange for it to be hedged
+   to another server if no reply arrives in time. */
+
+static int
+sendQuery(DnsQueryPtr query)
+{
+    unsigned tried = 0;
+    int i, rc = -1;
+
+    while(1) {
+        i = dnsChooseServer(query->sent | tried);
+        if(i < 0)
+            i = dnsChooseServer(tried);
+        if(i < 0)
+            return rc;
+        rc = sendQueryTo(query, i);
+        if(rc >= 0 || rc == -EWOULDBLOCK || rc == -EAGAIN || rc == -ENOBUFS)
+            break;
+        dnsServerFailed(i);
+        tried |= 1 << i;
+    }
+
+    if(numDnsServers > 1 && dnsHedgePercentile > 0 &&
+       !query->hedge_handler && dnsChooseServer(query->sent) >= 0)
+        query->hedge_handler =
+            scheduleTimeEventMsec(dnsHedgeDelay(i), dnsHedgeHandler,
+                                  sizeof(query), &query);
+    return rc;
+}
+
+/* Send a query that a server failed to answer to another server.
+   Returns 1 if the query has been resent. */
+
+static int
+dnsFailover(DnsQueryPtr query)
+{
+    int i, rc;
+
+    i = dnsChooseServer(query->sent);
+    if(i < 0)
+        return 0;
+    rc = sendQueryTo(query, i);
+    return rc >= 0;
+}
+
 static int
 really_do_dns(AtomPtr name, ObjectPtr object)
 {
@@ -1038,7 +1404,11 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     query->object = retainObject(object);
     query->timeout = 4;
     query->timeout_handler = NULL;
-    query->next = NULL;
+    query->hedge_handler = NULL;
+    query->refresh = 0;
+    query->start = current_time;
+    query->sent = query->resent = query->answered = 0;
+    query->next = query->name_next = NULL;
 
     query->timeout_handler = 
         scheduleTimeEvent(query->timeout, dnsTimeoutHandler,
@@ -1067,7 +1437,7 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     removeQuery(query);
  free_fallback:
     releaseObject(query->object);
-    cancelTimeEvent(query->timeout_handler);
+    cancelQueryTimers(query);
     free(query);
  fallback:
     if(dnsUseGethostbyname >= 1) {
@@ -1081,9 +1451,156 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     }
 }
 
+/* Called on a cache hit for a name that is about to expire: query it
+   again in the background, so that the next request doesn't need to
+   wait for the reply. */
+
+static void
+dnsRefresh(AtomPtr name, ObjectPtr object)
+{
+    DnsQueryPtr query;
+    struct in_addr ina;
+    int rc;
+
+    if(name == atomLocalhost || name == atomLocalhostDot ||
+       name->string[0] == '[' || inet_aton(name->string, &ina) == 1)
+        return;
+
+    if(findQueryByName(name))
+        return;
+
+    rc = establishDnsSocket();
+    if(rc < 0)
+        return;
+
+    query = malloc(sizeof(DnsQueryRec));
+    if(query == NULL)
+        return;
+    query->id = (idSeed++) & 0xFFFF;
+    query->inet4 = NULL;
+    query->inet6 = NULL;
+    query->name = retainAtom(name);
+    query->time = current_time.tv_sec;
+    query->object = retainObject(object);
+    query->timeout = 4;
+    query->hedge_handler = NULL;
+    query->refresh = 1;
+    query->start = current_time;
+    query->sent = query->resent = query->answered = 0;
+    query->next = query->name_next = NULL;
+
+    query->timeout_handler =
+        scheduleTimeEvent(query->timeout, dnsTimeoutHandler,
+                          sizeof(query), &query);
+    if(query->timeout_handler == NULL) {
+        discardRefreshQuery(query);
+        return;
+    }
+    insertQuery(query);
+    dnsRefreshes++;
+
+    do_log(D_DNS, "DNS: refreshing %s.\n", scrub(name->string));
+    rc = sendQuery(query);
+    if(rc < 0 && rc != -EWOULDBLOCK && rc != -EAGAIN && rc != -ENOBUFS) {
+        removeQuery(query);
+        discardRefreshQuery(query);
+    }
+}
+
+/* Combine the replies to a complete query.  Returns the DNS_A or
+   DNS_CNAME atom, or NULL with *message_return set. */
+
+static AtomPtr
+dnsQueryResult(DnsQueryPtr query, AtomPtr cname, unsigned ttl,
+               AtomPtr message,
+               time_t *expires_return, AtomPtr *message_return)
+{
+    AtomPtr result = NULL;
+
+    *message_return = NULL;
+    if(cname) {
+        assert(query->inet4 == NULL && query->inet6 == NULL);
+        *expires_return = current_time.tv_sec + ttl;
+        return cname;
+    } else if((!query->inet4 || query->inet4->length == 0) &&
+              (!query->inet6 || query->inet6->length == 0)) {
+        *message_return = retainAtom(message);
+    } else if(!query->inet4 || query->inet4->length == 0) {
+        result = retainAtom(query->inet6);
+        *expires_return = query->ttl6;
+    } else if(!query->inet6 || query->inet6->length == 0) {
+        result = retainAtom(query->inet4);
+        *expires_return = query->ttl4;
+    } else {
+        /* need to merge results */
+        char buf[1024];
+        if(query->inet4->length + query->inet6->length > 1024) {
+            *message_return = internAtom("DNS reply too long");
+        } else {
+            if(dnsQueryIPv6 <= 1) {
+                memcpy(buf, query->inet4->string, query->inet4->length);
+                memcpy(buf + query->inet4->length,
+                       query->inet6->string + 1, query->inet6->length - 1);
+            } else {
+                memcpy(buf, query->inet6->string, query->inet6->length);
+                memcpy(buf + query->inet6->length,
+                       query->inet4->string + 1, query->inet4->length - 1);
+            }
+            result = internAtomN(buf,
+                                 query->inet4->length +
+                                 query->inet6->length - 1);
+            if(result == NULL)
+                *message_return = internAtom("Couldn't allocate DNS atom");
+            *expires_return = MIN(query->ttl4, query->ttl6);
+        }
+    }
+    releaseAtom(query->inet4);
+    releaseAtom(query->inet6);
+    query->inet4 = query->inet6 = NULL;
+    if(result == NULL)
+        *expires_return = current_time.tv_sec + dnsNegativeTtl;
+    return result;
+}
+
+/* A server sent back an ICMP error.  Send the queries that were waiting
+   for it to another server, or fall back on the system resolver. */
+
+static void
+dnsServerUnreachable(int i)
+{
+    DnsQueryPtr *queries, query;
+    unsigned bit = 1 << i;
+    int j, n = 0;
+
+    dnsServers[i].errors++;
+    dnsServerFailed(i);
+
+    if(numInFlightDnsQueries <= 0)
+        return;
+    queries = malloc(numInFlightDnsQueries * sizeof(DnsQueryPtr));
+    if(queries == NULL)
+        return;
+    for(j = 0; j < DNS_QUERY_HASH_SIZE; j++)
+        for(query = inFlightDnsQueries[j]; query; query = query->next)
+            if((query->sent & bit) && !(query->answered & bit))
+                queries[n++] = query;
+
+    for(j = 0; j < n; j++) {
+        query = queries[j];
+        query->answered |= bit;
+        if(dnsFailover(query))
+            continue;
+        if(query->sent & ~query->answered)
+            continue;
+        dnsQueryFallback(query, NULL);
+    }
+    free(queries);
+}
+
 static int
 dnsReplyHandler(int abort, FdEventHandlerPtr event)
 {
+    int i = *(int*)event->data;
     int fd = event->fd;
     char buf[2048];
     int len, rc;
@@ -1096,8 +1613,8 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     AtomPtr cname = NULL;
 
     if(abort) {
-        dnsSocketHandler = NULL;
-        rc = establishDnsSocket();
+        dnsServers[i].handler = NULL;
+        rc = establishDnsServerSocket(i);
         if(rc < 0) {
             do_log(L_ERROR, "Couldn't reestablish DNS socket.\n");
             /* At this point, we should abort all in-flight
@@ -1110,8 +1627,9 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     if(len <= 0) {
         if(errno == EINTR || errno == EAGAIN) return 0;
         /* This is where we get ECONNREFUSED for an ICMP port unreachable */
-        do_log_error(L_ERROR, errno, "DNS: recv failed");
-        dnsGethostbynameFallback(-1, message);
+        do_log_error(L_ERROR, errno, "DNS: recv from %s failed",
+                     dnsServers[i].name->string);
+        dnsServerUnreachable(i);
         return 0;
     }
 
@@ -1130,6 +1648,19 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
     }
 
     rc = dnsDecodeReply(buf, 0, len, &id, &name, &value, &af, &ttl);
+
+    /* A server failure is not an answer; ask another server. */
+    if(rc == -EDNS_NO_RECOVERY || rc == -EDNS_REFUSED) {
+        query = findQuery(id, NULL);
+        if(query) {
+            dnsServerReplied(query, i, 0);
+            if(dnsFailover(query)) {
+                releaseAtom(name);
+                return 0;
+            }
+        }
+    }
+
     if(rc < 0) {
         assert(value == NULL);
         /* We only want to fallback on gethostbyname if we received a
@@ -1159,6 +1690,10 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
         return 0;
     }
 
+    dnsServerReplied(query, i,
+                     rc >= 0 || rc == -EDNS_HOST_NOT_FOUND ||
+                     rc == -EDNS_NO_ADDRESS);
+
     /* We're going to use the information in this reply.  If it was an
        error, construct an empty atom to distinguish it from information
        we're still waiting for. */
@@ -1208,64 +1743,58 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
 
     /* This query is complete */
 
-    cancelTimeEvent(query->timeout_handler);
+    cancelQueryTimers(query);
+    dnsServersLate(query);
     object = query->object;
+    removeQuery(query);
 
-    if(object->flags & OBJECT_INITIAL) {
-        assert(!object->headers);
-        if(cname) {
-            assert(query->inet4 == NULL && query->inet6 == NULL);
-            object->headers = cname;
-            object->expires = current_time.tv_sec + ttl;
-        } else if((!query->inet4 || query->inet4->length == 0) &&
-                  (!query->inet6 || query->inet6->length == 0)) {
-            releaseAtom(query->inet4);
-            releaseAtom(query->inet6);
-            object->expires = current_time.tv_sec + dnsNegativeTtl;
-            abortObject(object, 500, retainAtom(message));
-        } else if(!query->inet4 || query->inet4->length == 0) {
-            object->headers = query->inet6;
-            object->expires = query->ttl6;
-            releaseAtom(query->inet4);
-        } else if(!query->inet6 || query->inet6->length == 0) {
-            object->headers = query->inet4;
-            object->expires = query->ttl4;
-            releaseAtom(query->inet6);
+    if(query->refresh) {
+        AtomPtr result, error;
+        time_t expires;
+        histogramRecord(&dnsRefreshLatency,
+                        timeval_minus_usec(&current_time, &query->start));
+        result = dnsQueryResult(query, cname, ttl, message, &expires, &error);
+        if(result) {
+            releaseAtom(object->headers);
+            object->headers = result;
+            object->expires = expires;
+            object->age = current_time.tv_sec;
         } else {
-            /* need to merge results */
-            char buf[1024];
-            if(query->inet4->length + query->inet6->length > 1024) {
-                releaseAtom(query->inet4);
-                releaseAtom(query->inet6);
-                abortObject(object, 500, internAtom("DNS reply too long"));
-            } else {
-                if(dnsQueryIPv6 <= 1) {
-                    memcpy(buf, query->inet4->string, query->inet4->length);
-                    memcpy(buf + query->inet4->length,
-                           query->inet6->string + 1, query->inet6->length - 1);
-                } else {
-                    memcpy(buf, query->inet6->string, query->inet6->length);
-                    memcpy(buf + query->inet6->length,
-                           query->inet4->string + 1, query->inet4->length - 1);
-                }
-                object->headers =
-                    internAtomN(buf, 
-                                query->inet4->length + 
-                                query->inet6->length - 1);
-                if(object->headers == NULL)
-                    abortObject(object, 500, 
-                                internAtom("Couldn't allocate DNS atom"));
-            }
-            object->expires = MIN(query->ttl4, query->ttl6);
+            do_log(D_DNS, "DNS: couldn't refresh %s.\n",
+                   scrub(query->name->string));
+            releaseAtom(error);
         }
+        discardRefreshQuery(query);
+        releaseAtom(name);
+        releaseAtom(message);
+        return 0;
+    }
+
+    if(object->flags & OBJECT_INITIAL) {
+        AtomPtr error;
+        int t;
+        assert(!object->headers);
+        object->headers = dnsQueryResult(query, cname, ttl, message,
+                                         &object->expires, &error);
+        if(object->headers == NULL)
+            abortObject(object, 500, error);
         object->age = current_time.tv_sec;
         object->flags &= ~(OBJECT_INITIAL | OBJECT_INPROGRESS);
+        t = timeval_minus_usec(&current_time, &query->start);
+        histogramRecord(&dnsLatency, t);
+        t /= 1000;
+        dnsQueries++;
+        dnsQueryTime += t;
+        if(t > dnsMaxQueryTime)
+            dnsMaxQueryTime = t;
     } else {
         do_log(L_WARN, "DNS object ex nihilo for %s.\n",
                scrub(query->name->string));
+        releaseAtom(query->inet4);
+        releaseAtom(query->inet6);
+        releaseAtom(cname);
     }
     
-    removeQuery(query);
     free(query);
 
     releaseAtom(name);
@@ -1277,41 +1806,40 @@ dnsReplyHandler(int abort, FdEventHandlerPtr event)
 static int
 dnsGethostbynameFallback(int id, AtomPtr message)
 {
-    DnsQueryPtr query, previous;
-    ObjectPtr object;
+    DnsQueryPtr query;
 
-    if(inFlightDnsQueries == NULL) {
+    query = NULL;
+    if(id >= 0)
+        query = findQuery(id, NULL);
+    if(query == NULL)
+        query = anyQuery();
+    if(query == NULL) {
         releaseAtom(message);
         return 1;
     }
 
-    query = NULL;
-    if(id < 0 || inFlightDnsQueries->id == id) {
-        previous = NULL;
-        query = inFlightDnsQueries;
-    } else {
-        previous = inFlightDnsQueries;
-        while(previous->next) {
-            if(previous->next->id == id) {
-                query = previous->next;
-                break;
-            }
-            previous = previous->next;
-        }
-        if(!query) {
-            previous = NULL;
-            query = inFlightDnsQueries;
-        }
+    if(id < 0 && query->refresh) {
+        removeQuery(query);
+        discardRefreshQuery(query);
+        return dnsGethostbynameFallback(id, message);
     }
 
-    if(previous == NULL) {
-        inFlightDnsQueries = query->next;
-        if(inFlightDnsQueries == NULL)
-            inFlightDnsQueriesLast = NULL;
-    } else {
-        previous->next = query->next;
-        if(query->next == NULL)
-            inFlightDnsQueriesLast = NULL;
+    return dnsQueryFallback(query, message);
+}
+
+/* Give up on query, which must still be in flight. */
+
+static int
+dnsQueryFallback(DnsQueryPtr query, AtomPtr message)
+{
+    ObjectPtr object;
+
+    removeQuery(query);
+
+    if(query->refresh) {
+        discardRefreshQuery(query);
+        releaseAtom(message);
+        return 1;
     }
 
     object = makeObject(OBJECT_DNS, query->name->string, query->name->length,
@@ -1321,7 +1849,7 @@ dnsGethostbynameFallback(int id, AtomPtr message)
         releaseAtom(query->name);
         releaseAtom(message);
         releaseObject(query->object);
-        cancelTimeEvent(query->timeout_handler);
+        cancelQueryTimers(query);
         free(query);
         return -1;
     }
@@ -1335,7 +1863,7 @@ dnsGethostbynameFallback(int id, AtomPtr message)
         object->flags &= ~OBJECT_INPROGRESS;
         releaseNotifyObject(object);
     }
-    cancelTimeEvent(query->timeout_handler);
+    cancelQueryTimers(query);
     releaseAtom(query->name);
     if(query->inet4) releaseAtom(query->inet4);
     if(query->inet6) releaseAtom(query->inet6);
@@ -1344,6 +1872,64 @@ dnsGethostbynameFallback(int id, AtomPtr message)
     return 1;
 }
 
+void
+listDnsServers(FILE *out)
+{
+    int i;
+
+    fprintf(out, "<!DOCTYPE HTML PUBLIC "
+            "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+            "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+            "<html><head>\n"
+            "\r\n<title>Name servers</title>\n"
+           "</head><body>\n"
+            "<h1>Name servers</h1>\n");
+
+    if(dnsUseGethostbyname >= 3) {
+        fprintf(out, "<p>Using the system resolver.</p>\n");
+        goto done;
+    }
+
+    alternatingHttpStyle(out, "dns");
+    fprintf(out, "<table id=dns>\n");
+    fprintf(out, "<thead><tr><th>Server</th>"
+            "<th>rtt</th>"
+            "<th>hedge</th>"
+            "<th>failures</th>"
+            "<th>queries</th>"
+            "<th>replies</th>"
+            "<th>timeouts</th>"
+            "<th>errors</th>"
+            "<th>hedged</th>"
+            "</tr></thead>\n");
+    fprintf(out, "<tbody>\n");
+    for(i = 0; i < numDnsServers; i++) {
+        DnsServerPtr server = &dnsServers[i];
+        fprintf(out, "<tr class=\"%s\">", i % 2 == 0 ? "even" : "odd");
+        fprintf(out, "<td>%s</td>", server->name->string);
+        if(server->rtt >= 0)
+            fprintf(out, "<td>%.3f</td>", (double)server->rtt / 1000000.0);
+        else
+            fprintf(out, "<td></td>");
+        if(numDnsServers > 1 && dnsHedgePercentile > 0)
+            fprintf(out, "<td>%.3f</td>", (double)dnsHedgeDelay(i) / 1000.0);
+        else
+            fprintf(out, "<td></td>");
+        fprintf(out, "<td>%d%%</td><td>%d</td><td>%d</td><td>%d</td>"
+                "<td>%d</td><td>%d</td>",
+                (server->failures + 5) / 10,
+                server->queries, server->replies, server->timeouts,
+                server->errors, server->hedges);
+        fprintf(out, "</tr>\n");
+    }
+    fprintf(out, "</tbody>\n");
+    fprintf(out, "</table>\n");
+
+ done:
+    fprintf(out, "<p><a href=\"/polipo/\">back</a></p>");
+    fprintf(out, "</body></html>\n");
+}
+
 static int
 stringToLabels(char *buf, int offset, int n, char *string)
 {
@@ -1744,4 +2330,19 @@ really_do_dns(AtomPtr name, ObjectPtr object)
     abort();
 }
 
+void
+listDnsServers(FILE *out)
+{
+    fprintf(out, "<!DOCTYPE HTML PUBLIC "
+            "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+            "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+            "<html><head>\n"
+            "\r\n<title>Name servers</title>\n"
+           "</head><body>\n"
+            "<h1>Name servers</h1>\n"
+            "<p>Using the system resolver.</p>\n"
+            "<p><a href=\"/polipo/\">back</a></p>"
+            "</body></html>\n");
+}
+
 #endif
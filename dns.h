@@ -22,6 +22,10 @@ THE SOFTWARE.
 
 extern char *nameServer;
 extern int useGethostbyname;
+extern int dnsHits, dnsMisses, dnsRefreshes;
+extern int dnsQueries, dnsMaxQueryTime;
+extern long long dnsQueryTime;
+extern HistogramRec dnsLatency, dnsRefreshLatency;
 
 #define DNS_A 0
 #define DNS_CNAME 1
@@ -46,3 +50,4 @@ void preinitDns(void);
 void initDns(void);
 int do_gethostbyname(char *name, int count,
                      int (*handler)(int, GethostbynameRequestPtr), void *data);
+void listDnsServers(FILE *out);
@@ -43,6 +43,15 @@ int diskIsClean = 1;
 
 static int fds_invalid = 0;
 
+int eventProfile = 0;
+static int eventSlowThreshold = 100;
+HandlerProfileRec handlerProfiles[HANDLER_PROFILE_SIZE];
+HistogramRec loopLag;
+
+static int profileDepth = 0;
+static const char *profileNestedName = NULL;
+static int profileNestedTime = 0;
+
 static inline int
 timeval_cmp(struct timeval *t1, struct timeval *t2)
 {
@@ -77,6 +86,92 @@ timeval_minus_usec(const struct timeval *s1, const struct timeval *s2)
     return (s1->tv_sec - s2->tv_sec) * 1000000 + s1->tv_usec - s2->tv_usec;
 }
 
+void
+preinitEvents()
+{
+    CONFIG_VARIABLE_SETTABLE(eventProfile, CONFIG_BOOLEAN, configIntSetter,
+                             "Measure the time spent in event handlers.");
+    CONFIG_VARIABLE_SETTABLE(eventSlowThreshold, CONFIG_INT, configIntSetter,
+                             "Log handlers slower than this many ms.");
+}
+
+/* Stream I/O all goes through do_scheduled_stream, so handlers are
+   told apart by name as well as by function. */
+static HandlerProfilePtr
+findHandlerProfile(HandlerFunction function, const char *name)
+{
+    int i, j;
+
+    if(name == NULL)
+        name = "(unknown)";
+    i = ((unsigned long)function >> 4) % HANDLER_PROFILE_SIZE;
+    for(j = 0; j < HANDLER_PROFILE_SIZE; j++) {
+        HandlerProfilePtr profile = &handlerProfiles[i];
+        if(profile->function == function &&
+           (profile->name == name || strcmp(profile->name, name) == 0))
+            return profile;
+        if(profile->function == NULL) {
+            profile->function = function;
+            profile->name = name;
+            return profile;
+        }
+        i = (i + 1) % HANDLER_PROFILE_SIZE;
+    }
+    return NULL;
+}
+
+static void
+profileStart(struct timeval *start)
+{
+    gettimeofday(start, NULL);
+    profileDepth++;
+}
+
+/* Handlers may be nested, for example condition handlers run from
+   within an fd handler; the time of a nested handler is included in
+   that of its parent.  Only the outermost handler is reported as slow,
+   together with the slowest handler it called. */
+
+static void
+profileEnd(struct timeval *start, HandlerFunction function, const char *name)
+{
+    struct timeval now;
+    HandlerProfilePtr profile;
+    int t;
+
+    gettimeofday(&now, NULL);
+    t = timeval_minus_usec(&now, start);
+    profileDepth--;
+
+    profile = findHandlerProfile(function, name);
+    if(profile) {
+        profile->count++;
+        profile->total += t;
+        if(t > profile->max)
+            profile->max = t;
+    }
+
+    if(profileDepth > 0) {
+        if(t > profileNestedTime) {
+            profileNestedName = name;
+            profileNestedTime = t;
+        }
+        return;
+    }
+
+    if(eventSlowThreshold > 0 && t >= eventSlowThreshold * 1000) {
+        if(profileNestedName)
+            do_log(L_WARN, "Handler %s ran for %d ms (%d ms in %s).\n",
+                   name ? name : "(unknown)", t / 1000,
+                   profileNestedTime / 1000, profileNestedName);
+        else
+            do_log(L_WARN, "Handler %s ran for %d ms.\n",
+                   name ? name : "(unknown)", t / 1000);
+    }
+    profileNestedName = NULL;
+    profileNestedTime = 0;
+}
+
 #ifdef HAVE_FORK
 static void
 sigexit(int signo)
@@ -249,21 +344,13 @@ enqueueTimeEvent(TimeEventHandlerPtr event)
     return event;
 }
 
-TimeEventHandlerPtr
-scheduleTimeEvent(int seconds,
-                  int (*handler)(TimeEventHandlerPtr), int dsize, void *data)
+static TimeEventHandlerPtr
+scheduleTimeEventAt(struct timeval when,
+                    int (*handler)(TimeEventHandlerPtr), const char *name,
+                    int dsize, void *data)
 {
-    struct timeval when;
     TimeEventHandlerPtr event;
 
-    if(seconds >= 0) {
-        when = current_time;
-        when.tv_sec += seconds;
-    } else {
-        when.tv_sec = 0;
-        when.tv_usec = 0;
-    }
-
     event = malloc(sizeof(TimeEventHandlerRec) - 1 + dsize);
     if(event == NULL) {
         do_log(L_ERROR, "Couldn't allocate time event handler -- "
@@ -274,6 +361,7 @@ scheduleTimeEvent(int seconds,
 
     event->time = when;
     event->handler = handler;
+    event->name = name;
     /* Let the compiler optimise the common case */
     if(dsize == sizeof(void*))
         memcpy(event->data, data, sizeof(void*));
@@ -283,6 +371,45 @@ scheduleTimeEvent(int seconds,
     return enqueueTimeEvent(event);
 }
 
+TimeEventHandlerPtr
+scheduleTimeEventNamed(int seconds,
+                       int (*handler)(TimeEventHandlerPtr), const char *name,
+                       int dsize, void *data)
+{
+    struct timeval when;
+
+    if(seconds >= 0) {
+        when = current_time;
+        when.tv_sec += seconds;
+    } else {
+        when.tv_sec = 0;
+        when.tv_usec = 0;
+    }
+    return scheduleTimeEventAt(when, handler, name, dsize, data);
+}
+
+/* Same as above, for delays shorter than a second. */
+
+TimeEventHandlerPtr
+scheduleTimeEventMsecNamed(int msecs,
+                           int (*handler)(TimeEventHandlerPtr),
+                           const char *name, int dsize, void *data)
+{
+    struct timeval when;
+
+    if(msecs < 0)
+        return scheduleTimeEventNamed(-1, handler, name, dsize, data);
+
+    when = current_time;
+    when.tv_sec += msecs / 1000;
+    when.tv_usec += (msecs % 1000) * 1000;
+    if(when.tv_usec >= 1000000) {
+        when.tv_sec++;
+        when.tv_usec -= 1000000;
+    }
+    return scheduleTimeEventAt(when, handler, name, dsize, data);
+}
+
 void
 cancelTimeEvent(TimeEventHandlerPtr event)
 {
@@ -353,8 +480,9 @@ deallocateFdEventNum(int i)
 }
 
 FdEventHandlerPtr 
-makeFdEvent(int fd, int poll_events, 
-            int (*handler)(int, FdEventHandlerPtr), int dsize, void *data)
+makeFdEventNamed(int fd, int poll_events, 
+                 int (*handler)(int, FdEventHandlerPtr), const char *name,
+                 int dsize, void *data)
 {
     FdEventHandlerPtr event;
 
@@ -368,6 +496,7 @@ makeFdEvent(int fd, int poll_events,
     event->fd = fd;
     event->poll_events = poll_events;
     event->handler = handler;
+    event->name = name;
     /* Let the compiler optimise the common cases */
     if(dsize == sizeof(void*))
         memcpy(event->data, data, sizeof(void*));
@@ -409,12 +538,13 @@ registerFdEventHelper(FdEventHandlerPtr event)
 }
 
 FdEventHandlerPtr 
-registerFdEvent(int fd, int poll_events, 
-                int (*handler)(int, FdEventHandlerPtr), int dsize, void *data)
+registerFdEventNamed(int fd, int poll_events, 
+                     int (*handler)(int, FdEventHandlerPtr), const char *name,
+                     int dsize, void *data)
 {
     FdEventHandlerPtr event;
 
-    event = makeFdEvent(fd, poll_events, handler, dsize, data);
+    event = makeFdEventNamed(fd, poll_events, handler, name, dsize, data);
     if(event == NULL)
         return NULL;
 
@@ -479,6 +609,7 @@ void
 runTimeEventQueue()
 {
     TimeEventHandlerPtr event;
+    struct timeval start;
     int done;
 
     while(timeEventQueue && 
@@ -489,7 +620,20 @@ runTimeEventQueue()
             timeEventQueue->previous = NULL;
         else
             timeEventQueueLast = NULL;
-        done = event->handler(event);
+        if(eventProfile) {
+            profileStart(&start);
+            /* How late we are running timers is our measure of lag.
+               Timers scheduled during initialisation, before the
+               clock was first read, are not interesting. */
+            if(event->time.tv_sec != 0 &&
+               start.tv_sec - event->time.tv_sec < 3600)
+                histogramRecord(&loopLag,
+                                timeval_minus_usec(&start, &event->time));
+            done = event->handler(event);
+            profileEnd(&start, (HandlerFunction)event->handler, event->name);
+        } else {
+            done = event->handler(event);
+        }
         assert(done);
         free(event);
     }
@@ -566,7 +710,16 @@ pokeFdEventHandler(TimeEventHandlerPtr tevent)
     while(event) {
         next = event->next;
         if(event->poll_events & what) {
-            done = event->handler(status, event);
+            if(eventProfile) {
+                HandlerFunction function = (HandlerFunction)event->handler;
+                const char *name = event->name;
+                struct timeval start;
+                profileStart(&start);
+                done = event->handler(status, event);
+                profileEnd(&start, function, name);
+            } else {
+                done = event->handler(status, event);
+            }
             if(done) {
                 if(fds_invalid)
                     unregisterFdEvent(event);
@@ -622,7 +775,7 @@ workToDo()
 void
 eventLoop()
 {
-    struct timeval sleep_time, timeout;
+    struct timeval sleep_time, timeout, start;
     int rc, i, done, n;
     FdEventHandlerPtr event;
     int fd0;
@@ -635,6 +788,8 @@ eventLoop()
             if(exitFlag < 3)
                 reopenLog();
             if(exitFlag >= 2) {
+                if(exitFlag >= 3)
+                    writeoutObjectTable();
                 discardObjects(1, 0);
                 if(exitFlag >= 3)
                     return;
@@ -688,8 +843,16 @@ eventLoop()
         if(rc == 0) {
             if(!diskIsClean) {
                 timeToSleep(&sleep_time);
-                if(timeval_cmp(&sleep_time, &current_time) > 0)
-                    writeoutObjects(0);
+                if(timeval_cmp(&sleep_time, &current_time) > 0) {
+                    if(eventProfile) {
+                        profileStart(&start);
+                        writeoutObjects(0);
+                        profileEnd(&start, (HandlerFunction)writeoutObjects,
+                                   "writeoutObjects");
+                    } else {
+                        writeoutObjects(0);
+                    }
+                }
             }
             continue;
         }
@@ -710,7 +873,15 @@ eventLoop()
                 event = findEvent(poll_fds[j].revents, fdEvents[j]);
                 if(!event)
                     continue;
-                done = event->handler(0, event);
+                if(eventProfile) {
+                    HandlerFunction function = (HandlerFunction)event->handler;
+                    const char *name = event->name;
+                    profileStart(&start);
+                    done = event->handler(0, event);
+                    profileEnd(&start, function, name);
+                } else {
+                    done = event->handler(0, event);
+                }
                 if(done) {
                     if(fds_invalid)
                         unregisterFdEvent(event);
@@ -744,9 +915,9 @@ makeCondition(void)
 }
 
 ConditionHandlerPtr
-conditionWait(ConditionPtr condition,
-              int (*handler)(int, ConditionHandlerPtr),
-              int dsize, void *data)
+conditionWaitNamed(ConditionPtr condition,
+                   int (*handler)(int, ConditionHandlerPtr),
+                   const char *name, int dsize, void *data)
 {
     ConditionHandlerPtr chandler;
 
@@ -758,6 +929,7 @@ conditionWait(ConditionPtr condition,
 
     chandler->condition = condition;
     chandler->handler = handler;
+    chandler->name = name;
     /* Let the compiler optimise the common case */
     if(dsize == sizeof(void*))
         memcpy(chandler->data, data, sizeof(void*));
@@ -802,6 +974,7 @@ void
 signalCondition(ConditionPtr condition)
 {
     ConditionHandlerPtr handler;
+    struct timeval start;
     int done;
 
     assert(!in_signalCondition);
@@ -810,7 +983,14 @@ signalCondition(ConditionPtr condition)
     handler = condition->handlers;
     while(handler) {
         ConditionHandlerPtr next = handler->next;
-        done = handler->handler(0, handler);
+        if(eventProfile) {
+            profileStart(&start);
+            done = handler->handler(0, handler);
+            profileEnd(&start, (HandlerFunction)handler->handler,
+                       handler->name);
+        } else {
+            done = handler->handler(0, handler);
+        }
         if(done) {
             if(handler == condition->handlers)
                 condition->handlers = next;
@@ -24,10 +24,29 @@ extern struct timeval current_time;
 extern struct timeval null_time;
 extern int diskIsClean;
 
+/* The name of an event handler is recorded when it is registered, so
+   that the event loop profiler can report it. */
+typedef void (*HandlerFunction)(void);
+
+typedef struct _HandlerProfile {
+    HandlerFunction function;
+    const char *name;
+    int count;
+    int max;
+    long long total;
+} HandlerProfileRec, *HandlerProfilePtr;
+
+#define HANDLER_PROFILE_SIZE 256
+
+extern int eventProfile;
+extern HandlerProfileRec handlerProfiles[HANDLER_PROFILE_SIZE];
+extern HistogramRec loopLag;
+
 typedef struct _TimeEventHandler {
     struct timeval time;
     struct _TimeEventHandler *previous, *next;
     int (*handler)(struct _TimeEventHandler*);
+    const char *name;
     char data[1];
 } TimeEventHandlerRec, *TimeEventHandlerPtr;
 
@@ -36,6 +55,7 @@ typedef struct _FdEventHandler {
     short poll_events;
     struct _FdEventHandler *previous, *next;
     int (*handler)(int, struct _FdEventHandler*);
+    const char *name;
     char data[1];
 } FdEventHandlerRec, *FdEventHandlerPtr;
 
@@ -43,6 +63,7 @@ typedef struct _ConditionHandler {
     struct _Condition *condition;
     struct _ConditionHandler *previous, *next;
     int (*handler)(int, struct _ConditionHandler*);
+    const char *name;
     char data[1];
 } ConditionHandlerRec, *ConditionHandlerPtr;
 
@@ -50,13 +71,23 @@ typedef struct _Condition {
     ConditionHandlerPtr handlers;
 } ConditionRec, *ConditionPtr;
 
+void preinitEvents(void);
 void initEvents(void);
 void uninitEvents(void);
 void interestingSignals(sigset_t *ss);
 
-TimeEventHandlerPtr scheduleTimeEvent(int seconds,
-                                      int (*handler)(TimeEventHandlerPtr),
-                                      int dsize, void *data);
+TimeEventHandlerPtr scheduleTimeEventNamed(int seconds,
+                                           int (*handler)(TimeEventHandlerPtr),
+                                           const char *name,
+                                           int dsize, void *data);
+TimeEventHandlerPtr
+scheduleTimeEventMsecNamed(int msecs,
+                           int (*handler)(TimeEventHandlerPtr),
+                           const char *name, int dsize, void *data);
+#define scheduleTimeEvent(seconds, handler, dsize, data) \
+    scheduleTimeEventNamed(seconds, handler, #handler, dsize, data)
+#define scheduleTimeEventMsec(msecs, handler, dsize, data) \
+    scheduleTimeEventMsecNamed(msecs, handler, #handler, dsize, data)
 
 int timeval_minus_usec(const struct timeval *s1, const struct timeval *s2)
      ATTRIBUTE((pure));
@@ -65,12 +96,17 @@ int allocateFdEventNum(int fd);
 void deallocateFdEventNum(int i);
 void timeToSleep(struct timeval *);
 void runTimeEventQueue(void);
-FdEventHandlerPtr makeFdEvent(int fd, int poll_events, 
-                              int (*handler)(int, FdEventHandlerPtr), 
-                              int dsize, void *data);
-FdEventHandlerPtr registerFdEvent(int fd, int poll_events,
-                                  int (*handler)(int, FdEventHandlerPtr),
-                                  int dsize, void *data);
+FdEventHandlerPtr makeFdEventNamed(int fd, int poll_events, 
+                                   int (*handler)(int, FdEventHandlerPtr), 
+                                   const char *name, int dsize, void *data);
+FdEventHandlerPtr registerFdEventNamed(int fd, int poll_events,
+                                       int (*handler)(int, FdEventHandlerPtr),
+                                       const char *name,
+                                       int dsize, void *data);
+#define makeFdEvent(fd, poll_events, handler, dsize, data) \
+    makeFdEventNamed(fd, poll_events, handler, #handler, dsize, data)
+#define registerFdEvent(fd, poll_events, handler, dsize, data) \
+    registerFdEventNamed(fd, poll_events, handler, #handler, dsize, data)
 FdEventHandlerPtr registerFdEventHelper(FdEventHandlerPtr event);
 void unregisterFdEvent(FdEventHandlerPtr event);
 void pokeFdEvent(int fd, int status, int what);
@@ -80,9 +116,11 @@ ConditionPtr makeCondition(void);
 void initCondition(ConditionPtr);
 void signalCondition(ConditionPtr condition);
 ConditionHandlerPtr 
-conditionWait(ConditionPtr condition,
-              int (*handler)(int, ConditionHandlerPtr),
-              int dsize, void *data);
+conditionWaitNamed(ConditionPtr condition,
+                   int (*handler)(int, ConditionHandlerPtr),
+                   const char *name, int dsize, void *data);
+#define conditionWait(condition, handler, dsize, data) \
+    conditionWaitNamed(condition, handler, #handler, dsize, data)
 void unregisterConditionHandler(ConditionHandlerPtr);
 void abortConditionHandler(ConditionHandlerPtr);
 void polipoExit(void);
@@ -58,12 +58,45 @@ static char *regexbuf;
 static int rlen, rsize, dlen, dsize;
 
 #ifndef NO_REDIRECTOR
-static pid_t redirector_pid = 0;
-static int redirector_read_fd = -1, redirector_write_fd = -1;
 #define REDIRECTOR_BUFFER_SIZE 1024
-static char *redirector_buffer = NULL;
+#define MAX_REDIRECTORS 32
+
+typedef struct _Redirector {
+    pid_t pid;
+    int read_fd, write_fd;
+    char *buf;
+    int len;
+    short reading, writing, dying;
+    int inflight;
+    /* Requests written to this helper and not answered yet */
+    RedirectRequestPtr first, last;
+    char id[16];
+} RedirectorRec, *RedirectorPtr;
+
+typedef struct _RedirectCacheEntry {
+    AtomPtr url;
+    AtomPtr location;           /* NULL if not redirected */
+    time_t time;
+    struct _RedirectCacheEntry *hash_next;
+    struct _RedirectCacheEntry *previous, *next;
+} RedirectCacheEntryRec, *RedirectCacheEntryPtr;
+
+int redirectorChildren = 1;
+int redirectorConcurrency = 0;
+int redirectorCacheSize = 1024;
+int redirectorCacheTime = 60;
+
+static RedirectorRec redirectors[MAX_REDIRECTORS];
+static int redirector_id = 0;
 RedirectRequestPtr redirector_request_first = NULL,
     redirector_request_last = NULL;
+
+static RedirectCacheEntryPtr *redirectCache = NULL;
+static int redirectCacheBuckets = 0, redirectCacheCount = 0;
+static RedirectCacheEntryPtr redirectCacheFirst = NULL,
+    redirectCacheLast = NULL;
+
+static int redirectCacheAnswer(RedirectRequestPtr request);
 #endif
 
 static int atomSetterForbidden(ConfigVariablePtr, void*);
@@ -85,6 +118,17 @@ preinitForbidden(void)
     CONFIG_VARIABLE_SETTABLE(redirectorRedirectCode, CONFIG_INT,
                              configIntSetter,
                              "Redirect code to use with redirector.");
+    CONFIG_VARIABLE_SETTABLE(redirectorChildren, CONFIG_INT, configIntSetter,
+                             "Maximum number of redirector processes.");
+    CONFIG_VARIABLE_SETTABLE(redirectorConcurrency, CONFIG_INT,
+                             configIntSetter,
+                             "Requests in flight per redirector "
+                             "(concurrent protocol if > 0).");
+    CONFIG_VARIABLE_SETTABLE(redirectorCacheSize, CONFIG_INT, configIntSetter,
+                             "Number of redirector answers to cache.");
+    CONFIG_VARIABLE_SETTABLE(redirectorCacheTime, CONFIG_TIME, configIntSetter,
+                             "Time during which redirector answers "
+                             "are cached.");
 #endif
     CONFIG_VARIABLE_SETTABLE(uncachableFile, CONFIG_ATOM, atomSetterForbidden,
                              "File specifying uncachable URLs.");
@@ -465,14 +509,18 @@ urlForbidden(AtomPtr url,
         request->url = url;
         request->handler = handler;
         request->data = closure;
+        request->id = -1;
+        if(redirectCacheAnswer(request)) {
+            free(request);
+            return 1;
+        }
         if(redirector_request_first == NULL)
             redirector_request_first = request;
         else
             redirector_request_last->next = request;
         redirector_request_last = request;
         request->next = NULL;
-        if(request == redirector_request_first)
-            redirectorTrigger();
+        redirectorTrigger();
         return 1;
     }
 
@@ -504,69 +552,372 @@ logExitStatus(int status)
     }
 }
 
-void
-redirectorKill(void)
+static RedirectCacheEntryPtr
+redirectCacheFind(AtomPtr url)
+{
+    RedirectCacheEntryPtr entry;
+
+    if(redirectCache == NULL)
+        return NULL;
+
+    entry = redirectCache[url->hash & (redirectCacheBuckets - 1)];
+    while(entry) {
+        if(entry->url == url)
+            return entry;
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+static void
+redirectCacheUnlink(RedirectCacheEntryPtr entry)
+{
+    RedirectCacheEntryPtr *p;
+
+    p = &redirectCache[entry->url->hash & (redirectCacheBuckets - 1)];
+    while(*p != entry)
+        p = &(*p)->hash_next;
+    *p = entry->hash_next;
+
+    if(entry->previous)
+        entry->previous->next = entry->next;
+    else
+        redirectCacheFirst = entry->next;
+    if(entry->next)
+        entry->next->previous = entry->previous;
+    else
+        redirectCacheLast = entry->previous;
+    redirectCacheCount--;
+}
+
+static void
+redirectCacheDiscard(RedirectCacheEntryPtr entry)
+{
+    redirectCacheUnlink(entry);
+    releaseAtom(entry->url);
+    if(entry->location)
+        releaseAtom(entry->location);
+    free(entry);
+}
+
+static void
+redirectCacheFlush(void)
+{
+    while(redirectCacheFirst)
+        redirectCacheDiscard(redirectCacheFirst);
+    free(redirectCache);
+    redirectCache = NULL;
+    redirectCacheBuckets = 0;
+}
+
+/* Returns the cached answer for url, or NULL.  The entry is moved to
+   the front of the LRU list. */
+static RedirectCacheEntryPtr
+redirectCacheLookup(AtomPtr url)
+{
+    RedirectCacheEntryPtr entry;
+
+    if(redirectorCacheSize <= 0 || redirectorCacheTime <= 0)
+        return NULL;
+
+    entry = redirectCacheFind(url);
+    if(entry == NULL)
+        return NULL;
+
+    if(entry->time > current_time.tv_sec ||
+       entry->time + redirectorCacheTime <= current_time.tv_sec) {
+        redirectCacheDiscard(entry);
+        return NULL;
+    }
+
+    if(entry != redirectCacheFirst) {
+        entry->previous->next = entry->next;
+        if(entry->next)
+            entry->next->previous = entry->previous;
+        else
+            redirectCacheLast = entry->previous;
+        entry->previous = NULL;
+        entry->next = redirectCacheFirst;
+        redirectCacheFirst->previous = entry;
+        redirectCacheFirst = entry;
+    }
+    return entry;
+}
+
+static void
+redirectCacheStore(AtomPtr url, AtomPtr location)
+{
+    RedirectCacheEntryPtr entry;
+    int h;
+
+    if(redirectorCacheSize <= 0 || redirectorCacheTime <= 0)
+        return;
+
+    if(redirectCache == NULL) {
+        int n = 16;
+        while(n < redirectorCacheSize && n < 0x10000)
+            n <<= 1;
+        redirectCache = calloc(n, sizeof(RedirectCacheEntryPtr));
+        if(redirectCache == NULL)
+            return;
+        redirectCacheBuckets = n;
+    }
+
+    entry = redirectCacheFind(url);
+    if(entry)
+        redirectCacheDiscard(entry);
+
+    while(redirectCacheCount >= redirectorCacheSize && redirectCacheLast)
+        redirectCacheDiscard(redirectCacheLast);
+
+    entry = malloc(sizeof(RedirectCacheEntryRec));
+    if(entry == NULL)
+        return;
+    entry->url = retainAtom(url);
+    entry->location = location ? retainAtom(location) : NULL;
+    entry->time = current_time.tv_sec;
+
+    h = url->hash & (redirectCacheBuckets - 1);
+    entry->hash_next = redirectCache[h];
+    redirectCache[h] = entry;
+    entry->previous = NULL;
+    entry->next = redirectCacheFirst;
+    if(redirectCacheFirst)
+        redirectCacheFirst->previous = entry;
+    else
+        redirectCacheLast = entry;
+    redirectCacheFirst = entry;
+    redirectCacheCount++;
+}
+
+static int
+redirectAnswer(RedirectRequestPtr request, AtomPtr location)
+{
+    AtomPtr message, headers;
+
+    if(location == NULL) {
+        request->handler(0, request->url, NULL, NULL, request->data);
+        return 1;
+    }
+
+    message = internAtom("Redirected by external redirector");
+    if(message == NULL)
+        return -ENOMEM;
+    headers = internAtomF("\r\nLocation: %s", location->string);
+    if(headers == NULL) {
+        releaseAtom(message);
+        return -ENOMEM;
+    }
+    request->handler(redirectorRedirectCode, request->url,
+                     message, headers, request->data);
+    return 1;
+}
+
+/* Try to answer a request from the cache.  Returns 1 if the request
+   has been handled. */
+static int
+redirectCacheAnswer(RedirectRequestPtr request)
+{
+    RedirectCacheEntryPtr entry;
+    AtomPtr location;
+    int rc;
+
+    entry = redirectCacheLookup(request->url);
+    if(entry == NULL)
+        return 0;
+
+    location = entry->location ? retainAtom(entry->location) : NULL;
+    rc = redirectAnswer(request, location);
+    if(location)
+        releaseAtom(location);
+    return rc > 0;
+}
+
+static int
+redirectorCapacity(void)
+{
+    return redirectorConcurrency > 0 ? redirectorConcurrency : 1;
+}
+
+/* Close a redirector's pipes and reap it.  Must not be called while a
+   stream request is pending on it. */
+static void
+redirectorClose(RedirectorPtr r)
 {
     int rc, status, dead;
 
-    if(redirector_read_fd >= 0) {
-        rc = waitpid(redirector_pid, &status, WNOHANG);
+    assert(!r->reading && !r->writing);
+    assert(r->first == NULL);
+
+    if(r->pid > 0) {
+        rc = waitpid(r->pid, &status, WNOHANG);
         dead = (rc > 0);
-        close(redirector_read_fd);
-        redirector_read_fd = -1;
-        close(redirector_write_fd);
-        redirector_write_fd = -1;
+        close(r->read_fd);
+        r->read_fd = -1;
+        close(r->write_fd);
+        r->write_fd = -1;
         if(!dead) {
-            rc = kill(redirector_pid, SIGTERM);
-            if(rc < 0 && errno != ESRCH) {
-                do_log_error(L_ERROR, errno, "Couldn't kill redirector");
-                redirector_pid = -1;
-                return;
+            if(!r->dying) {
+                rc = kill(r->pid, SIGTERM);
+                if(rc < 0 && errno != ESRCH) {
+                    do_log_error(L_ERROR, errno, "Couldn't kill redirector");
+                    r->pid = -1;
+                    goto done;
+                }
             }
             do {
-                rc = waitpid(redirector_pid, &status, 0);
+                rc = waitpid(r->pid, &status, 0);
             } while(rc < 0 && errno == EINTR);
             if(rc < 0)
                 do_log_error(L_ERROR, errno,
                              "Couldn't wait for redirector's death");
-        } else
+        } else if(!r->dying) {
             logExitStatus(status);
-        redirector_pid = -1;
+        }
+        r->pid = -1;
     }
+
+ done:
+    r->dying = 0;
+    r->len = 0;
+    free(r->buf);
+    r->buf = NULL;
 }
 
+/* Fail all the requests in flight on r, and shut it down.  If a
+   stream request is still pending, the helper is killed and we finish
+   the job when the stream request notices. */
 static void
-redirectorDestroyRequest(RedirectRequestPtr request)
+redirectorFail(RedirectorPtr r, int status)
 {
-    assert(redirector_request_first == request);
-    redirector_request_first = request->next;
-    if(redirector_request_first == NULL)
-        redirector_request_last = NULL;
-    free(request);
+    RedirectRequestPtr request;
+
+    while(r->first) {
+        request = r->first;
+        r->first = request->next;
+        if(r->first == NULL)
+            r->last = NULL;
+        r->inflight--;
+        request->handler(status, request->url, NULL, NULL, request->data);
+        free(request);
+    }
+
+    if(r->pid <= 0)
+        return;
+
+    if(r->reading || r->writing) {
+        if(!r->dying) {
+            r->dying = 1;
+            kill(r->pid, SIGTERM);
+        }
+        return;
+    }
+
+    redirectorClose(r);
+}
+
+void
+redirectorKill(void)
+{
+    int i;
+
+    for(i = 0; i < MAX_REDIRECTORS; i++)
+        redirectorFail(&redirectors[i], -EREDIRECTOR);
+
+    redirectCacheFlush();
+}
+
+static void
+redirectorRead(RedirectorPtr r)
+{
+    r->reading = 1;
+    do_stream(IO_READ, r->read_fd, r->len,
+              r->buf, REDIRECTOR_BUFFER_SIZE,
+              redirectorStreamHandler2, r);
+}
+
+/* Pick the least loaded redirector that can accept a request right
+   now.  Running redirectors are preferred to starting a new one. */
+static RedirectorPtr
+redirectorChoose(void)
+{
+    RedirectorPtr best = NULL;
+    int i, n;
+
+    n = MAX(1, MIN(redirectorChildren, MAX_REDIRECTORS));
+    for(i = 0; i < n; i++) {
+        RedirectorPtr r = &redirectors[i];
+        if(r->dying || r->writing || r->inflight >= redirectorCapacity())
+            continue;
+        if(best == NULL || r->inflight < best->inflight ||
+           (r->inflight == best->inflight &&
+            r->pid > 0 && best->pid <= 0))
+            best = r;
+    }
+    return best;
 }
 
 void
 redirectorTrigger(void)
 {
-    RedirectRequestPtr request = redirector_request_first;
+    RedirectRequestPtr request;
+    RedirectorPtr r;
     int rc;
 
-    if(!request)
-        return;
-
-    if(redirector_read_fd < 0) {
-        rc = runRedirector(&redirector_pid,
-                           &redirector_read_fd, &redirector_write_fd);
-        if(rc < 0) {
-            request->handler(rc, request->url, NULL, NULL, request->data);
-            redirectorDestroyRequest(request);
+    while(redirector_request_first) {
+        r = redirectorChoose();
+        if(r == NULL)
             return;
+
+        request = redirector_request_first;
+
+        if(r->pid <= 0) {
+            r->buf = malloc(REDIRECTOR_BUFFER_SIZE);
+            if(r->buf == NULL)
+                rc = -ENOMEM;
+            else
+                rc = runRedirector(&r->pid, &r->read_fd, &r->write_fd);
+            if(rc < 0) {
+                free(r->buf);
+                r->buf = NULL;
+                redirector_request_first = request->next;
+                if(redirector_request_first == NULL)
+                    redirector_request_last = NULL;
+                request->handler(rc, request->url, NULL, NULL, request->data);
+                free(request);
+                continue;
+            }
+            r->len = 0;
+        }
+
+        redirector_request_first = request->next;
+        if(redirector_request_first == NULL)
+            redirector_request_last = NULL;
+        request->next = NULL;
+        if(r->last)
+            r->last->next = request;
+        else
+            r->first = request;
+        r->last = request;
+        r->inflight++;
+
+        r->writing = 1;
+        if(redirectorConcurrency > 0) {
+            request->id = redirector_id;
+            redirector_id = (redirector_id + 1) & 0x3FFFFFFF;
+            rc = snnprintf(r->id, 0, 16, "%d ", request->id);
+            do_stream_3(IO_WRITE, r->write_fd, 0,
+                        r->id, rc,
+                        request->url->string, request->url->length,
+                        "\n", 1,
+                        redirectorStreamHandler1, r);
+        } else {
+            do_stream_2(IO_WRITE, r->write_fd, 0,
+                        request->url->string, request->url->length,
+                        "\n", 1,
+                        redirectorStreamHandler1, r);
         }
     }
-    do_stream_2(IO_WRITE, redirector_write_fd, 0,
-                request->url->string, request->url->length,
-                "\n", 1,
-                redirectorStreamHandler1, request);
 }
 
 int
@@ -574,29 +925,96 @@ redirectorStreamHandler1(int status,
                          FdEventHandlerPtr event,
                          StreamRequestPtr srequest)
 {
-    RedirectRequestPtr request = (RedirectRequestPtr)srequest->data;
+    RedirectorPtr r = (RedirectorPtr)srequest->data;
 
     if(status) {
         if(status >= 0)
             status = -EPIPE;
-        do_log_error(L_ERROR, -status, "Write to redirector failed");
-        goto fail;
+        if(!r->dying)
+            do_log_error(L_ERROR, -status, "Write to redirector failed");
+        r->writing = 0;
+        redirectorFail(r, status);
+        redirectorTrigger();
+        return 1;
     }
 
     if(!streamRequestDone(srequest))
         return 0;
 
-    do_stream(IO_READ, redirector_read_fd, 0,
-              redirector_buffer, REDIRECTOR_BUFFER_SIZE,
-              redirectorStreamHandler2, request);
+    r->writing = 0;
+    if(r->dying)
+        redirectorFail(r, -EREDIRECTOR);
+    else if(!r->reading)
+        redirectorRead(r);
+    redirectorTrigger();
     return 1;
+}
 
- fail:
-    request->handler(status < 0 ? status : -EPIPE,
-                     request->url, NULL, NULL, request->data);
-    redirectorDestroyRequest(request);
-    redirectorKill();
-    return 1;
+/* Handle a single line of redirector output. */
+static int
+redirectorReply(RedirectorPtr r, char *line, int n)
+{
+    RedirectRequestPtr request, previous;
+    AtomPtr location = NULL;
+    int rc;
+
+    if(redirectorConcurrency > 0) {
+        char *end;
+        long id = strtol(line, &end, 10);
+        if(end == line) {
+            do_log(L_ERROR, "Couldn't parse redirector reply.\n");
+            return -1;
+        }
+        if(*end == ' ')
+            end++;
+        n -= end - line;
+        line = end;
+        previous = NULL;
+        request = r->first;
+        while(request && request->id != id) {
+            previous = request;
+            request = request->next;
+        }
+        if(request == NULL) {
+            do_log(L_WARN, "Redirector replied with unknown id %ld.\n", id);
+            return 0;
+        }
+    } else {
+        previous = NULL;
+        request = r->first;
+        if(request == NULL) {
+            do_log(L_WARN, "Stray bytes in redirector output.\n");
+            return 0;
+        }
+    }
+
+    if(previous)
+        previous->next = request->next;
+    else
+        r->first = request->next;
+    if(r->last == request)
+        r->last = previous;
+    r->inflight--;
+
+    if(n > 1 &&
+       (n != request->url->length ||
+        memcmp(line, request->url->string, n) != 0)) {
+        location = internAtomN(line, n);
+        if(location == NULL) {
+            request->handler(-ENOMEM, request->url, NULL, NULL, request->data);
+            free(request);
+            return 0;
+        }
+    }
+
+    redirectCacheStore(request->url, location);
+    rc = redirectAnswer(request, location);
+    if(rc < 0)
+        request->handler(rc, request->url, NULL, NULL, request->data);
+    if(location)
+        releaseAtom(location);
+    free(request);
+    return 0;
 }
 
 int
@@ -604,64 +1022,59 @@ redirectorStreamHandler2(int status,
                          FdEventHandlerPtr event,
                          StreamRequestPtr srequest)
 {
-    RedirectRequestPtr request = (RedirectRequestPtr)srequest->data;
+    RedirectorPtr r = (RedirectorPtr)srequest->data;
     char *c;
-    AtomPtr message;
-    AtomPtr headers;
-    int code;
+    int rc, consumed = 0;
 
     if(status < 0) {
-        do_log_error(L_ERROR, -status, "Read from redirector failed");
-        request->handler(status, request->url, NULL, NULL, request->data);
-        goto kill;
-    }
-    c = memchr(redirector_buffer, '\n', srequest->offset);
-    if(!c) {
-        if(!status && srequest->offset < REDIRECTOR_BUFFER_SIZE)
-            return 0;
-        do_log(L_ERROR, "Redirector returned incomplete reply.\n");
-        request->handler(-EREDIRECTOR, request->url, NULL, NULL, request->data);
-        goto kill;
+        if(!r->dying)
+            do_log_error(L_ERROR, -status, "Read from redirector failed");
+        r->reading = 0;
+        redirectorFail(r, status);
+        redirectorTrigger();
+        return 1;
     }
-    *c = '\0';
 
-    if(srequest->offset > c + 1 - redirector_buffer)
-        do_log(L_WARN, "Stray bytes in redirector output.\n");
+    r->len = srequest->offset;
+    while((c = memchr(r->buf, '\n', r->len)) != NULL) {
+        int n = c - r->buf;
+        *c = '\0';
+        rc = redirectorReply(r, r->buf, n);
+        r->len -= n + 1;
+        if(r->len > 0)
+            memmove(r->buf, c + 1, r->len);
+        consumed = 1;
+        if(rc < 0)
+            goto fail;
+    }
 
-    if(c > redirector_buffer + 1 &&
-       (c - redirector_buffer != request->url->length ||
-        memcmp(redirector_buffer, request->url->string,
-               request->url->length) != 0)) {
-        code = redirectorRedirectCode;
-        message = internAtom("Redirected by external redirector");
-        if(message == NULL) {
-            request->handler(-ENOMEM, request->url, NULL, NULL, request->data);
-            goto kill;
-        }
+    if(r->len >= REDIRECTOR_BUFFER_SIZE) {
+        do_log(L_ERROR, "Redirector returned incomplete reply.\n");
+        goto fail;
+    }
 
-        headers = internAtomF("\r\nLocation: %s", redirector_buffer);
-        if(headers == NULL) {
-            releaseAtom(message);
-            request->handler(-ENOMEM, request->url, NULL, NULL, request->data);
-            goto kill;
-        }
-    } else {
-        code = 0;
-        message = NULL;
-        headers = NULL;
+    if(status) {
+        if(r->first && !r->dying)
+            do_log(L_ERROR, "Redirector returned incomplete reply.\n");
+        goto fail;
     }
-    request->handler(code, request->url,
-                     message, headers, request->data);
-    goto cont;
 
- cont:
-    redirectorDestroyRequest(request);
+    if(!consumed)
+        return 0;
+
+    r->reading = 0;
+    if(r->dying)
+        redirectorFail(r, -EREDIRECTOR);
+    else if(r->first)
+        redirectorRead(r);
     redirectorTrigger();
     return 1;
 
- kill:
-    redirectorKill();
-    goto cont;
+ fail:
+    r->reading = 0;
+    redirectorFail(r, -EREDIRECTOR);
+    redirectorTrigger();
+    return 1;
 }
 
 int
@@ -674,12 +1087,6 @@ runRedirector(pid_t *pid_return, int *read_fd_return, int *write_fd_return)
 
     assert(redirector);
 
-    if(redirector_buffer == NULL) {
-        redirector_buffer = malloc(REDIRECTOR_BUFFER_SIZE);
-        if(redirector_buffer == NULL)
-            return -errno;
-    }
-
     rc = pipe(filedes1);
     if(rc < 0) {
         rc = -errno;
@@ -782,8 +1189,6 @@ runRedirector(pid_t *pid_return, int *read_fd_return, int *write_fd_return)
     close(filedes1[0]);
     close(filedes1[1]);
  fail1:
-    free(redirector_buffer);
-    redirector_buffer = NULL;
     return rc;
 }
 
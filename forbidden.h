@@ -25,6 +25,7 @@ extern int forbiddenRedirectCode;
 
 typedef struct _RedirectRequest {
     AtomPtr url;
+    int id;
     struct _RedirectRequest *next;
     int (*handler)(int, AtomPtr, AtomPtr, AtomPtr, void*);
     void *data;
@@ -31,6 +31,7 @@ int serverTimeout = 90;
 int serverIdleTimeout = 45;
 
 int bigBufferSize = (32 * 1024);
+int maxDiskReadAhead = (128 * 1024);
 
 AtomPtr authRealm = NULL;
 AtomPtr authCredentials = NULL;
@@ -58,6 +59,13 @@ int disableVia = 1;
 
 int proxyOffline = 0;
 int relaxTransparency = 0;
+
+/* Slot 0 holds the total time from TIME_PARSED to TIME_DONE. */
+HistogramRec requestTimes[NUM_REQUEST_TIMES];
+const char *requestTimeNames[NUM_REQUEST_TIMES] = {
+    "total", "read", "lookup", "dns", "connect", "socks",
+    "queue", "server", "reply", "transfer"
+};
 AtomPtr proxyAddress = NULL;
 
 static int timeoutSetter(ConfigVariablePtr var, void *value);
@@ -101,6 +109,8 @@ preinitHttp()
                     "Send Expect-Continue to servers.");
     CONFIG_VARIABLE(bigBufferSize, CONFIG_INT,
                     "Size of big buffers (max size of headers).");
+    CONFIG_VARIABLE_SETTABLE(maxDiskReadAhead, CONFIG_INT, configIntSetter,
+                             "Max amount of data to read ahead from disk.");
     CONFIG_VARIABLE_SETTABLE(disableVia, CONFIG_BOOLEAN, configIntSetter,
                              "Don't use Via headers.");
     CONFIG_VARIABLE(dontTrustVaryETag, CONFIG_TRISTATE,
@@ -281,21 +291,66 @@ httpTimeoutHandler(TimeEventHandlerPtr event)
     return 1;
 }
 
+static int
+headerCacheValid(ObjectHeaderCachePtr cache, ObjectPtr object)
+{
+    if(cache->headers != object->headers || cache->via != object->via ||
+       cache->date != object->date ||
+       cache->last_modified != object->last_modified ||
+       cache->expires != object->expires ||
+       cache->cache_control != object->cache_control ||
+       cache->disable_via != disableVia)
+        return 0;
+    if(cache->etag == NULL || object->etag == NULL)
+        return cache->etag == object->etag;
+    return strcmp(cache->etag, object->etag) == 0;
+}
+
+static void
+makeHeaderCache(ObjectPtr object, const char *data, int n)
+{
+    ObjectHeaderCachePtr cache;
+
+    cache = malloc(sizeof(ObjectHeaderCacheRec) + n);
+    if(cache == NULL)
+        return;
+    cache->etag = NULL;
+    if(object->etag) {
+        cache->etag = strdup(object->etag);
+        if(cache->etag == NULL) {
+            free(cache);
+            return;
+        }
+    }
+    /* The cache holds references, so a pointer comparison is enough. */
+    cache->headers = retainAtom(object->headers);
+    cache->via = retainAtom(object->via);
+    cache->date = object->date;
+    cache->last_modified = object->last_modified;
+    cache->expires = object->expires;
+    cache->cache_control = object->cache_control;
+    cache->disable_via = disableVia;
+    memcpy(cache->data, data, n);
+    cache->length = n;
+    object->header_cache = cache;
+}
+
 int
 httpWriteObjectHeaders(char *buf, int offset, int len,
-                       ObjectPtr object, int from, int to)
+                       ObjectPtr object, long long from, long long to)
 {
     int n = offset;
+    int start = -1;
 
     if(from <= 0 && to < 0) {
         if(object->length >= 0) {
             n = snnprintf(buf, n, len,
-                          "\r\nContent-Length: %d", object->length);
+                          "\r\nContent-Length: %lld", object->length);
         }
     } else {
         if(to >= 0) {
             n = snnprintf(buf, n, len,
-                          "\r\nContent-Length: %d", to - from);
+                          "\r\nContent-Length: %lld", to - from);
         }
     }
 
@@ -303,27 +358,40 @@ httpWriteObjectHeaders(char *buf, int offset, int len,
         if(object->length >= 0) {
             if(from >= to) {
                 n = snnprintf(buf, n, len,
-                              "\r\nContent-Range: bytes */%d",
+                              "\r\nContent-Range: bytes */%lld",
                               object->length);
             } else {
                 n = snnprintf(buf, n, len,
-                              "\r\nContent-Range: bytes %d-%d/%d",
+                              "\r\nContent-Range: bytes %lld-%lld/%lld",
                               from, to - 1, 
                               object->length);
             }
         } else {
             if(to >= 0) {
                 n = snnprintf(buf, n, len,
-                              "\r\nContent-Range: bytes %d-/*",
+                              "\r\nContent-Range: bytes %lld-/*",
                               from);
             } else {
                 n = snnprintf(buf, n, len,
-                              "\r\nContent-Range: bytes %d-%d/*",
+                              "\r\nContent-Range: bytes %lld-%lld/*",
                               from, to);
             }
         }
     }
         
+    if(!(object->flags & OBJECT_LOCAL)) {
+        /* Everything below depends only on the object. */
+        ObjectHeaderCachePtr cache = object->header_cache;
+        if(cache && headerCacheValid(cache, object)) {
+            if(n < 0 || n + cache->length >= len)
+                return -1;
+            memcpy(buf + n, cache->data, cache->length);
+            return n + cache->length;
+        }
+        discardObjectHeaderCache(object);
+        start = n;
+    }
+
     if(object->etag) {
         n = snnprintf(buf, n, len, "\r\nETag: \"%s\"", object->etag);
     }
@@ -362,11 +430,14 @@ httpWriteObjectHeaders(char *buf, int offset, int len,
         n = snnprint_n(buf, n, len, object->headers->string,
                        object->headers->length);
 
-    if(n < len)
-        return n;
-    else
+    if(n >= len)
         return -1;
 
+    if(start >= 0 && n >= 0)
+        makeHeaderCache(object, buf + start, n - start);
+
+    return n;
+
  fail:
     return -1;
 }
@@ -572,7 +643,13 @@ httpMakeConnection()
     connection->server = NULL;
     connection->pipelined = 0;
     connection->connecting = 0;
+    connection->start = current_time;
+    connection->peer = NULL;
+    connection->resolved = null_time;
+    connection->connected = null_time;
     connection->server = NULL;
+    connection->readahead = 0;
+    connection->readahead_offset = -1;
     return connection;
 }
 
@@ -619,6 +696,8 @@ HTTPRequestPtr
 httpMakeRequest()
 {
     HTTPRequestPtr request;
+    int i;
+
     request = malloc(sizeof(HTTPRequestRec));
     if(request == NULL)
         return NULL;
@@ -639,11 +718,45 @@ httpMakeRequest()
     request->headers = NULL;
     request->time0 = null_time;
     request->time1 = null_time;
+    for(i = 0; i < NUM_REQUEST_TIMES; i++)
+        request->times[i] = null_time;
+    request->result = RESULT_NONE;
+    request->detached = -1;
     request->request = NULL;
     request->next = NULL;
     return request;
 }
 
+void
+httpRequestTime(HTTPRequestPtr request, int which)
+{
+    if(request->times[which].tv_sec == null_time.tv_sec)
+        request->times[which] = current_time;
+}
+
+void
+httpRecordRequestTimes(HTTPRequestPtr request)
+{
+    struct timeval *last = NULL;
+    int i;
+
+    for(i = 0; i < NUM_REQUEST_TIMES; i++) {
+        if(request->times[i].tv_sec == null_time.tv_sec)
+            continue;
+        if(last)
+            histogramRecord(&requestTimes[i],
+                            MAX(timeval_minus_usec(&request->times[i], last),
+                                0));
+        last = &request->times[i];
+    }
+
+    if(request->times[TIME_PARSED].tv_sec != null_time.tv_sec &&
+       request->times[TIME_DONE].tv_sec != null_time.tv_sec)
+        histogramRecord(&requestTimes[0],
+                        timeval_minus_usec(&request->times[TIME_DONE],
+                                           &request->times[TIME_PARSED]));
+}
+
 void
 httpDestroyRequest(HTTPRequestPtr request)
 {
@@ -1022,12 +1135,22 @@ httpTweakCachability(ObjectPtr object)
     if(code != 200 && code != 206 && 
        code != 300 && code != 301 && code != 302 && code != 303 &&
        code != 304 && code != 307 &&
-       code != 403 && code != 404 && code != 405 && code != 416) {
+       code != 403 && code != 404 && code != 405 && code != 410 &&
+       code != 416 &&
+       !(SERVER_ERROR_CODE(code) && negativeErrorTime > 0)) {
         object->cache_control |= (CACHE_NO_HIDDEN | CACHE_MISMATCH);
         object->flags |= OBJECT_LINEAR;
+    } else if(NEGATIVE_CODE(code)) {
+        /* Negative replies are cachable by default (RFC 7231 6.1);
+           objectIsStale keeps them for negativeCacheTime, or
+           negativeErrorTime for server errors. */
+        int t = SERVER_ERROR_CODE(code) ? negativeErrorTime : negativeCacheTime;
+        if(t <= 0 &&
+           object->expires < 0 && object->max_age < 0 &&
+           object->s_maxage < 0 && !(object->cache_control & CACHE_PUBLIC))
+            object->cache_control |= CACHE_NO_HIDDEN;
     } else if(code != 200 && code != 206 &&
-              code != 300 && code != 301 && code != 304 &&
-              code != 410) {
+              code != 300 && code != 301 && code != 304) {
         if(object->expires < 0 && !(object->cache_control & CACHE_PUBLIC)) {
             object->cache_control |= CACHE_NO_HIDDEN;
         }
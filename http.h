@@ -28,13 +28,27 @@ typedef struct _HTTPCondition {
     char *ifrange;
 } HTTPConditionRec, *HTTPConditionPtr;
 
+/* Client requests record when they reach each of these points; the
+   time between two successive points is accounted to the latter. */
+#define TIME_ACCEPT 0
+#define TIME_PARSED 1
+#define TIME_LOOKUP 2
+#define TIME_DNS 3
+#define TIME_CONNECT 4
+#define TIME_SOCKS 5
+#define TIME_SENT 6
+#define TIME_UPSTREAM 7
+#define TIME_REPLY 8
+#define TIME_DONE 9
+#define NUM_REQUEST_TIMES 10
+
 typedef struct _HTTPRequest {
     int flags;
     struct _HTTPConnection *connection;
     ObjectPtr object;
     int method;
-    int from;
-    int to;
+    long long from;
+    long long to;
     CacheControlRec cache_control;
     HTTPConditionPtr condition;
     AtomPtr via;
@@ -45,23 +59,34 @@ typedef struct _HTTPRequest {
     struct _Atom *error_headers;
     AtomPtr headers;
     struct timeval time0, time1;
+    struct timeval times[NUM_REQUEST_TIMES];
+    int result;
+    long long detached;
     struct _HTTPRequest *request;
     struct _HTTPRequest *next;
 } HTTPRequestRec, *HTTPRequestPtr;
 
+/* request->result, for the access log */
+#define RESULT_NONE 0
+#define RESULT_HIT 1
+#define RESULT_MISS 2
+#define RESULT_REVALIDATE 3
+#define RESULT_LOCAL 4
+
 /* request->flags */
 #define REQUEST_PERSISTENT 1
 #define REQUEST_REQUESTED 2
 #define REQUEST_WAIT_CONTINUE 4
 #define REQUEST_FORCE_ERROR 8
 #define REQUEST_PIPELINED 16
+#define REQUEST_DETACHED 32
 
 typedef struct _HTTPConnection {
     int flags;
     int fd;
     char *buf;
     int len;
-    int offset;
+    long long offset;
     HTTPRequestPtr request;
     HTTPRequestPtr request_last;
     int serviced;
@@ -80,6 +105,11 @@ typedef struct _HTTPConnection {
     struct _HTTPServer *server;
     int pipelined;
     int connecting;
+    struct timeval start, resolved, connected;
+    AtomPtr peer;
+    /* For client connections serving from the on-disk cache */
+    int readahead;
+    long long readahead_offset;
 } HTTPConnectionRec, *HTTPConnectionPtr;
 
 /* connection->flags */
@@ -126,6 +156,7 @@ extern AtomPtr proxyName;
 extern int proxyPort;
 extern int clientTimeout, serverTimeout, serverIdleTimeout;
 extern int bigBufferSize;
+extern int maxDiskReadAhead;
 extern AtomPtr proxyAddress;
 extern int proxyOffline;
 extern int relaxTransparency;
@@ -140,6 +171,8 @@ extern int expectContinue;
 extern AtomPtr atom100Continue;
 extern int disableVia;
 extern int dontTrustVaryETag;
+extern HistogramRec requestTimes[NUM_REQUEST_TIMES];
+extern const char *requestTimeNames[NUM_REQUEST_TIMES];
 
 void preinitHttp(void);
 void initHttp(void);
@@ -147,7 +180,7 @@ void initHttp(void);
 int httpTimeoutHandler(TimeEventHandlerPtr);
 int httpSetTimeout(HTTPConnectionPtr connection, int secs);
 int httpWriteObjectHeaders(char *buf, int offset, int len, 
-                           ObjectPtr object, int from, int to);
+                           ObjectPtr object, long long from, long long to);
 int httpPrintCacheControl(char*, int, int, int, CacheControlPtr);
 char *httpMessage(int) ATTRIBUTE((pure));
 int htmlString(char *buf, int n, int len, char *s, int slen);
@@ -159,6 +192,8 @@ void httpConnectionDestroyReqbuf(HTTPConnectionPtr connection);
 HTTPRequestPtr httpMakeRequest(void);
 void httpDestroyRequest(HTTPRequestPtr request);
 void httpQueueRequest(HTTPConnectionPtr, HTTPRequestPtr);
+void httpRequestTime(HTTPRequestPtr request, int which);
+void httpRecordRequestTimes(HTTPRequestPtr request);
 HTTPRequestPtr httpDequeueRequest(HTTPConnectionPtr connection);
 int httpConnectionBigify(HTTPConnectionPtr);
 int httpConnectionBigifyReqbuf(HTTPConnectionPtr);
@@ -22,6 +22,10 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
 static int getNextWord(const char *buf, int i, int *x_return, int *y_return);
 static int getNextToken(const char *buf, int i, int *x_return, int *y_return);
 static int getNextTokenInList(const char *buf, int i, 
@@ -43,6 +47,75 @@ static AtomPtr atomConnection, atomProxyConnection, atomContentLength,
 
 AtomPtr atomContentType, atomContentEncoding;
 
+static AtomPtr atomAccept, atomAcceptEncoding, atomAcceptLanguage,
+    atomUserAgent, atomServer;
+
+/* Header names that we know about are looked up in a collision-free
+   hash table built at startup, so that parsing them requires neither
+   a lowercase copy nor a trip through the atom table.  Since the
+   entries are the interned atoms themselves, the result can be
+   compared by pointer just like any other atom. */
+
+#define LOG2_HEADER_TABLE_SIZE 8
+#define MAX_KNOWN_HEADERS 64
+#define MAX_KNOWN_HEADER_LENGTH 32
+
+static AtomPtr knownHeaders[MAX_KNOWN_HEADERS];
+static int numKnownHeaders = 0;
+static AtomPtr headerTable[1 << LOG2_HEADER_TABLE_SIZE];
+static unsigned int headerTableSeed;
+
+/* Header names consist of letters, digits and hyphens; or-ing with 0x20
+   lowercases letters and leaves the others alone.  Any other character
+   is mangled, but that's fine since we check for equality afterwards. */
+static unsigned int
+headerHash(unsigned int seed, const char *buf, int n)
+{
+    unsigned int h = seed ^ n;
+    int i;
+    for(i = 0; i < n; i++)
+        h = h * 33 + ((unsigned char)buf[i] | 0x20);
+    return (h ^ (h >> 13)) & ((1 << LOG2_HEADER_TABLE_SIZE) - 1);
+}
+
+static int
+buildHeaderTable()
+{
+    unsigned int seed;
+    int i, h;
+
+    for(seed = 0; seed < 100000; seed++) {
+        memset(headerTable, 0, sizeof(headerTable));
+        for(i = 0; i < numKnownHeaders; i++) {
+            h = headerHash(seed, knownHeaders[i]->string,
+                           knownHeaders[i]->length);
+            if(headerTable[h])
+                break;
+            headerTable[h] = knownHeaders[i];
+        }
+        if(i >= numKnownHeaders) {
+            headerTableSeed = seed;
+            return 1;
+        }
+    }
+    memset(headerTable, 0, sizeof(headerTable));
+    return -1;
+}
+
+/* Returns the (non-retained) atom for a known header name, or NULL. */
+static AtomPtr
+knownHeaderName(const char *buf, int n)
+{
+    AtomPtr atom;
+
+    if(n <= 0 || n > MAX_KNOWN_HEADER_LENGTH)
+        return NULL;
+    atom = headerTable[headerHash(headerTableSeed, buf, n)];
+    if(atom == NULL || atom->length != n || lwrcmp(atom->string, buf, n) != 0)
+        return NULL;
+    return atom;
+}
+
 int censorReferer = 0;
 int laxHttpParser = 1;
 
@@ -67,7 +140,12 @@ preinitHttpParser()
 void
 initHttpParser()
 {
-#define A(name, value) name = internAtom(value); if(!name) goto fail;
+#define A(name, value) \
+    name = internAtom(value); \
+    if(!name) goto fail; \
+    assert(numKnownHeaders < MAX_KNOWN_HEADERS && \
+           name->length <= MAX_KNOWN_HEADER_LENGTH); \
+    knownHeaders[numKnownHeaders++] = name;
     /* These must be in lower-case */
     A(atomConnection, "connection");
     A(atomProxyConnection, "proxy-connection");
@@ -109,7 +187,15 @@ initHttpParser()
     A(atomXPolipoAccess, "x-polipo-access");
     A(atomXPolipoLocation, "x-polipo-location");
     A(atomXPolipoBodyOffset, "x-polipo-body-offset");
+    /* Not interpreted, but common enough to be worth a slot. */
+    A(atomAccept, "accept");
+    A(atomAcceptEncoding, "accept-encoding");
+    A(atomAcceptLanguage, "accept-language");
+    A(atomUserAgent, "user-agent");
+    A(atomServer, "server");
 #undef A
+    if(buildHeaderTable() < 0)
+        do_log(L_WARN, "Couldn't build header hash table.\n");
     return;
 
  fail:
@@ -497,12 +583,15 @@ httpParseServerFirstLine(const char *restrict buf,
 }
 
 static int
-parseInt(const char *restrict buf, int start, int *val_return)
+parseInt(const char *restrict buf, int start, long long *val_return)
 {
-    int i = start, val = 0;
+    int i = start;
+    long long val = 0;
     if(!digit(buf[i]))
         return -1;
     while(digit(buf[i])) {
+        if(val > (LLONG_MAX - 9) / 10)
+            return -1;
         val = val * 10 + (buf[i] - '0');
         i++;
     }
@@ -563,13 +652,49 @@ parseHeaderLine(const char *restrict buf, int start,
     return i;
 }
 
+/* Returns the index of the first CR or LF in buf[i..to), or to. */
+
+#if defined(__SSE2__) && defined(__GNUC__)
+
+static int
+scanEol(const char *restrict buf, int i, int to)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    while(i + 16 <= to) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+        if(mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    while(i < to && buf[i] != '\r' && buf[i] != '\n')
+        i++;
+    return i;
+}
+
+#else
+
+static int
+scanEol(const char *restrict buf, int i, int to)
+{
+    while(i < to && buf[i] != '\r' && buf[i] != '\n')
+        i++;
+    return i;
+}
+
+#endif
+
 int
 findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return) 
 {
     int i = from;
     int eol = 0;
     while(i < to) {
-        if(buf[i] == '\n') {
+        if(buf[i] != '\n' && buf[i] != '\r') {
+            eol = 0;
+            i = scanEol(buf, i + 1, to);
+        } else if(buf[i] == '\n') {
             if(eol) {
                 *body_return = i + 1;
                 return eol;
@@ -588,9 +713,6 @@ findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return)
                 eol = 0;
                 i++;
             }
-        } else {
-            eol = 0;
-            i++;
         }
     }
     return -1;
@@ -598,10 +720,11 @@ findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return)
 
 static int
 parseContentRange(const char *restrict buf, int i, 
-                  int *from_return, int *to_return, int *full_len_return)
+                  long long *from_return, long long *to_return,
+                  long long *full_len_return)
 {
     int j;
-    int from, to, full_len;
+    long long from, to, full_len;
 
     i = skipWhitespace(buf, i);
     if(i < 0) return -1;
@@ -645,10 +768,10 @@ parseContentRange(const char *restrict buf, int i,
 
 static int
 parseRange(const char *restrict buf, int i, 
-           int *from_return, int *to_return)
+           long long *from_return, long long *to_return)
 {
     int j;
-    int from, to;
+    long long from, to;
 
     i = skipWhitespace(buf, i);
     if(i < 0)
@@ -747,7 +870,7 @@ int
 httpParseHeaders(int client, AtomPtr url,
                  const char *buf, int start, HTTPRequestPtr request,
                  AtomPtr *headers_return,
-                 int *len_return, CacheControlPtr cache_control_return,
+                 long long *len_return, CacheControlPtr cache_control_return,
                  HTTPConditionPtr *condition_return, int *te_return,
                  time_t *date_return, time_t *last_modified_return,
                  time_t *expires_return, time_t *polipo_age_return,
@@ -765,9 +888,10 @@ httpParseHeaders(int client, AtomPtr url,
         name_start, name_end, value_start, value_end, 
         token_start, token_end, end;
     AtomPtr name = NULL;
+    int name_interned = 0;
     time_t date = -1, last_modified = -1, expires = -1, polipo_age = -1,
         polipo_access = -1, polipo_body_offset = -1;
-    int len = -1;
+    long long len = -1;
     CacheControlRec cache_control;
     char *endptr;
     int te = TE_IDENTITY;
@@ -814,7 +938,7 @@ httpParseHeaders(int client, AtomPtr url,
         if(name_start < 0)
             continue;
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
+        name = knownHeaderName(buf + name_start, name_end - name_start);
 
         if(name == atomConnection) {
             j = getNextTokenInList(buf, value_start, 
@@ -853,7 +977,6 @@ httpParseHeaders(int client, AtomPtr url,
         } else if(name == atomCacheControl)
             haveCacheControl = 1;
 
-        releaseAtom(name);
         name = NULL;
     }
     
@@ -878,8 +1001,13 @@ httpParseHeaders(int client, AtomPtr url,
                 goto fail;
         }
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
-        
+        name = knownHeaderName(buf + name_start, name_end - name_start);
+        name_interned = 0;
+        if(name == NULL) {
+            name = internAtomLowerN(buf + name_start, name_end - name_start);
+            name_interned = 1;
+        }
+
         if(name == atomProxyConnection) {
             j = getNextTokenInList(buf, value_start, 
                                    &token_start, &token_end, NULL, NULL,
@@ -914,7 +1042,7 @@ httpParseHeaders(int client, AtomPtr url,
                 len = -1;
             } else {
                 errno = 0;
-                len = strtol(buf + value_start, &endptr, 10);
+                len = strtoll(buf + value_start, &endptr, 10);
                 if(errno == ERANGE || endptr <= buf + value_start) {
                     do_log(L_WARN, "Couldn't parse Content-Length: \n");
                     do_log_n(L_WARN, buf + value_start, 
@@ -1270,7 +1398,8 @@ httpParseHeaders(int client, AtomPtr url,
                 }
             }
         }
-        releaseAtom(name);
+        if(name_interned)
+            releaseAtom(name);
         name = NULL;
     }
 
@@ -1360,7 +1489,7 @@ httpParseHeaders(int client, AtomPtr url,
 
  fail:
     if(hbuf && hbuf != hbuf_small) free(hbuf);
-    if(name) releaseAtom(name);
+    if(name && name_interned) releaseAtom(name);
     if(etag) free(etag);
     if(location) free(location);
     if(via) releaseAtom(via);
@@ -21,9 +21,9 @@ THE SOFTWARE.
 */
 
 typedef struct HTTPRange {
-    int from;
-    int to;
-    int full_length;
+    long long from;
+    long long to;
+    long long full_length;
 } HTTPRangeRec, *HTTPRangePtr;
 
 extern int censorReferer;
@@ -43,7 +43,7 @@ int httpParseServerFirstLine(const char *buf,
 int findEndOfHeaders(const char *buf, int from, int to, int *body_return);
 
 int httpParseHeaders(int, AtomPtr, const char *, int, HTTPRequestPtr,
-                     AtomPtr*, int*, CacheControlPtr, 
+                     AtomPtr*, long long*, CacheControlPtr, 
                      HTTPConditionPtr *, int*,
                      time_t*, time_t*, time_t*, time_t*, time_t*,
                      int*, int*, char**, AtomPtr*,
@@ -32,9 +32,47 @@ THE SOFTWARE.
 int useTemporarySourceAddress = 1;
 #endif
 
+int connectionAttemptDelay = 250;
+
+/* When a host has multiple addresses, we race connections to them,
+   starting a new attempt every connectionAttemptDelay milliseconds
+   until one of them succeeds (RFC 8305).  The winning address is
+   remembered, indexed by the address list, so that the next connection
+   starts with it. */
+
+typedef struct _ConnectRace {
+    AtomPtr addr;
+    int firstindex;
+    int port;
+    int n;
+    int next;
+    int pending;
+    int busy;
+    int done;
+    int error;
+    int *order;
+    FdEventHandlerPtr *attempts;
+    TimeEventHandlerPtr timer;
+    int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr);
+    void *data;
+} ConnectRaceRec, *ConnectRacePtr;
+
+#define CONNECT_PREFERENCES 64
+
+static struct {
+    AtomPtr addr;
+    int index;
+} connectPreferences[CONNECT_PREFERENCES];
+
+static int connectRaceHandler(int, FdEventHandlerPtr, ConnectRequestPtr);
+
 void
 preinitIo()
 {
+    CONFIG_VARIABLE_SETTABLE(connectionAttemptDelay, CONFIG_INT,
+                             configIntSetter,
+                             "Delay in ms before trying the next address "
+                             "of a host (0 to try them in turn).");
 #ifdef HAVE_IPV6_PREFER_TEMPADDR
     CONFIG_VARIABLE_SETTABLE(useTemporarySourceAddress, CONFIG_TRISTATE,
                              configIntSetter,
@@ -61,63 +99,65 @@ initIo()
 }
 
 FdEventHandlerPtr
-do_stream(int operation, int fd, int offset, char *buf, int len,
-          int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-          void *data)
+do_stream_named(int operation, int fd, int offset, char *buf, int len,
+                int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                const char *name, void *data)
 {
     assert(len > offset || (operation & (IO_END | IO_IMMEDIATE)));
     return schedule_stream(operation, fd, offset, 
                            NULL, 0, buf, len, NULL, 0, NULL, 0, NULL,
-                           handler, data);
+                           handler, name, data);
 }
 
 FdEventHandlerPtr
-do_stream_2(int operation, int fd, int offset, 
-            char *buf, int len, char *buf2, int len2,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data)
+do_stream_2_named(int operation, int fd, int offset, 
+                  char *buf, int len, char *buf2, int len2,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data)
 {
     assert(len + len2 > offset || (operation & (IO_END | IO_IMMEDIATE)));
     return schedule_stream(operation, fd, offset,
                            NULL, 0, buf, len, buf2, len2, NULL, 0, NULL,
-                           handler, data);
+                           handler, name, data);
 }
 
 FdEventHandlerPtr
-do_stream_3(int operation, int fd, int offset, 
-            char *buf, int len, char *buf2, int len2, char *buf3, int len3,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data)
+do_stream_3_named(int operation, int fd, int offset, 
+                  char *buf, int len, char *buf2, int len2,
+                  char *buf3, int len3,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data)
 {
     assert(len + len2 > offset || (operation & (IO_END | IO_IMMEDIATE)));
     return schedule_stream(operation, fd, offset,
                            NULL, 0, buf, len, buf2, len2, buf3, len3, NULL,
-                           handler, data);
+                           handler, name, data);
 }
 
 FdEventHandlerPtr
-do_stream_h(int operation, int fd, int offset,
-            char *header, int hlen, char *buf, int len,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data)
+do_stream_h_named(int operation, int fd, int offset,
+                  char *header, int hlen, char *buf, int len,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data)
 {
     assert(hlen + len > offset || (operation & (IO_END | IO_IMMEDIATE)));
     return schedule_stream(operation, fd, offset, 
                            header, hlen, buf, len, NULL, 0, NULL, 0, NULL,
-                           handler, data);
+                           handler, name, data);
 }
 
 FdEventHandlerPtr
-do_stream_buf(int operation, int fd, int offset, char **buf_location, int len,
-              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-              void *data)
+do_stream_buf_named(int operation, int fd, int offset,
+                    char **buf_location, int len,
+                    int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                    const char *name, void *data)
 {
     assert((len > offset || (operation & (IO_END | IO_IMMEDIATE)))
            && len <= CHUNK_SIZE);
     return schedule_stream(operation, fd, offset,
                            NULL, 0, *buf_location, len, 
                            NULL, 0, NULL, 0, buf_location,
-                           handler, data);
+                           handler, name, data);
 }
 
 static int
@@ -154,7 +194,7 @@ schedule_stream(int operation, int fd, int offset,
                 char *buf, int len, char *buf2, int len2, char *buf3, int len3,
                 char **buf_location,
                 int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-                void *data)
+                const char *name, void *data)
 {
     StreamRequestRec request;
     FdEventHandlerPtr event;
@@ -190,11 +230,13 @@ schedule_stream(int operation, int fd, int offset,
     }
     request.handler = handler;
     request.data = data;
-    event = makeFdEvent(fd, 
-                        (operation & IO_MASK) == IO_WRITE ?
-                        POLLOUT : POLLIN, 
-                        do_scheduled_stream, 
-                        sizeof(StreamRequestRec), &request);
+    /* Named after the completion handler, so that the profiler can tell
+       streams apart. */
+    event = makeFdEventNamed(fd, 
+                             (operation & IO_MASK) == IO_WRITE ?
+                             POLLOUT : POLLIN, 
+                             do_scheduled_stream, name,
+                             sizeof(StreamRequestRec), &request);
     if(!event) {
         done = (*handler)(-ENOMEM, NULL, &request);
         assert(done);
@@ -444,21 +486,279 @@ serverSocket(int af)
     return fd;
 }
 
+static int
+connectPreference(AtomPtr addr, int index)
+{
+    int i = addr->hash % CONNECT_PREFERENCES;
+    if(connectPreferences[i].addr == addr)
+        return connectPreferences[i].index;
+    return index;
+}
+
+static void
+rememberConnectPreference(AtomPtr addr, int index)
+{
+    int i = addr->hash % CONNECT_PREFERENCES;
+    if(connectPreferences[i].addr != addr) {
+        if(connectPreferences[i].addr)
+            releaseAtom(connectPreferences[i].addr);
+        connectPreferences[i].addr = retainAtom(addr);
+    }
+    connectPreferences[i].index = index;
+}
+
+static void
+discardConnectRace(ConnectRacePtr race)
+{
+    releaseAtom(race->addr);
+    free(race->order);
+    free(race->attempts);
+    free(race);
+}
+
+static void
+connectRaceFinish(ConnectRacePtr race, int status,
+                  FdEventHandlerPtr event, ConnectRequestPtr winner)
+{
+    ConnectRequestRec request;
+    int i, done;
+
+    if(race->timer) {
+        cancelTimeEvent(race->timer);
+        race->timer = NULL;
+    }
+
+    for(i = 0; i < race->n; i++) {
+        FdEventHandlerPtr attempt = race->attempts[i];
+        if(attempt && attempt != event) {
+            ConnectRequestPtr r = (ConnectRequestPtr)&attempt->data;
+            CLOSE(r->fd);
+            releaseAtom(r->addr);
+            unregisterFdEvent(attempt);
+        }
+        race->attempts[i] = NULL;
+    }
+    race->pending = 0;
+
+    if(winner) {
+        request = *winner;
+        rememberConnectPreference(race->addr, winner->index);
+    } else {
+        request.fd = -1;
+        request.index = race->order[0];
+        request.af = race->addr->string[1 + request.index *
+                                        sizeof(HostAddressRec)];
+    }
+    request.addr = race->addr;
+    request.firstindex = race->firstindex;
+    request.port = race->port;
+    request.handler = race->handler;
+    request.data = race->data;
+
+    race->done = 1;
+    done = race->handler(status, event, &request);
+    assert(done);
+}
+
+/* Start the next attempt, and carry on immediately if it fails straight
+   away.  Returns 1 if the race is over, in which case it has been freed. */
+
+static int
+connectRaceStart(ConnectRacePtr race)
+{
+    ConnectRequestRec request;
+    FdEventHandlerPtr event;
+    int i, index, done;
+
+    race->busy++;
+    while(!race->done && race->next < race->n) {
+        i = race->next++;
+        index = race->order[i];
+        request.af = race->addr->string[1 + index * sizeof(HostAddressRec)];
+        request.fd = serverSocket(request.af);
+        if(request.fd < 0) {
+            race->error = -errno;
+            continue;
+        }
+        request.addr = retainAtom(race->addr);
+        request.index = index;
+        /* Prevent do_scheduled_connect from walking the address list
+           on its own. */
+        request.firstindex = (index + 1) % race->n;
+        request.port = race->port;
+        request.handler = connectRaceHandler;
+        request.data = race;
+        event = registerFdEvent(request.fd, POLLIN | POLLOUT,
+                                do_scheduled_connect,
+                                sizeof(ConnectRequestRec), &request);
+        if(event == NULL) {
+            CLOSE(request.fd);
+            releaseAtom(request.addr);
+            race->error = -ENOMEM;
+            continue;
+        }
+        race->attempts[i] = event;
+        race->pending++;
+        done = event->handler(0, event);
+        if(done)
+            unregisterFdEvent(event);
+        else
+            break;
+    }
+    race->busy--;
+
+    if(!race->done && race->pending == 0 && race->next >= race->n)
+        connectRaceFinish(race, race->error ? race->error : -ECONNREFUSED,
+                          NULL, NULL);
+
+    if(race->done) {
+        discardConnectRace(race);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+connectRaceTimeout(TimeEventHandlerPtr event)
+{
+    ConnectRacePtr race = *(ConnectRacePtr*)event->data;
+    int done;
+
+    race->timer = NULL;
+    done = connectRaceStart(race);
+    if(!done && race->next < race->n)
+        race->timer = scheduleTimeEventMsec(connectionAttemptDelay,
+                                            connectRaceTimeout,
+                                            sizeof(race), &race);
+    return 1;
+}
+
+static int
+connectRaceHandler(int status, FdEventHandlerPtr event,
+                   ConnectRequestPtr request)
+{
+    ConnectRacePtr race = request->data;
+    int i, done;
+
+    for(i = 0; i < race->n; i++)
+        if(race->attempts[i] == event)
+            break;
+    assert(i < race->n);
+
+    if(status > 0) {
+        race->attempts[i] = NULL;
+        race->pending--;
+        connectRaceFinish(race, status, event, request);
+        if(!race->busy)
+            discardConnectRace(race);
+        return 1;
+    }
+
+    do_log_error(D_SERVER_CONN, -status, "Connection attempt failed");
+    CLOSE(request->fd);
+    request->fd = -1;
+    race->attempts[i] = NULL;
+    race->pending--;
+    race->error = status;
+    if(race->busy)
+        return 1;
+
+    /* Don't wait for the timer, try the next address right now. */
+    if(race->timer) {
+        cancelTimeEvent(race->timer);
+        race->timer = NULL;
+    }
+    done = connectRaceStart(race);
+    if(!done && race->next < race->n)
+        race->timer = scheduleTimeEventMsec(connectionAttemptDelay,
+                                            connectRaceTimeout,
+                                            sizeof(race), &race);
+    return 1;
+}
+
+static int
+connectRaceNext(ConnectRacePtr race, int index, int *cursor, int af, int same)
+{
+    while(*cursor < race->n) {
+        int ix = (index + (*cursor)++) % race->n;
+        if((race->addr->string[1 + ix * sizeof(HostAddressRec)] == af) == same)
+            return ix;
+    }
+    return -1;
+}
+
+/* Order the addresses starting with the preferred one, alternating
+   address families. */
+
+static void
+connectRaceOrder(ConnectRacePtr race, int index)
+{
+    int i, ix, same, af;
+    int cursor[2] = {0, 0};
+
+    af = race->addr->string[1 + index * sizeof(HostAddressRec)];
+    for(i = 0; i < race->n; i++) {
+        same = (i % 2 == 0);
+        ix = connectRaceNext(race, index, &cursor[same], af, same);
+        if(ix < 0)
+            ix = connectRaceNext(race, index, &cursor[!same], af, !same);
+        assert(ix >= 0);
+        race->order[i] = ix;
+    }
+}
+
 FdEventHandlerPtr
 do_connect(AtomPtr addr, int index, int port,
            int (*handler)(int, FdEventHandlerPtr, ConnectRequestPtr),
            void *data)
 {
     ConnectRequestRec request;
+    ConnectRacePtr race;
     FdEventHandlerPtr event;
-    int done, fd, af;
+    int done, fd, af, n;
 
     assert(addr->length > 0 && addr->string[0] == DNS_A);
     assert(addr->length % sizeof(HostAddressRec) == 1);
 
-    if(index >= (addr->length - 1)/ sizeof(HostAddressRec))
+    n = (addr->length - 1) / sizeof(HostAddressRec);
+    index = connectPreference(addr, index);
+    if(index < 0 || index >= n)
         index = 0;
 
+    if(n > 1 && connectionAttemptDelay > 0) {
+        race = malloc(sizeof(ConnectRaceRec));
+        if(race == NULL)
+            goto serial;
+        race->order = malloc(n * sizeof(int));
+        race->attempts = calloc(n, sizeof(FdEventHandlerPtr));
+        if(race->order == NULL || race->attempts == NULL) {
+            free(race->order);
+            free(race->attempts);
+            free(race);
+            goto serial;
+        }
+        race->addr = addr;
+        race->firstindex = index;
+        race->port = port;
+        race->n = n;
+        race->next = 0;
+        race->pending = 0;
+        race->busy = 0;
+        race->done = 0;
+        race->error = 0;
+        race->timer = NULL;
+        race->handler = handler;
+        race->data = data;
+        connectRaceOrder(race, index);
+        done = connectRaceStart(race);
+        if(!done && race->next < race->n)
+            race->timer = scheduleTimeEventMsec(connectionAttemptDelay,
+                                                connectRaceTimeout,
+                                                sizeof(race), &race);
+        return NULL;
+    }
+
+ serial:
     request.firstindex = index;
     request.port = port;
     request.handler = handler;
@@ -473,7 +773,6 @@ do_connect(AtomPtr addr, int index, int port,
     request.index = index;
 
     if(fd < 0) {
-        int n = (addr->length - 1) / sizeof(HostAddressRec);
         if(errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT) {
             if((index + 1) % n != request.firstindex) {
                 index = (index + 1) % n;
@@ -1133,6 +1432,38 @@ netAddressMatch(int fd, NetAddressPtr list)
     return 0;
 }
 
+/* The address of the peer of fd, as an atom. */
+AtomPtr
+peerAddress(int fd)
+{
+    int rc;
+    unsigned int len;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+#ifdef HAVE_IPv6
+        struct sockaddr_in6 sin6;
+#endif
+    } addr;
+#ifdef HAVE_IPv6
+    char buf[INET6_ADDRSTRLEN];
+#endif
+
+    len = sizeof(addr);
+    rc = getpeername(fd, &addr.sa, &len);
+    if(rc < 0)
+        return NULL;
+
+    if(addr.sa.sa_family == AF_INET)
+        return internAtom(inet_ntoa(addr.sin.sin_addr));
+#ifdef HAVE_IPv6
+    if(addr.sa.sa_family == AF_INET6 &&
+       inet_ntop(AF_INET6, &addr.sin6.sin6_addr, buf, sizeof(buf)) != NULL)
+        return internAtom(buf);
+#endif
+    return NULL;
+}
+
 
         
         
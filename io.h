@@ -83,33 +83,58 @@ typedef struct _AcceptRequest {
 void preinitIo();
 void initIo();
 
+/* As with fd events, the completion handler's name is recorded, and
+   the profiler reports stream I/O under it. */
+
 FdEventHandlerPtr
-do_stream(int operation, int fd, int offset, char *buf, int len,
-          int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-          void *data);
+do_stream_named(int operation, int fd, int offset, char *buf, int len,
+                int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                const char *name, void *data);
 
 FdEventHandlerPtr
-do_stream_h(int operation, int fd, int offset, 
-            char *header, int hlen, char *buf, int len,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data);
+do_stream_h_named(int operation, int fd, int offset,
+                  char *header, int hlen, char *buf, int len,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data);
 
 FdEventHandlerPtr
-do_stream_2(int operation, int fd, int offset, 
-            char *buf, int len, char *buf2, int len2,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data);
+do_stream_2_named(int operation, int fd, int offset,
+                  char *buf, int len, char *buf2, int len2,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data);
 
 FdEventHandlerPtr
-do_stream_3(int operation, int fd, int offset, 
-            char *buf, int len, char *buf2, int len2, char *buf3, int len3,
-            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-            void *data);
+do_stream_3_named(int operation, int fd, int offset,
+                  char *buf, int len, char *buf2, int len2,
+                  char *buf3, int len3,
+                  int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                  const char *name, void *data);
 
 FdEventHandlerPtr
-do_stream_buf(int operation, int fd, int offset, char **buf_location, int len,
-              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-              void *data);
+do_stream_buf_named(int operation, int fd, int offset,
+                    char **buf_location, int len,
+                    int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                    const char *name, void *data);
+
+#define do_stream(operation, fd, offset, buf, len, handler, data) \
+    do_stream_named(operation, fd, offset, buf, len, \
+                    handler, #handler, data)
+#define do_stream_h(operation, fd, offset, header, hlen, buf, len, \
+                    handler, data) \
+    do_stream_h_named(operation, fd, offset, header, hlen, buf, len, \
+                      handler, #handler, data)
+#define do_stream_2(operation, fd, offset, buf, len, buf2, len2, \
+                    handler, data) \
+    do_stream_2_named(operation, fd, offset, buf, len, buf2, len2, \
+                      handler, #handler, data)
+#define do_stream_3(operation, fd, offset, buf, len, buf2, len2, \
+                    buf3, len3, handler, data) \
+    do_stream_3_named(operation, fd, offset, buf, len, buf2, len2, \
+                      buf3, len3, handler, #handler, data)
+#define do_stream_buf(operation, fd, offset, buf_location, len, \
+                      handler, data) \
+    do_stream_buf_named(operation, fd, offset, buf_location, len, \
+                        handler, #handler, data)
 
 FdEventHandlerPtr
 schedule_stream(int operation, int fd, int offset,
@@ -117,7 +142,7 @@ schedule_stream(int operation, int fd, int offset,
                 char *buf, int len, char *buf2, int len2, char *buf3, int len3,
                 char **buf_location,
                 int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-                void *data);
+                const char *name, void *data);
 
 int do_scheduled_stream(int, FdEventHandlerPtr);
 int streamRequestDone(StreamRequestPtr);
@@ -158,4 +183,5 @@ typedef struct _NetAddress {
 
 NetAddressPtr parseNetAddress(AtomListPtr list);
 int netAddressMatch(int fd, NetAddressPtr list) ATTRIBUTE ((pure));
+AtomPtr peerAddress(int fd);
 
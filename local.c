@@ -32,6 +32,7 @@ AtomPtr atomReopenLog;
 AtomPtr atomDiscardObjects;
 AtomPtr atomWriteoutObjects;
 AtomPtr atomFreeChunkArenas;
+AtomPtr atomDiscardNegative;
 
 void
 preinitLocal()
@@ -41,6 +42,7 @@ preinitLocal()
     atomDiscardObjects = internAtom("discard-objects");
     atomWriteoutObjects = internAtom("writeout-objects");
     atomFreeChunkArenas = internAtom("free-chunk-arenas");
+    atomDiscardNegative = internAtom("discard-negative");
 
     /* These should not be settable for obvious reasons */
     CONFIG_VARIABLE(disableLocalInterface, CONFIG_BOOLEAN,
@@ -56,7 +58,8 @@ preinitLocal()
 static void fillSpecialObject(ObjectPtr, void (*)(FILE*, char*), void*);
 
 int 
-httpLocalRequest(ObjectPtr object, int method, int from, int to,
+httpLocalRequest(ObjectPtr object, int method,
+                 long long from, long long to,
                  HTTPRequestPtr requestor, void *closure)
 {
     if(object->requestor == NULL)
@@ -132,6 +135,261 @@ serversList(FILE *out, char *dummy)
     listServers(out);
 }
 
+static void
+dnsServersList(FILE *out, char *dummy)
+{
+    listDnsServers(out);
+}
+
+static void
+printMetricHeader(ObjectPtr object, const char *name, const char *type,
+                  const char *help)
+{
+    objectPrintf(object, object->size,
+                 "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+printMetric(ObjectPtr object, const char *name, const char *type,
+            const char *help, long long value)
+{
+    printMetricHeader(object, name, type, help);
+    objectPrintf(object, object->size, "%s %lld\n", name, value);
+}
+
+/* Prometheus wants cumulative buckets; export one per power of two
+   from 128us up, which are exact in our log-linear histograms.  Label
+   is either empty or of the form name="value". */
+static void
+printHistogramMetric(ObjectPtr object, const char *name, const char *label,
+                     HistogramPtr histogram)
+{
+    int i, n = 0;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        n += histogram->buckets[i];
+        if(i % HISTOGRAM_SUB == HISTOGRAM_SUB - 1 &&
+           i / HISTOGRAM_SUB >= 4 && i / HISTOGRAM_SUB < HISTOGRAM_GROUPS - 1)
+            objectPrintf(object, object->size,
+                         "%s_bucket{%s%sle=\"%.6f\"} %d\n",
+                         name, label, label[0] ? "," : "",
+                         histogramBucketLimit(i) / 1.0E6, n);
+    }
+    objectPrintf(object, object->size,
+                 "%s_bucket{%s%sle=\"+Inf\"} %d\n",
+                 name, label, label[0] ? "," : "", histogram->count);
+    objectPrintf(object, object->size,
+                 "%s_sum%s%s%s %.6f\n%s_count%s%s%s %d\n",
+                 name, label[0] ? "{" : "", label, label[0] ? "}" : "",
+                 histogram->sum / 1.0E6,
+                 name, label[0] ? "{" : "", label, label[0] ? "}" : "",
+                 histogram->count);
+}
+
+static void
+printMetrics(ObjectPtr object)
+{
+    char label[40];
+    int i;
+
+    printMetric(object, "polipo_cache_hits_total", "counter",
+                "Requests served from the cache without contacting "
+                "the server.", cacheHits);
+    printMetric(object, "polipo_cache_misses_total", "counter",
+                "Requests fetched from the server.", cacheMisses);
+    printMetric(object, "polipo_cache_revalidations_total", "counter",
+                "Conditional requests sent to the server.",
+                cacheRevalidations);
+    printMetric(object, "polipo_negative_cache_hits_total", "counter",
+                "Negative replies served from the cache.",
+                negativeCacheHits);
+    printMetric(object, "polipo_negative_server_hits_total", "counter",
+                "Requests failed because of a recent connect failure.",
+                negativeServerHits);
+    printMetric(object, "polipo_public_objects", "gauge",
+                "Public objects in memory.", publicObjectCount);
+    printMetric(object, "polipo_private_objects", "gauge",
+                "Private objects in memory.", privateObjectCount);
+    printMetric(object, "polipo_memory_used_bytes", "gauge",
+                "Memory used by chunks.",
+                (long long)used_chunks * CHUNK_SIZE);
+    printMetric(object, "polipo_memory_allocated_bytes", "gauge",
+                "Memory allocated to chunk arenas.",
+                totalChunkArenaSize());
+    printMetric(object, "polipo_atoms", "gauge",
+                "Interned atoms.", used_atoms);
+#ifndef NO_DISK_CACHE
+    printMetric(object, "polipo_disk_entries", "gauge",
+                "Open disk cache entries.", numDiskEntries);
+    printMetric(object, "polipo_disk_written_bytes_total", "counter",
+                "Bytes written to the disk cache.", diskCacheWritten);
+#endif
+    printMetric(object, "polipo_client_connections", "gauge",
+                "Open client connections.", clientConnections);
+    printMetric(object, "polipo_client_connections_total", "counter",
+                "Accepted client connections.", clientConnectionsAccepted);
+    printMetric(object, "polipo_server_connections", "gauge",
+                "Open server connections.", serverConnections);
+    printMetric(object, "polipo_server_connections_total", "counter",
+                "Server connections attempted.", serverConnectionsOpened);
+    printMetric(object, "polipo_quick_abort_continued_total", "counter",
+                "Replies finished after the client went away.",
+                quickAbortContinued);
+    printMetric(object, "polipo_quick_abort_saved_bytes_total", "counter",
+                "Bytes fetched after the client went away "
+                "for replies that completed.", quickAbortSaved);
+    printMetric(object, "polipo_quick_abort_wasted_bytes_total", "counter",
+                "Bytes fetched after the client went away "
+                "for replies that failed.", quickAbortWasted);
+    printMetric(object, "polipo_range_coalesced_total", "counter",
+                "Ranges merged into a pending server request.",
+                rangeCoalesced);
+    printMetric(object, "polipo_range_fills_total", "counter",
+                "Background fetches of the rest of a partial object.",
+                rangeFills);
+    printMetric(object, "polipo_compressed_responses_total", "counter",
+                "Replies served compressed with gzip.", compressedResponses);
+    printMetric(object, "polipo_compressed_objects_total", "counter",
+                "Compressed variants built.", compressedObjects);
+    printMetric(object, "polipo_compressed_saved_bytes_total", "counter",
+                "Bytes saved by compressing replies.", compressedBytesSaved);
+    printMetric(object, "polipo_access_log_dropped_total", "counter",
+                "Access log lines dropped.", accessLogDropped);
+    printMetric(object, "polipo_dns_hits_total", "counter",
+                "Name lookups answered from the cache.", dnsHits);
+    printMetric(object, "polipo_dns_misses_total", "counter",
+                "Name lookups not answered from the cache.", dnsMisses);
+    printMetric(object, "polipo_dns_refreshes_total", "counter",
+                "Names refreshed ahead of expiry.", dnsRefreshes);
+    printMetricHeader(object, "polipo_dns_query_duration_seconds",
+                      "histogram", "Time taken by DNS queries.");
+    printHistogramMetric(object, "polipo_dns_query_duration_seconds", "",
+                         &dnsLatency);
+    printMetricHeader(object, "polipo_dns_refresh_duration_seconds",
+                      "histogram", "Time taken by refresh-ahead queries.");
+    printHistogramMetric(object, "polipo_dns_refresh_duration_seconds", "",
+                         &dnsRefreshLatency);
+    printMetricHeader(object, "polipo_request_phase_duration_seconds",
+                      "histogram", "Time spent by requests in each phase.");
+    for(i = 0; i < NUM_REQUEST_TIMES; i++) {
+        snprintf(label, 40, "phase=\"%s\"", requestTimeNames[i]);
+        printHistogramMetric(object, "polipo_request_phase_duration_seconds",
+                             label, &requestTimes[i]);
+    }
+    printMetricHeader(object, "polipo_event_loop_lag_seconds",
+                      "histogram", "How late timers ran.");
+    printHistogramMetric(object, "polipo_event_loop_lag_seconds", "",
+                         &loopLag);
+}
+
+static void
+printLatency(ObjectPtr object)
+{
+    HistogramPtr h;
+    int i;
+
+    objectPrintf(object, object->size,
+                 "<!DOCTYPE HTML PUBLIC "
+                 "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+                 "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+                 "<html><head>\n"
+                 "<title>Request latency</title>\n"
+                 "</head><body>\n"
+                 "<h1>Request latency</h1>\n"
+                 "<table>\n"
+                 "<thead><tr><th>Phase</th><th>Requests</th>"
+                 "<th>Mean</th><th>50%%</th><th>90%%</th><th>99%%</th>"
+                 "<th>Max</th></tr></thead>\n<tbody>\n");
+    /* The total comes last. */
+    for(i = 1; i <= NUM_REQUEST_TIMES; i++) {
+        h = &requestTimes[i % NUM_REQUEST_TIMES];
+        if(h->count == 0)
+            continue;
+        objectPrintf(object, object->size,
+                     "<tr><td>%s</td><td>%d</td><td>%.1f&nbsp;ms</td>"
+                     "<td>%.1f&nbsp;ms</td><td>%.1f&nbsp;ms</td>"
+                     "<td>%.1f&nbsp;ms</td><td>%.1f&nbsp;ms</td></tr>\n",
+                     requestTimeNames[i % NUM_REQUEST_TIMES], h->count,
+                     (double)h->sum / h->count / 1000.0,
+                     histogramPercentile(h, 50) / 1000.0,
+                     histogramPercentile(h, 90) / 1000.0,
+                     histogramPercentile(h, 99) / 1000.0,
+                     histogramPercentile(h, 100) / 1000.0);
+    }
+    objectPrintf(object, object->size,
+                 "</tbody>\n</table>\n"
+                 "<p>Percentiles are upper bounds, accurate to 1/8.</p>\n"
+                 "<p><a href=\"/polipo/\">back</a></p>"
+                 "</body></html>\n");
+}
+
+static int
+compareHandlerProfiles(const void *a, const void *b)
+{
+    const HandlerProfileRec *p1 = *(HandlerProfileRec * const *)a;
+    const HandlerProfileRec *p2 = *(HandlerProfileRec * const *)b;
+    if(p1->total != p2->total)
+        return p1->total > p2->total ? -1 : 1;
+    return 0;
+}
+
+#define EVENT_PROFILE_SHOWN 30
+
+static void
+printEventProfile(ObjectPtr object)
+{
+    HandlerProfilePtr profiles[HANDLER_PROFILE_SIZE];
+    int i, n = 0;
+
+    for(i = 0; i < HANDLER_PROFILE_SIZE; i++) {
+        if(handlerProfiles[i].function)
+            profiles[n++] = &handlerProfiles[i];
+    }
+    qsort(profiles, n, sizeof(HandlerProfilePtr), compareHandlerProfiles);
+
+    objectPrintf(object, object->size,
+                 "<!DOCTYPE HTML PUBLIC "
+                 "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+                 "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+                 "<html><head>\n"
+                 "<title>Event handlers</title>\n"
+                 "</head><body>\n"
+                 "<h1>Event handlers</h1>\n");
+    if(!eventProfile)
+        objectPrintf(object, object->size,
+                     "<p>Profiling is disabled; set <tt>eventProfile</tt> "
+                     "to enable it.</p>\n");
+    objectPrintf(object, object->size,
+                 "<table>\n"
+                 "<thead><tr><th>Handler</th><th>Calls</th>"
+                 "<th>Total</th><th>Mean</th><th>Max</th></tr></thead>\n"
+                 "<tbody>\n");
+    for(i = 0; i < MIN(n, EVENT_PROFILE_SHOWN); i++) {
+        objectPrintf(object, object->size,
+                     "<tr><td>%s</td><td>%d</td><td>%.1f&nbsp;ms</td>"
+                     "<td>%.1f&nbsp;&micro;s</td><td>%.1f&nbsp;ms</td>"
+                     "</tr>\n",
+                     profiles[i]->name, profiles[i]->count,
+                     profiles[i]->total / 1000.0,
+                     (double)profiles[i]->total / profiles[i]->count,
+                     profiles[i]->max / 1000.0);
+    }
+    objectPrintf(object, object->size, "</tbody>\n</table>\n");
+    if(loopLag.count > 0)
+        objectPrintf(object, object->size,
+                     "<p>Timers ran late by %.1f&nbsp;ms on average "
+                     "(50%%: %.1f&nbsp;ms, 99%%: %.1f&nbsp;ms, "
+                     "max: %.1f&nbsp;ms).</p>\n",
+                     (double)loopLag.sum / loopLag.count / 1000.0,
+                     histogramPercentile(&loopLag, 50) / 1000.0,
+                     histogramPercentile(&loopLag, 99) / 1000.0,
+                     histogramPercentile(&loopLag, 100) / 1000.0);
+    objectPrintf(object, object->size,
+                 "<p>Times include those of nested handlers.</p>\n"
+                 "<p><a href=\"/polipo/\">back</a></p>"
+                 "</body></html>\n");
+}
+
 static int
 matchUrl(char *base, ObjectPtr object)
 {
@@ -144,7 +402,8 @@ matchUrl(char *base, ObjectPtr object)
 }
     
 int 
-httpSpecialRequest(ObjectPtr object, int method, int from, int to,
+httpSpecialRequest(ObjectPtr object, int method,
+                   long long from, long long to,
                    HTTPRequestPtr requestor, void *closure)
 {
     char buffer[1024];
@@ -186,6 +445,10 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<p><a href=\"status?\">Status report</a>.</p>\n"
                      "<p><a href=\"config?\">Current configuration</a>.</p>\n"
                      "<p><a href=\"servers?\">Known servers</a>.</p>\n"
+                     "<p><a href=\"dns?\">Name servers</a>.</p>\n"
+                     "<p><a href=\"latency?\">Request latency</a>.</p>\n"
+                     "<p><a href=\"events?\">Event handlers</a>.</p>\n"
+                     "<p><a href=\"metrics?\">Metrics</a>.</p>\n"
 #ifndef NO_DISK_CACHE
                      "<p><a href=\"index?\">Disk cache index</a>.</p>\n"
 #endif
@@ -205,6 +468,12 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "currently in memory using %d KB in %d chunks "
                      "(%d KB allocated).</p>\n"
                      "<p>There are %d atoms.</p>"
+                     "<p>%d DNS lookups were answered from the cache "
+                     "and %d were not; %d names were refreshed "
+                     "ahead of expiry.  DNS queries took %d ms on average "
+                     "and at most %d ms.</p>\n"
+                     "<p>%d negative replies and %d recent connect failures "
+                     "were served from the cache.</p>\n"
                      "<p><form method=POST action=\"/polipo/status?\">"
                      "<input type=submit name=\"init-forbidden\" "
                      "value=\"Read forbidden file\"></form>\n"
@@ -215,6 +484,9 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<input type=submit name=\"discard-objects\" "
                      "value=\"Discard in-memory cache\"></form>\n"
                      "<form method=POST action=\"/polipo/status?\">"
+                     "<input type=submit name=\"discard-negative\" "
+                     "value=\"Discard negative cache\"></form>\n"
+                     "<form method=POST action=\"/polipo/status?\">"
                      "<input type=submit name=\"reopen-log\" "
                      "value=\"Reopen log file\"></form>\n"
                      "<form method=POST action=\"/polipo/status?\">"
@@ -232,7 +504,27 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      publicObjectCount, privateObjectCount,
                      used_chunks * CHUNK_SIZE / 1024, used_chunks,
                      totalChunkArenaSize() / 1024,
-                     used_atoms);
+                     used_atoms,
+                     dnsHits, dnsMisses, dnsRefreshes,
+                     dnsQueries > 0 ? (int)(dnsQueryTime / dnsQueries) : 0,
+                     dnsMaxQueryTime,
+                     negativeCacheHits, negativeServerHits);
+        object->expires = current_time.tv_sec;
+        object->length = object->size;
+    } else if(matchUrl("/polipo/metrics", object)) {
+        releaseAtom(object->headers);
+        object->headers = internAtom("\r\nServer: polipo"
+                                     "\r\nContent-Type: text/plain; "
+                                     "version=0.0.4");
+        printMetrics(object);
+        object->expires = current_time.tv_sec;
+        object->length = object->size;
+    } else if(matchUrl("/polipo/latency", object)) {
+        printLatency(object);
+        object->expires = current_time.tv_sec;
+        object->length = object->size;
+    } else if(matchUrl("/polipo/events", object)) {
+        printEventProfile(object);
         object->expires = current_time.tv_sec;
         object->length = object->size;
     } else if(matchUrl("/polipo/config", object)) {
@@ -286,6 +578,9 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
         }
         fillSpecialObject(object, serversList, NULL);
         object->expires = current_time.tv_sec + 2;
+    } else if(matchUrl("/polipo/dns", object)) {
+        fillSpecialObject(object, dnsServersList, NULL);
+        object->expires = current_time.tv_sec + 2;
     } else {
         abortObject(object, 404, internAtom("Not found"));
     }
@@ -296,7 +591,8 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
 }
 
 int 
-httpSpecialSideRequest(ObjectPtr object, int method, int from, int to,
+httpSpecialSideRequest(ObjectPtr object, int method,
+                       long long from, long long to,
                        HTTPRequestPtr requestor, void *closure)
 {
     HTTPConnectionPtr client = requestor->connection;
@@ -462,6 +758,10 @@ httpSpecialDoSideFinish(AtomPtr data, HTTPRequestPtr requestor)
                 writeoutObjects(1);
             else if(name == atomFreeChunkArenas)
                 free_chunk_arenas();
+            else if(name == atomDiscardNegative) {
+                discardNegativeObjects();
+                discardServerFailures();
+            }
             else {
                 abortObject(object, 400, internAtomF("Unknown action %s",
                                                      name->string));
@@ -33,11 +33,14 @@ extern int disableIndexing;
 
 void preinitLocal(void);
 void alternatingHttpStyle(FILE *out, char *id);
-int httpLocalRequest(ObjectPtr object, int method, int from, int to,
+int httpLocalRequest(ObjectPtr object, int method,
+                     long long from, long long to,
                      HTTPRequestPtr, void *);
-int httpSpecialRequest(ObjectPtr object, int method, int from, int to,
+int httpSpecialRequest(ObjectPtr object, int method,
+                       long long from, long long to,
                        HTTPRequestPtr, void*);
-int httpSpecialSideRequest(ObjectPtr object, int method, int from, int to,
+int httpSpecialSideRequest(ObjectPtr object, int method,
+                           long long from, long long to,
                            HTTPRequestPtr requestor, void *closure);
 int specialRequestHandler(int status, 
                           FdEventHandlerPtr event, StreamRequestPtr request);
@@ -33,6 +33,25 @@ static FILE *logF;
 static int logFilePermissions = 0640;
 int scrubLogs = 0;
 
+/* Most bytes written to the access log at a time. */
+#define ACCESS_LOG_WRITE_MAX (16 * 1024)
+
+static AtomPtr accessLogFile = NULL;
+static AtomListPtr accessLogFields = NULL;
+static int accessLogBufferSize = 64 * 1024;
+static int accessLogFd = -1;
+static char *accessLogBuf = NULL;
+static int accessLogStart = 0, accessLogLength = 0;
+static TimeEventHandlerPtr accessLogFlusher = NULL;
+static int accessLogFlushSoon = 0;
+int accessLogMask = 0;
+int accessLogDropped = 0;
+
+static const char *accessLogFieldNames[] = {
+    "time", "client", "method", "url", "status", "bytes", "cache", "timings",
+    NULL
+};
+
 #ifdef HAVE_SYSLOG
 static AtomPtr logFacility = NULL;
 static int facility;
@@ -42,6 +61,8 @@ static int facility;
 #define XSTR(x) #x
 
 static void initSyslog(void);
+static void initAccessLog(void);
+static void flushAccessLog(void);
 
 #ifdef HAVE_SYSLOG
 static char *syslogBuf;
@@ -64,6 +85,12 @@ preinitLog()
                     "Access rights of the logFile.");
     CONFIG_VARIABLE_SETTABLE(scrubLogs, CONFIG_BOOLEAN, configIntSetter,
                              "If true, don't include URLs in logs.");
+    CONFIG_VARIABLE(accessLogFile, CONFIG_ATOM,
+                    "Access log file (no access log if empty).");
+    CONFIG_VARIABLE(accessLogFields, CONFIG_ATOM_LIST_LOWER,
+                    "Fields to include in the access log.");
+    CONFIG_VARIABLE(accessLogBufferSize, CONFIG_INT,
+                    "Size of the access log buffer.");
 
 #ifdef HAVE_SYSLOG
     CONFIG_VARIABLE(logSyslog, CONFIG_BOOLEAN, "Log to syslog.");
@@ -126,6 +153,161 @@ initLog(void)
             logF = NULL;
         }
     }
+
+    initAccessLog();
+}
+
+static int
+openAccessLogFile(void)
+{
+    int fd;
+
+    fd = open(accessLogFile->string,
+              O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK,
+              logFilePermissions);
+    if(fd < 0)
+        do_log_error(L_ERROR, errno, "Couldn't open access log %s",
+                     accessLogFile->string);
+    return fd;
+}
+
+static void
+initAccessLog()
+{
+    int i, j;
+
+    if(accessLogFile == NULL || accessLogFile->length == 0)
+        return;
+
+    if(accessLogFields == NULL) {
+        accessLogMask = (1 << ACCESS_LOG_NUM_FIELDS) - 1;
+    } else {
+        for(i = 0; i < accessLogFields->length; i++) {
+            for(j = 0; accessLogFieldNames[j]; j++)
+                if(strcmp(accessLogFields->list[i]->string,
+                          accessLogFieldNames[j]) == 0)
+                    break;
+            if(accessLogFieldNames[j])
+                accessLogMask |= (1 << j);
+            else
+                do_log(L_WARN, "Unknown access log field %s.\n",
+                       accessLogFields->list[i]->string);
+        }
+    }
+
+    if(accessLogMask == 0)
+        return;
+
+    accessLogBufferSize = MAX(accessLogBufferSize, 4096);
+    accessLogBuf = malloc(accessLogBufferSize);
+    if(accessLogBuf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate access log buffer.\n");
+        exit(1);
+    }
+
+    accessLogFd = openAccessLogFile();
+    if(accessLogFd < 0)
+        exit(1);
+}
+
+/* Write out at most ACCESS_LOG_WRITE_MAX bytes from the head of the
+   ring.  Returns the number of bytes written, 0 if the write would
+   block, and -1 on error, in which case the ring is discarded. */
+static int
+writeAccessLog()
+{
+    int rc, n;
+
+    n = MIN(accessLogLength, accessLogBufferSize - accessLogStart);
+    n = MIN(n, ACCESS_LOG_WRITE_MAX);
+    if(n <= 0)
+        return 0;
+    do {
+        rc = write(accessLogFd, accessLogBuf + accessLogStart, n);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0) {
+        if(errno == EAGAIN)
+            return 0;
+        do_log_error(L_ERROR, errno, "Couldn't write access log");
+        accessLogStart = 0;
+        accessLogLength = 0;
+        return -1;
+    }
+    accessLogStart = (accessLogStart + rc) % accessLogBufferSize;
+    accessLogLength -= rc;
+    if(accessLogLength == 0)
+        accessLogStart = 0;
+    return rc;
+}
+
+/* Write out the whole ring.  Only used when reopening the log and
+   before forking or exiting, never on the request path. */
+static void
+flushAccessLog()
+{
+    while(accessLogLength > 0) {
+        if(writeAccessLog() <= 0)
+            break;
+    }
+}
+
+static int accessLogFlushHandler(TimeEventHandlerPtr event);
+
+/* Make sure the ring will be drained, on the next pass through the
+   event loop if soon is true, and within a second otherwise. */
+static void
+scheduleAccessLogFlush(int soon)
+{
+    if(accessLogFlusher) {
+        if(!soon || accessLogFlushSoon)
+            return;
+        cancelTimeEvent(accessLogFlusher);
+    }
+    accessLogFlusher =
+        scheduleTimeEvent(soon ? 0 : 1, accessLogFlushHandler, 0, NULL);
+    accessLogFlushSoon = soon;
+}
+
+static int
+accessLogFlushHandler(TimeEventHandlerPtr event)
+{
+    int rc;
+
+    accessLogFlusher = NULL;
+    rc = writeAccessLog();
+    if(accessLogLength > 0)
+        scheduleAccessLogFlush(rc > 0);
+    return 1;
+}
+
+/* Append a line to the access log.  Lines are only copied into the ring
+   here, and dropped if it is full; the ring is drained by
+   accessLogFlushHandler, a bounded write at a time. */
+void
+logAccess(const char *line, int n)
+{
+    int m;
+
+    if(accessLogFd < 0)
+        return;
+
+    if(n > accessLogBufferSize - accessLogLength) {
+        accessLogDropped++;
+        scheduleAccessLogFlush(1);
+        return;
+    }
+
+    m = (accessLogStart + accessLogLength) % accessLogBufferSize;
+    if(m + n <= accessLogBufferSize) {
+        memcpy(accessLogBuf + m, line, n);
+    } else {
+        memcpy(accessLogBuf + m, line, accessLogBufferSize - m);
+        memcpy(accessLogBuf, line + accessLogBufferSize - m,
+               n - (accessLogBufferSize - m));
+    }
+    accessLogLength += n;
+
+    scheduleAccessLogFlush(accessLogLength >= accessLogBufferSize / 2);
 }
 
 #ifdef HAVE_SYSLOG
@@ -361,6 +543,9 @@ void flushLog()
     if(logF)
         fflush(logF);
 
+    if(accessLogFd >= 0)
+        flushAccessLog();
+
 #ifdef HAVE_SYSLOG
     /* There shouldn't really be anything here, but let's be paranoid.
        We can't pick a good value for `type', so just invent one. */
@@ -389,6 +574,16 @@ reopenLog()
 
     if(logSyslog)
         initSyslog();
+
+    if(accessLogFd >= 0) {
+        int fd;
+        flushAccessLog();
+        fd = openAccessLogFile();
+        if(fd >= 0) {
+            close(accessLogFd);
+            accessLogFd = fd;
+        }
+    }
 }
 
 void
@@ -47,13 +47,26 @@ THE SOFTWARE.
 #define LOGGING_DEFAULT (L_ERROR | L_WARN | L_INFO)
 #define LOGGING_MAX 0xFF
 
+/* Bits of accessLogMask, in the order of the accessLogFields names. */
+#define ACCESS_LOG_TIME 0x1
+#define ACCESS_LOG_CLIENT 0x2
+#define ACCESS_LOG_METHOD 0x4
+#define ACCESS_LOG_URL 0x8
+#define ACCESS_LOG_STATUS 0x10
+#define ACCESS_LOG_BYTES 0x20
+#define ACCESS_LOG_CACHE 0x40
+#define ACCESS_LOG_TIMINGS 0x80
+#define ACCESS_LOG_NUM_FIELDS 8
+
 extern int scrubLogs;
+extern int accessLogMask, accessLogDropped;
 
 void preinitLog(void);
 void initLog(void);
 void reopenLog(void);
 void flushLog(void);
 int loggingToStderr(void);
+void logAccess(const char *line, int n);
 
 void really_do_log(int type, const char *f, ...)
     ATTRIBUTE ((format (printf, 2, 3)));
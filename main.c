@@ -52,6 +52,7 @@ main(int argc, char **argv)
 
     preinitChunks();
     preinitLog();
+    preinitEvents();
     preinitObject();
     preinitIo();
     preinitDns();
@@ -61,6 +62,7 @@ main(int argc, char **argv)
     preinitLocal();
     preinitForbidden();
     preinitSocks();
+    preinitCompress();
 
     i = 1;
     while(i < argc) {
@@ -129,8 +131,12 @@ main(int argc, char **argv)
     initChunks();
     initLog();
     initObject();
-    if(!expire && !printConfig)
+    if(!expire && !printConfig) {
         initEvents();
+        /* Before anything else gets a chance to scribble over the
+           chunks left behind by the previous run. */
+        restoreObjectTable();
+    }
     initIo();
     initDns();
     initHttp();
@@ -164,6 +170,7 @@ main(int argc, char **argv)
 
     eventLoop();
 
+    flushLog();
     if(pidFile) unlink(pidFile->string);
     return 0;
 }
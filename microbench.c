@@ -0,0 +1,750 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Microbenchmarks for Polipo's hot primitives.  This is linked with
+   all of Polipo's objects except main.o, and times each primitive on
+   fixed inputs, reporting the time and the number of calls to malloc
+   per operation. */
+
+#include "polipo.h"
+#include "md5import.h"
+
+AtomPtr configFile = NULL;
+int daemonise = 0;
+
+static long allocations = 0;
+
+#ifdef __GLIBC__
+/* The GNU libc allows the allocator to be replaced; we count calls and
+   defer to the real one. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+extern void __libc_free(void*);
+
+void *
+malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+    allocations++;
+    return __libc_realloc(p, size);
+}
+
+void
+free(void *p)
+{
+    __libc_free(p);
+}
+#define HAVE_ALLOCATION_COUNT
+#endif
+
+#define NUM_URLS 1024
+#define NUM_DOMAINS 2000
+
+static char *urls[NUM_URLS];
+static int urlLengths[NUM_URLS];
+static AtomPtr urlAtoms[NUM_URLS];
+
+/* Captured from a browser, minus the cookies. */
+static const char requestHeaders[] =
+    "GET http://www.example.com/news/2010/01/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; U; Linux x86_64; en-US; rv:1.9.1.7) "
+    "Gecko/20100106 Firefox/3.5.7\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n"
+    "Accept-Language: en-us,en;q=0.5\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.7\r\n"
+    "Keep-Alive: 300\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Referer: http://www.example.com/news/\r\n"
+    "If-Modified-Since: Sat, 16 Jan 2010 09:27:14 GMT\r\n"
+    "If-None-Match: \"4b5186e2-2d1c\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char *urlTemplates[] = {
+    "http://www.example%d.com/",
+    "http://static.example.net/images/%d/thumbnail.jpg",
+    "http://ads%d.example.org/banner?id=%d&size=468x60",
+    "http://www.example.com/news/2010/01/article-%d.html",
+    "http://cdn.example.com:8080/js/jquery-1.4.%d.min.js",
+    "http://en.example.org/wiki/Special:Search?search=topic%d&go=Go",
+};
+
+static void
+makeCorpus(void)
+{
+    char buf[256];
+    int i, n;
+    int t = sizeof(urlTemplates) / sizeof(urlTemplates[0]);
+
+    for(i = 0; i < NUM_URLS; i++) {
+        n = snprintf(buf, 256, urlTemplates[i % t], i, i);
+        urls[i] = strdup(buf);
+        urlLengths[i] = n;
+        urlAtoms[i] = internAtomN(buf, n);
+    }
+}
+
+static int
+makeBlocklist(void)
+{
+    char filename[] = "/tmp/polipo-microbench.XXXXXX";
+    char buf[300];
+    FILE *f;
+    int fd, i;
+
+    fd = mkstemp(filename);
+    if(fd < 0)
+        return -1;
+    f = fdopen(fd, "w");
+    if(f == NULL) {
+        close(fd);
+        return -1;
+    }
+    for(i = 0; i < NUM_DOMAINS; i++)
+        fprintf(f, "ads%d.example.net\n", i);
+    fprintf(f, "/(ad|banner)s?/\n");
+    fprintf(f, "\\.swf$\n");
+    fclose(f);
+
+    snprintf(buf, 300, "uncachableFile=%s", filename);
+    if(parseConfigLine(buf, "microbench", 0, 0) < 0) {
+        unlink(filename);
+        return -1;
+    }
+    initForbidden();
+    unlink(filename);
+    return 1;
+}
+
+static volatile int sink;
+
+static void
+benchHash(int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        sink += hash(0, urls[i % NUM_URLS], urlLengths[i % NUM_URLS], 16);
+}
+
+static void
+benchInternAtomHit(int n)
+{
+    int i;
+    for(i = 0; i < n; i++) {
+        AtomPtr atom = internAtomN(urls[i % NUM_URLS], urlLengths[i % NUM_URLS]);
+        releaseAtom(atom);
+    }
+}
+
+static void
+benchInternAtomMiss(int n)
+{
+    char buf[32];
+    int i, len;
+    for(i = 0; i < n; i++) {
+        AtomPtr atom;
+        len = snprintf(buf, 32, "x-microbench-%d", i % 4096);
+        atom = internAtomN(buf, len);
+        releaseAtom(atom);
+    }
+}
+
+static AtomPtr *liveAtoms = NULL;
+static int numLiveAtoms = 0;
+
+/* Grow or shrink the set of atoms kept alive during benchAtomChurn. */
+static void
+setLiveAtoms(int count)
+{
+    char buf[64];
+    int len;
+
+    if(liveAtoms == NULL) {
+        liveAtoms = malloc(1000000 * sizeof(AtomPtr));
+        if(liveAtoms == NULL)
+            abort();
+    }
+    assert(count <= 1000000);
+    while(numLiveAtoms > count)
+        releaseAtom(liveAtoms[--numLiveAtoms]);
+    while(numLiveAtoms < count) {
+        len = snprintf(buf, 64, "http://www%d.example.com/", numLiveAtoms);
+        liveAtoms[numLiveAtoms] = internAtomN(buf, len);
+        if(liveAtoms[numLiveAtoms] == NULL)
+            abort();
+        numLiveAtoms++;
+    }
+}
+
+/* Look up a live atom, in no particular order, and intern and release
+   a new one. */
+static void
+benchAtomChurn(int n)
+{
+    char buf[32];
+    int i, len;
+    for(i = 0; i < n; i++) {
+        AtomPtr atom = liveAtoms[(unsigned)i * 7919 % numLiveAtoms];
+        atom = internAtomN(atom->string, atom->length);
+        releaseAtom(atom);
+        len = snprintf(buf, 32, "x-microbench-%d", i % 4096);
+        atom = internAtomN(buf, len);
+        releaseAtom(atom);
+    }
+}
+
+static void
+benchParseUrl(int n)
+{
+    int i, x, y, port, z;
+    for(i = 0; i < n; i++) {
+        parseUrl(urls[i % NUM_URLS], urlLengths[i % NUM_URLS],
+                 &x, &y, &port, &z);
+        sink += z;
+    }
+}
+
+static void
+benchParseHeaders(int n)
+{
+    HTTPConnectionRec connection;
+    HTTPRequestRec request;
+    AtomPtr headers, expect, via, auth;
+    CacheControlRec cache_control;
+    HTTPConditionPtr condition;
+    HTTPRangeRec range;
+    long long body_len;
+    int i, rc, te, start;
+
+    memset(&connection, 0, sizeof(connection));
+    connection.version = HTTP_11;
+    start = strstr(requestHeaders, "\r\n") + 2 - requestHeaders;
+
+    for(i = 0; i < n; i++) {
+        memset(&request, 0, sizeof(request));
+        request.connection = &connection;
+        request.flags = REQUEST_PERSISTENT;
+        rc = httpParseHeaders(1, urlAtoms[3], requestHeaders, start, &request,
+                              &headers, &body_len, &cache_control,
+                              &condition, &te,
+                              NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                              &expect, &range, NULL, NULL, &via, &auth);
+        if(rc < 0)
+            abort();
+        releaseAtom(headers);
+        if(condition)
+            httpDestroyCondition(condition);
+        if(expect)
+            releaseAtom(expect);
+        if(via)
+            releaseAtom(via);
+        if(auth)
+            releaseAtom(auth);
+    }
+}
+
+#define NUM_DATES 4096
+
+static char *dates[NUM_DATES];
+static int dateLengths[NUM_DATES];
+static time_t dateTimes[NUM_DATES];
+static int numDates = NUM_DATES;
+
+/* Dates a day and a few seconds apart, in the three formats that
+   HTTP allows. */
+static void
+makeDates(void)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    char buf[64];
+    struct tm *tm;
+    int i, n;
+
+    for(i = 0; i < NUM_DATES; i++) {
+        dateTimes[i] = 1263634034 - (time_t)i * 86413;
+        tm = gmtime(&dateTimes[i]);
+        if(tm == NULL)
+            abort();
+        n = strftime(buf, 64, formats[i % 3], tm);
+        dates[i] = strdup(buf);
+        dateLengths[i] = n;
+    }
+}
+
+static void
+benchParseTime(int n)
+{
+    time_t t;
+    int i, j;
+    for(i = 0; i < n; i++) {
+        j = i % numDates;
+        if(parse_time(dates[j], 0, dateLengths[j], &t) < 0)
+            abort();
+        sink += (int)t;
+    }
+}
+
+static void
+benchFormatTime(int n)
+{
+    char buf[64];
+    int i;
+    for(i = 0; i < n; i++)
+        sink += format_time(buf, 0, 64, dateTimes[i % numDates]);
+}
+
+/* Check the memoised parse_time and format_time against the corpus,
+   twice over so that the second pass runs from the caches. */
+static int
+checkDates(void)
+{
+    char buf[64], expected[64];
+    struct tm *tm;
+    time_t t;
+    int i, j, n, failures = 0;
+
+    makeDates();
+    for(i = 0; i < 2 * NUM_DATES; i++) {
+        j = (i * 7) % NUM_DATES;
+        if(parse_time(dates[j], 0, dateLengths[j], &t) != dateLengths[j] ||
+           t != dateTimes[j]) {
+            fprintf(stderr, "parse_time(%s) failed\n", dates[j]);
+            failures++;
+        }
+        tm = gmtime(&dateTimes[j]);
+        strftime(expected, 64, "%a, %d %b %Y %H:%M:%S GMT", tm);
+        n = format_time(buf, 0, 64, dateTimes[j]);
+        if(n != (int)strlen(expected) || strcmp(buf, expected) != 0) {
+            fprintf(stderr, "format_time: %s, expected %s\n",
+                    buf, expected);
+            failures++;
+        }
+    }
+    printf("parse_time/format_time: %d dates, %d mismatches\n",
+           2 * NUM_DATES, failures);
+    return failures;
+}
+
+static ObjectPtr replyObject;
+
+/* A small cached reply, as it would be after a fetch. */
+static void
+makeReplyObject(void)
+{
+    static const char key[] = "http://www.example.com/style.css";
+
+    replyObject = makeObject(OBJECT_HTTP, key, sizeof(key) - 1, 0, 0,
+                             NULL, NULL);
+    if(replyObject == NULL)
+        abort();
+    replyObject->flags &= ~OBJECT_INITIAL;
+    replyObject->code = 200;
+    replyObject->message = internAtom("OK");
+    replyObject->length = 2745;
+    replyObject->etag = strdup("4b5186e2-ab9");
+    replyObject->date = 1263634034;
+    replyObject->last_modified = 1263281234;
+    replyObject->expires = 1263720434;
+    replyObject->max_age = 86400;
+    replyObject->cache_control = CACHE_PUBLIC;
+    replyObject->via = internAtom("1.1 cache.example.net");
+    replyObject->headers =
+        internAtom("\r\nContent-Type: text/css"
+                   "\r\nServer: Apache/2.2.14 (Unix)"
+                   "\r\nAccept-Ranges: bytes");
+}
+
+/* The header block of a 200 reply served from memory. */
+static void
+benchObjectHeaders(int n)
+{
+    char buf[CHUNK_SIZE];
+    int i, m;
+    for(i = 0; i < n; i++) {
+        m = snnprintf(buf, 0, CHUNK_SIZE, "HTTP/1.1 200 OK");
+        m = httpWriteObjectHeaders(buf, m, CHUNK_SIZE, replyObject, 0, -1);
+        if(m < 0)
+            abort();
+        sink += m;
+    }
+}
+
+static void
+benchObjectHeadersUncached(int n)
+{
+    char buf[CHUNK_SIZE];
+    int i, m;
+    for(i = 0; i < n; i++) {
+        discardObjectHeaderCache(replyObject);
+        m = snnprintf(buf, 0, CHUNK_SIZE, "HTTP/1.1 200 OK");
+        m = httpWriteObjectHeaders(buf, m, CHUNK_SIZE, replyObject, 0, -1);
+        if(m < 0)
+            abort();
+        sink += m;
+    }
+}
+
+static void
+benchUrlIsUncachable(int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        sink += urlIsUncachable(urls[i % NUM_URLS], urlLengths[i % NUM_URLS]);
+}
+
+static void
+benchChunks(int n)
+{
+    void *chunks[16];
+    int i, j;
+    for(i = 0; i < n; i += 16) {
+        for(j = 0; j < 16; j++)
+            chunks[j] = get_chunk();
+        for(j = 0; j < 16; j++)
+            if(chunks[j])
+                dispose_chunk(chunks[j]);
+    }
+}
+
+static void
+benchMd5(int n)
+{
+    MD5_CTX ctx;
+    int i;
+    for(i = 0; i < n; i++) {
+        MD5Init(&ctx);
+        MD5Update(&ctx, (unsigned char*)urls[i % NUM_URLS],
+                  urlLengths[i % NUM_URLS]);
+        MD5Final(&ctx);
+        sink += ctx.digest[0];
+    }
+}
+
+static void
+benchIntListCons(int n)
+{
+    IntListPtr list = NULL;
+    int i;
+    for(i = 0; i < n; i++) {
+        if(i % 64 == 0) {
+            if(list)
+                destroyIntList(list);
+            list = makeIntList(0);
+            if(list == NULL)
+                abort();
+        }
+        /* Disjoint ranges, so that every call adds one. */
+        intListCons((i % 64) * 4, (i % 64) * 4 + 1, list);
+    }
+    if(list)
+        destroyIntList(list);
+}
+
+/* The byte-at-a-time findEndOfHeaders that scanEol replaced, kept as
+   a reference for the vectorised one. */
+static int
+bytewiseEndOfHeaders(const char *buf, int from, int to, int *body_return)
+{
+    int i = from;
+    int eol = 0;
+    while(i < to) {
+        if(buf[i] == '\n') {
+            if(eol) {
+                *body_return = i + 1;
+                return eol;
+            }
+            eol = i;
+            i++;
+        } else if(buf[i] == '\r') {
+            if(i < to - 1 && buf[i + 1] == '\n') {
+                if(eol) {
+                    *body_return = eol;
+                    return i + 2;
+                }
+                eol = i;
+                i += 2;
+            } else {
+                eol = 0;
+                i++;
+            }
+        } else {
+            eol = 0;
+            i++;
+        }
+    }
+    return -1;
+}
+
+static void
+benchFindEndOfHeaders(int n)
+{
+    int i, body, len = sizeof(requestHeaders) - 1;
+    for(i = 0; i < n; i++)
+        sink += findEndOfHeaders(requestHeaders, 0, len, &body);
+}
+
+static void
+benchBytewiseEndOfHeaders(int n)
+{
+    int i, body, len = sizeof(requestHeaders) - 1;
+    for(i = 0; i < n; i++)
+        sink += bytewiseEndOfHeaders(requestHeaders, 0, len, &body);
+}
+
+static int
+compareEndOfHeaders(const char *buf, int from, int to)
+{
+    int rc1, rc2, body1 = -1, body2 = -1;
+
+    rc1 = findEndOfHeaders(buf, from, to, &body1);
+    rc2 = bytewiseEndOfHeaders(buf, from, to, &body2);
+    if(rc1 != rc2 || (rc1 >= 0 && body1 != body2)) {
+        fprintf(stderr,
+                "findEndOfHeaders(%d, %d): %d (body %d), expected %d "
+                "(body %d)\n", from, to, rc1, body1, rc2, body2);
+        return -1;
+    }
+    return 1;
+}
+
+#define CHECK_SIZE 600
+
+/* Check findEndOfHeaders against the bytewise version on buffers that
+   end just before an unmapped page, so that reading past the end
+   faults.  Returns the number of mismatches. */
+static int
+checkFindEndOfHeaders(void)
+{
+    static const char *terminators[] = {
+        "\r\n\r\n", "\n\n", "\r\n\n", "\n\r\n", "\r\r\n\r\n", "\r\n\r\r\n"
+    };
+    int nterminators = sizeof(terminators) / sizeof(terminators[0]);
+    char *page, *buf;
+    int pagesize, t, len, pos, from, i, j, m;
+    int buffers = 0, failures = 0;
+
+#ifndef WIN32 /*MINGW*/
+    pagesize = getpagesize();
+    page = mmap(NULL, 2 * pagesize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(page == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if(mprotect(page + pagesize, pagesize, PROT_NONE) < 0) {
+        perror("mprotect");
+        return 1;
+    }
+#else
+    pagesize = 4096;
+    page = malloc(pagesize);
+    if(page == NULL)
+        return 1;
+#endif
+    assert(CHECK_SIZE <= pagesize);
+
+    /* Each terminator at every position around the 16-byte boundaries,
+       with the end of the data cutting through it at every point. */
+    for(t = 0; t < nterminators; t++) {
+        for(len = 0; len <= 70; len++) {
+            for(pos = 0; pos <= len; pos++) {
+                buf = page + pagesize - len;
+                memset(buf, 'x', len);
+                m = MIN((int)strlen(terminators[t]), len - pos);
+                memcpy(buf + pos, terminators[t], m);
+                for(from = 0; from <= MIN(len, 20); from++) {
+                    buffers++;
+                    if(compareEndOfHeaders(buf, from, len) < 0)
+                        failures++;
+                }
+            }
+        }
+    }
+
+    /* Random buffers, from nearly all line ends to nearly none. */
+    srandom(42);
+    for(i = 0; i < 200000; i++) {
+        int density = 1 + random() % 64;
+        len = random() % (CHECK_SIZE + 1);
+        buf = page + pagesize - len;
+        for(j = 0; j < len; j++) {
+            int r = random();
+            if(r % density != 0)
+                buf[j] = 'a' + (r >> 8) % 26;
+            else
+                buf[j] = (r >> 8) % 2 ? '\r' : '\n';
+        }
+        from = len > 0 ? random() % (len + 1) : 0;
+        buffers += 2;
+        if(compareEndOfHeaders(buf, 0, len) < 0)
+            failures++;
+        if(compareEndOfHeaders(buf, from, len) < 0)
+            failures++;
+    }
+
+#ifndef WIN32 /*MINGW*/
+    munmap(page, 2 * pagesize);
+#else
+    free(page);
+#endif
+    printf("findEndOfHeaders: %d buffers, %d mismatches\n",
+           buffers, failures);
+    return failures;
+}
+
+static double
+elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return timeval_minus_usec(&now, start) / 1.0E6;
+}
+
+static void
+runBenchmark(const char *name, void (*f)(int), double seconds)
+{
+    struct timeval start;
+    long allocs;
+    double t;
+    int n = 16;
+
+    /* Warm up and calibrate. */
+    while(1) {
+        gettimeofday(&start, NULL);
+        f(n);
+        t = elapsed(&start);
+        if(t >= seconds / 10 || n >= (1 << 28))
+            break;
+        n *= 2;
+    }
+    n = (int)MIN((double)(1 << 30), n * (seconds / MAX(t, 1.0E-6)));
+    n = MAX(n, 16);
+
+    allocs = allocations;
+    gettimeofday(&start, NULL);
+    f(n);
+    t = elapsed(&start);
+    allocs = allocations - allocs;
+
+#ifdef HAVE_ALLOCATION_COUNT
+    printf("%-28s %10.1f ns/op %8.2f allocs/op\n",
+           name, t * 1.0E9 / n, (double)allocs / n);
+#else
+    printf("%-28s %10.1f ns/op\n", name, t * 1.0E9 / n);
+#endif
+}
+
+int
+main(int argc, char **argv)
+{
+    double seconds = 0.5;
+    int check = 0;
+
+    if(argc > 1 && strcmp(argv[1], "check") == 0)
+        check = 1;
+    else if(argc > 1)
+        seconds = atof(argv[1]);
+    if(seconds <= 0) {
+        fprintf(stderr, "%s [ seconds | check ]\n", argv[0]);
+        exit(1);
+    }
+
+    initAtoms();
+    preinitChunks();
+    preinitLog();
+    preinitObject();
+    preinitIo();
+    preinitDns();
+    preinitServer();
+    preinitHttp();
+    preinitDiskcache();
+    preinitLocal();
+    preinitForbidden();
+    preinitSocks();
+    preinitCompress();
+
+    initChunks();
+    initLog();
+    initObject();
+    initHttp();
+    initForbidden();
+
+    if(check)
+        return checkFindEndOfHeaders() + checkDates() == 0 ? 0 : 1;
+
+    makeCorpus();
+    makeReplyObject();
+    makeDates();
+    if(makeBlocklist() < 0) {
+        perror("blocklist");
+        exit(1);
+    }
+
+    runBenchmark("hash", benchHash, seconds);
+    runBenchmark("internAtom (existing)", benchInternAtomHit, seconds);
+    runBenchmark("internAtom (new)", benchInternAtomMiss, seconds);
+    setLiveAtoms(10000);
+    runBenchmark("atom churn (10k atoms)", benchAtomChurn, seconds);
+    setLiveAtoms(1000000);
+    runBenchmark("atom churn (1M atoms)", benchAtomChurn, seconds);
+    setLiveAtoms(0);
+    runBenchmark("parseUrl", benchParseUrl, seconds);
+    runBenchmark("httpParseHeaders", benchParseHeaders, seconds);
+    runBenchmark("findEndOfHeaders", benchFindEndOfHeaders, seconds);
+    runBenchmark("findEndOfHeaders (bytewise)", benchBytewiseEndOfHeaders,
+                 seconds);
+    runBenchmark("reply headers (cache hit)", benchObjectHeaders, seconds);
+    runBenchmark("reply headers (rebuilt)", benchObjectHeadersUncached,
+                 seconds);
+    numDates = 8;
+    runBenchmark("parse_time (8 dates)", benchParseTime, seconds);
+    runBenchmark("format_time (8 dates)", benchFormatTime, seconds);
+    numDates = NUM_DATES;
+    runBenchmark("parse_time (4096 dates)", benchParseTime, seconds);
+    runBenchmark("format_time (4096 dates)", benchFormatTime, seconds);
+    runBenchmark("urlIsUncachable", benchUrlIsUncachable, seconds);
+    runBenchmark("get_chunk/dispose_chunk", benchChunks, seconds);
+    runBenchmark("md5", benchMd5, seconds);
+    runBenchmark("intListCons", benchIntListCons, seconds);
+    return 0;
+}
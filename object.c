@@ -45,6 +45,9 @@ int maxWriteoutWhenIdle = 64 * 1024;
 int maxObjectsWhenIdle = 32;
 int idleTime = 20;
 int dontCacheCookies = 0;
+int negativeCacheTime = 30;
+int negativeErrorTime = 5;
+int negativeCacheHits = 0;
 
 void
 preinitObject()
@@ -77,6 +80,11 @@ preinitObject()
                              "Max age for objects without Last-modified.");
     CONFIG_VARIABLE_SETTABLE(dontCacheCookies, CONFIG_BOOLEAN, configIntSetter,
                              "Work around cachable cookies.");
+    CONFIG_VARIABLE_SETTABLE(negativeCacheTime, CONFIG_TIME, configIntSetter,
+                             "Max age for 404 and 410 replies "
+                             "without Expires.");
+    CONFIG_VARIABLE_SETTABLE(negativeErrorTime, CONFIG_TIME, configIntSetter,
+                             "Max age for server errors without Expires.");
 }
 
 void
@@ -234,6 +242,7 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     initCondition(&object->condition);
     object->headers = NULL;
     object->via = NULL;
+    object->header_cache = NULL;
     object->numchunks = 0;
     object->chunks = NULL;
     object->length = -1;
@@ -341,7 +350,8 @@ objectSetChunks(ObjectPtr object, int numchunks)
         return 0;
 
     if(object->length >= 0)
-        n = MAX(numchunks, (object->length + (CHUNK_SIZE - 1)) / CHUNK_SIZE);
+        n = MAX(numchunks,
+                (int)((object->length + (CHUNK_SIZE - 1)) / CHUNK_SIZE));
     else
         n = MAX(numchunks, 
                 MAX(object->numchunks + 2, object->numchunks * 5 / 4));
@@ -368,7 +378,7 @@ objectSetChunks(ObjectPtr object, int numchunks)
 }
 
 ObjectPtr
-objectPartial(ObjectPtr object, int length, struct _Atom *headers)
+objectPartial(ObjectPtr object, long long length, struct _Atom *headers)
 {
     object->headers = headers;
 
@@ -391,7 +401,7 @@ objectPartial(ObjectPtr object, int length, struct _Atom *headers)
 }
 
 static int
-objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
+objectAddChunk(ObjectPtr object, const char *data, long long offset, int plen)
 {
     int i = offset / CHUNK_SIZE;
     int rc;
@@ -431,7 +441,8 @@ objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
 }
 
 static int
-objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
+objectAddChunkEnd(ObjectPtr object, const char *data,
+                  long long offset, int plen)
 {
     int i = offset / CHUNK_SIZE;
     int rc;
@@ -475,11 +486,11 @@ objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
 }
 
 int
-objectAddData(ObjectPtr object, const char *data, int offset, int len)
+objectAddData(ObjectPtr object, const char *data, long long offset, int len)
 {
     int rc;
 
-    do_log(D_OBJECT_DATA, "Adding data to 0x%lx (%d) at %d: %d bytes\n",
+    do_log(D_OBJECT_DATA, "Adding data to 0x%lx (%lld) at %lld: %d bytes\n",
            (unsigned long)object, object->length, offset, len);
 
     if(len == 0)
@@ -488,7 +499,8 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
     if(object->length >= 0) {
         if(offset + len > object->length) {
             do_log(L_ERROR, 
-                   "Inconsistent object length (%d, should be at least %d).\n",
+                   "Inconsistent object length (%lld, "
+                   "should be at least %lld).\n",
                    object->length, offset + len);
             object->length = offset + len;
         }
@@ -496,7 +508,7 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
             
     object->flags &= ~OBJECT_FAILED;
 
-    if(offset + len >= object->numchunks * CHUNK_SIZE) {
+    if(offset + len >= (long long)object->numchunks * CHUNK_SIZE) {
         rc = objectSetChunks(object, (offset + len - 1) / CHUNK_SIZE + 1);
         if(rc < 0) {
             return -1;
@@ -531,7 +543,7 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
 }
 
 void
-objectPrintf(ObjectPtr object, int offset, const char *format, ...)
+objectPrintf(ObjectPtr object, long long offset, const char *format, ...)
 {
     char *buf;
     int rc;
@@ -552,10 +564,11 @@ objectPrintf(ObjectPtr object, int offset, const char *format, ...)
         abortObject(object, 500, internAtom("Couldn't add data to object"));
 }
 
-int 
-objectHoleSize(ObjectPtr object, int offset)
+long long
+objectHoleSize(ObjectPtr object, long long offset)
 {
-    int size = 0, i;
+    long long size = 0;
+    int i;
 
     if(offset < 0 || offset / CHUNK_SIZE >= object->numchunks)
         return -1;
@@ -589,9 +602,10 @@ objectHoleSize(ObjectPtr object, int offset)
    If the client request was a Range request, from & to specify the requested
    range; otherwise 'from' is 0 and 'to' is -1. */
 int
-objectHasData(ObjectPtr object, int from, int to)
+objectHasData(ObjectPtr object, long long from, long long to)
 {
-    int first, last, i, upto;
+    int first, last, i;
+    long long upto;
 
     if(to < 0) {
         if(object->length >= 0)
@@ -619,7 +633,7 @@ objectHasData(ObjectPtr object, int from, int to)
 
     for(i = last - 1; i >= first; i--) {
         if(object->chunks[i].size < CHUNK_SIZE) {
-            upto = (i + 1) * CHUNK_SIZE;
+            upto = (long long)(i + 1) * CHUNK_SIZE;
             goto disk;
         }
     }
@@ -657,6 +671,7 @@ destroyObject(ObjectPtr object)
         if(object->headers) releaseAtom(object->headers);
         if(object->etag) free(object->etag);
         if(object->via) releaseAtom(object->via);
+        discardObjectHeaderCache(object);
         for(i = 0; i < object->numchunks; i++) {
             assert(!object->chunks[i].locked);
             if(object->chunks[i].data)
@@ -670,6 +685,19 @@ destroyObject(ObjectPtr object)
     }
 }
 
+void
+discardObjectHeaderCache(ObjectPtr object)
+{
+    ObjectHeaderCachePtr cache = object->header_cache;
+    if(cache == NULL)
+        return;
+    if(cache->headers) releaseAtom(cache->headers);
+    if(cache->via) releaseAtom(cache->via);
+    if(cache->etag) free(cache->etag);
+    free(cache);
+    object->header_cache = NULL;
+}
+
 void
 privatiseObject(ObjectPtr object, int linear) 
 {
@@ -808,6 +836,23 @@ writeoutObjects(int all)
     diskIsClean = 1;
 }
 
+/* Forget about all the negative replies we are holding. */
+void
+discardNegativeObjects()
+{
+    ObjectPtr object, next;
+
+    object = object_list;
+    while(object) {
+        next = object->next;
+        if(NEGATIVE_CODE(object->code) &&
+           object->type == OBJECT_HTTP &&
+           !(object->flags & (OBJECT_INPROGRESS | OBJECT_LOCAL)))
+            supersedeObject(object);
+        object = next;
+    }
+}
+
 int
 discardObjects(int all, int force)
 {
@@ -837,7 +882,8 @@ discardObjects(int all, int force)
                     if(object->chunks[j].size < CHUNK_SIZE) {
                         continue;
                     }
-                    writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
+                    writeoutToDisk(object,
+                                   (long long)(j + 1) * CHUNK_SIZE, -1);
                     dispose_chunk(object->chunks[j].data);
                     object->chunks[j].data = NULL;
                     object->chunks[j].size = 0;
@@ -882,7 +928,8 @@ discardObjects(int all, int force)
                             continue;
                         if(object->chunks[j].size < CHUNK_SIZE)
                             continue;
-                        writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
+                        writeoutToDisk(object,
+                                       (long long)(j + 1) * CHUNK_SIZE, -1);
                         dispose_chunk(object->chunks[j].data);
                         object->chunks[j].data = NULL;
                         object->chunks[j].size = 0;
@@ -982,7 +1029,11 @@ objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
 
     if(object->expires < 0 && object->max_age < 0) {
         /* No server-side information -- heuristic expiration */
-        if(object->last_modified >= 0)
+        if(SERVER_ERROR_CODE(object->code))
+            stale = MIN(stale, object->age + negativeErrorTime);
+        else if(NEGATIVE_CODE(object->code))
+            stale = MIN(stale, object->age + negativeCacheTime);
+        else if(object->last_modified >= 0)
             /* Again, take care of clock skew */
             stale = MIN(stale,
                         object->age +
@@ -1038,3 +1089,359 @@ objectMustRevalidate(ObjectPtr object, CacheControlPtr cache_control)
     return 0;
 }
 
+
+/* When chunk memory is backed by a file (chunkArenaFile), the table
+   of in-memory objects is saved on exit next to it, and read back on
+   startup.  Chunks are named by their position in the arena file, so
+   restoring an object is just a matter of reattaching its chunks. */
+
+#define OBJECT_TABLE_MAGIC "Polipo object table 2\n"
+
+typedef struct _ObjectTableHeader {
+    char magic[sizeof(OBJECT_TABLE_MAGIC)];
+    int chunk_size;
+    int slots;
+    int count;
+} ObjectTableHeaderRec;
+
+typedef struct _ObjectTableEntry {
+    int key_size;
+    int headers_size;
+    int message_size;
+    int via_size;
+    int etag_size;
+    int code;
+    int flags;
+    int cache_control;
+    long long length;
+    int max_age;
+    int s_maxage;
+    int numchunks;
+    time_t date;
+    time_t age;
+    time_t expires;
+    time_t last_modified;
+    time_t atime;
+} ObjectTableEntryRec;
+
+typedef struct _ObjectTableChunk {
+    int index;
+    int size;
+    int number;
+} ObjectTableChunkRec;
+
+static char *
+objectTableFilename()
+{
+    if(chunkArenaSlots() <= 0)
+        return NULL;
+    return sprintf_a("%s.objects", chunkArenaFile->string);
+}
+
+static int
+objectIsSaveable(ObjectPtr object)
+{
+    return object->type == OBJECT_HTTP && object->code != 0 &&
+        (object->flags & OBJECT_PUBLIC) &&
+        !(object->flags & (OBJECT_INITIAL | OBJECT_ABORTED |
+                           OBJECT_SUPERSEDED | OBJECT_LINEAR |
+                           OBJECT_VALIDATING | OBJECT_LOCAL)) &&
+        !(object->cache_control & CACHE_NO_STORE);
+}
+
+static int
+writeBytes(FILE *f, const void *data, int n)
+{
+    if(n <= 0)
+        return 1;
+    return fwrite(data, n, 1, f) == 1 ? 1 : -1;
+}
+
+void
+writeoutObjectTable()
+{
+    ObjectTableHeaderRec header;
+    ObjectTableEntryRec entry;
+    ObjectTableChunkRec c;
+    ObjectPtr object;
+    char *name, *tmpname = NULL;
+    FILE *f = NULL;
+    int i, rc, count = 0, chunks = 0;
+
+    name = objectTableFilename();
+    if(name == NULL)
+        return;
+    tmpname = sprintf_a("%s.tmp", name);
+    if(tmpname == NULL)
+        goto fail;
+
+    f = fopen(tmpname, "wb");
+    if(f == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmpname);
+        goto fail;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_TABLE_MAGIC, sizeof(OBJECT_TABLE_MAGIC));
+    header.chunk_size = CHUNK_SIZE;
+    header.slots = chunkArenaSlots();
+    header.count = 0;
+    rc = writeBytes(f, &header, sizeof(header));
+    if(rc < 0) goto write_fail;
+
+    /* Least recently used first, so that restoring preserves the order. */
+    for(object = object_list_end; object; object = object->previous) {
+        if(!objectIsSaveable(object))
+            continue;
+        memset(&entry, 0, sizeof(entry));
+        entry.key_size = object->key_size;
+        entry.headers_size = object->headers ? object->headers->length : 0;
+        entry.message_size = object->message ? object->message->length : 0;
+        entry.via_size = object->via ? object->via->length : 0;
+        entry.etag_size = object->etag ? strlen(object->etag) : 0;
+        entry.code = object->code;
+        entry.flags = object->flags & OBJECT_DYNAMIC;
+        entry.cache_control = object->cache_control;
+        entry.length = object->length;
+        entry.max_age = object->max_age;
+        entry.s_maxage = object->s_maxage;
+        entry.date = object->date;
+        entry.age = object->age;
+        entry.expires = object->expires;
+        entry.last_modified = object->last_modified;
+        entry.atime = object->atime;
+        entry.numchunks = 0;
+        for(i = 0; i < object->numchunks; i++) {
+            if(object->chunks[i].data && object->chunks[i].size > 0 &&
+               chunkNumber(object->chunks[i].data) >= 0)
+                entry.numchunks++;
+        }
+
+        rc = writeBytes(f, &entry, sizeof(entry));
+        if(rc >= 0) rc = writeBytes(f, object->key, entry.key_size);
+        if(rc >= 0 && object->headers)
+            rc = writeBytes(f, object->headers->string, entry.headers_size);
+        if(rc >= 0 && object->message)
+            rc = writeBytes(f, object->message->string, entry.message_size);
+        if(rc >= 0 && object->via)
+            rc = writeBytes(f, object->via->string, entry.via_size);
+        if(rc >= 0 && object->etag)
+            rc = writeBytes(f, object->etag, entry.etag_size);
+        if(rc < 0) goto write_fail;
+
+        for(i = 0; i < object->numchunks; i++) {
+            if(!object->chunks[i].data || object->chunks[i].size == 0)
+                continue;
+            c.number = chunkNumber(object->chunks[i].data);
+            if(c.number < 0)
+                continue;
+            c.index = i;
+            c.size = object->chunks[i].size;
+            rc = writeBytes(f, &c, sizeof(c));
+            if(rc < 0) goto write_fail;
+            chunks++;
+        }
+        count++;
+    }
+
+    header.count = count;
+    rc = fseek(f, 0, SEEK_SET);
+    if(rc >= 0) rc = writeBytes(f, &header, sizeof(header));
+    if(rc < 0) goto write_fail;
+    rc = fclose(f);
+    f = NULL;
+    if(rc != 0) goto write_fail;
+
+    rc = rename(tmpname, name);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't rename %s", tmpname);
+        goto fail;
+    }
+    do_log(L_INFO, "Saved %d objects (%d chunks) to %s.\n",
+           count, chunks, name);
+    free(tmpname);
+    free(name);
+    return;
+
+ write_fail:
+    do_log_error(L_ERROR, errno, "Couldn't write %s", tmpname);
+ fail:
+    if(f) fclose(f);
+    if(tmpname) {
+        unlink(tmpname);
+        free(tmpname);
+    }
+    free(name);
+}
+
+static int
+readBytes(FILE *f, void *data, int n)
+{
+    if(n <= 0)
+        return 1;
+    return fread(data, n, 1, f) == 1 ? 1 : -1;
+}
+
+static AtomPtr
+readAtom(FILE *f, int n, char *buf)
+{
+    if(n <= 0)
+        return NULL;
+    if(readBytes(f, buf, n) < 0)
+        return NULL;
+    return internAtomN(buf, n);
+}
+
+void
+restoreObjectTable()
+{
+    ObjectTableHeaderRec header;
+    ObjectTableEntryRec entry;
+    ObjectTableChunkRec c;
+    ObjectPtr object;
+    char *name, *buf = NULL;
+    FILE *f;
+    int i, j, rc, count = 0, chunks = 0;
+
+    name = objectTableFilename();
+    if(name == NULL)
+        return;
+
+    f = fopen(name, "rb");
+    if(f == NULL) {
+        if(errno != ENOENT)
+            do_log_error(L_ERROR, errno, "Couldn't open %s", name);
+        free(name);
+        return;
+    }
+
+    /* The chunks named in the table are going to be reused, so it must
+       never be read twice -- e.g. after a crash. */
+    unlink(name);
+
+    rc = readBytes(f, &header, sizeof(header));
+    if(rc < 0 ||
+       memcmp(header.magic, OBJECT_TABLE_MAGIC,
+              sizeof(OBJECT_TABLE_MAGIC)) != 0 ||
+       header.chunk_size != CHUNK_SIZE || header.slots != chunkArenaSlots()) {
+        do_log(L_WARN, "Object table %s doesn't match -- ignored.\n", name);
+        goto done;
+    }
+
+    /* Atom lengths are at most 16 bits. */
+    buf = malloc(0x10000);
+    if(buf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate buffer.\n");
+        goto done;
+    }
+
+    for(i = 0; i < header.count; i++) {
+        AtomPtr headers, message, via;
+        char *etag = NULL;
+
+        rc = readBytes(f, &entry, sizeof(entry));
+        if(rc < 0 ||
+           entry.key_size <= 0 || entry.key_size >= 50000 ||
+           entry.headers_size < 0 || entry.headers_size >= 0x10000 ||
+           entry.message_size < 0 || entry.message_size >= 0x10000 ||
+           entry.via_size < 0 || entry.via_size >= 0x10000 ||
+           entry.etag_size < 0 || entry.etag_size >= 0x10000 ||
+           entry.numchunks < 0)
+            goto corrupt;
+
+        rc = readBytes(f, buf, entry.key_size);
+        if(rc < 0) goto corrupt;
+        object = makeObject(OBJECT_HTTP, buf, entry.key_size, 1, 0,
+                            httpServerRequest, NULL);
+        if(object && !(object->flags & OBJECT_INITIAL)) {
+            releaseObject(object);
+            object = NULL;
+        }
+
+        headers = readAtom(f, entry.headers_size, buf);
+        message = readAtom(f, entry.message_size, buf);
+        via = readAtom(f, entry.via_size, buf);
+        if(entry.etag_size > 0 && readBytes(f, buf, entry.etag_size) >= 0)
+            etag = strdup_n(buf, entry.etag_size);
+
+        if(object) {
+            object->headers = headers;
+            object->message = message;
+            object->via = via;
+            object->etag = etag;
+            object->code = entry.code;
+            object->flags |= entry.flags & OBJECT_DYNAMIC;
+            object->flags &= ~OBJECT_INITIAL;
+            object->cache_control = entry.cache_control;
+            object->length = entry.length;
+            object->max_age = entry.max_age;
+            object->s_maxage = entry.s_maxage;
+            object->date = entry.date;
+            object->age = entry.age;
+            object->expires = entry.expires;
+            object->last_modified = entry.last_modified;
+            object->atime = entry.atime;
+            if(entry.numchunks > 0) {
+                rc = objectSetChunks(object, 1);
+                if(rc < 0) {
+                    abortObject(object, 500,
+                                internAtom("Couldn't restore object"));
+                    releaseObject(object);
+                    object = NULL;
+                }
+            }
+        } else {
+            releaseAtom(headers);
+            releaseAtom(message);
+            releaseAtom(via);
+            if(etag) free(etag);
+        }
+
+        for(j = 0; j < entry.numchunks; j++) {
+            void *data;
+            rc = readBytes(f, &c, sizeof(c));
+            if(rc < 0) {
+                if(object) releaseObject(object);
+                goto corrupt;
+            }
+            if(!object || c.index < 0 || c.size <= 0 || c.size > CHUNK_SIZE)
+                continue;
+            if(object->length >= 0 &&
+               (long long)c.index * CHUNK_SIZE + c.size > object->length)
+                continue;
+            if(c.index >= object->numchunks) {
+                rc = objectSetChunks(object, c.index + 1);
+                if(rc < 0)
+                    continue;
+            }
+            if(object->chunks[c.index].data)
+                continue;
+            data = attachChunk(c.number);
+            if(data == NULL)
+                continue;
+            object->chunks[c.index].data = data;
+            object->chunks[c.index].size = c.size;
+            object->size = MAX(object->size,
+                               (long long)c.index * CHUNK_SIZE + c.size);
+            chunks++;
+        }
+
+        if(object) {
+            releaseObject(object);
+            count++;
+        }
+    }
+
+ done:
+    if(count > 0)
+        do_log(L_INFO, "Restored %d objects (%d chunks) from %s.\n",
+               count, chunks, name);
+    if(buf) free(buf);
+    fclose(f);
+    free(name);
+    return;
+
+ corrupt:
+    do_log(L_ERROR, "Object table %s is corrupt.\n", name);
+    goto done;
+}
@@ -42,7 +42,23 @@ typedef struct _Chunk {
 
 struct _Object;
 
-typedef int (*RequestFunction)(struct _Object *, int, int, int,
+/* The part of an object's reply headers that doesn't depend on the
+   request, as last serialised by httpWriteObjectHeaders, together with
+   the values it was computed from. */
+typedef struct _ObjectHeaderCache {
+    struct _Atom *headers;
+    struct _Atom *via;
+    char *etag;
+    time_t date;
+    time_t last_modified;
+    time_t expires;
+    unsigned short cache_control;
+    int disable_via;
+    int length;
+    char data[1];
+} ObjectHeaderCacheRec, *ObjectHeaderCachePtr;
+
+typedef int (*RequestFunction)(struct _Object *, int, long long, long long,
                                struct _HTTPRequest*, void*);
 
 typedef struct _Object {
@@ -56,7 +72,7 @@ typedef struct _Object {
     unsigned short code;
     void *abort_data;
     struct _Atom *message;
-    int length;
+    long long length;
     time_t date;
     time_t age;
     time_t expires;
@@ -68,7 +84,8 @@ typedef struct _Object {
     int s_maxage;
     struct _Atom *headers;
     struct _Atom *via;
-    int size;
+    ObjectHeaderCachePtr header_cache;
+    long long size;
     int numchunks;
     ChunkPtr chunks;
     void *requestor;
@@ -93,6 +110,12 @@ extern int objectExpiryScheduled;
 extern int publicObjectCount;
 extern int privateObjectCount;
 extern int idleTime;
+extern int negativeCacheTime, negativeErrorTime, negativeCacheHits;
+
+#define SERVER_ERROR_CODE(code) \
+    ((code) == 500 || (code) == 502 || (code) == 503 || (code) == 504)
+#define NEGATIVE_CODE(code) \
+    ((code) == 404 || (code) == 410 || SERVER_ERROR_CODE(code))
 
 extern const time_t time_t_max;
 
@@ -103,6 +126,7 @@ extern int log2ObjectHashTableSize;
 /* object->type */
 #define OBJECT_HTTP 1
 #define OBJECT_DNS 2
+#define OBJECT_COMPRESSED 3
 
 /* object->flags */
 /* object is public */
@@ -166,8 +190,7 @@ void initObject(void);
 ObjectPtr findObject(int type, const void *key, int key_size);
 ObjectPtr makeObject(int type, const void *key, int key_size,
                      int public, int fromdisk,
-                     int (*request)(ObjectPtr, int, int, int, 
-                                    struct _HTTPRequest*, void*), void*);
+                     RequestFunction request, void*);
 void objectMetadataChanged(ObjectPtr object, int dirty);
 ObjectPtr retainObject(ObjectPtr);
 void releaseObject(ObjectPtr);
@@ -180,18 +203,24 @@ void abortObject(ObjectPtr object, int code, struct _Atom *message);
 void supersedeObject(ObjectPtr);
 void notifyObject(ObjectPtr);
 void releaseNotifyObject(ObjectPtr);
-ObjectPtr objectPartial(ObjectPtr object, int length, struct _Atom *headers);
-int objectHoleSize(ObjectPtr object, int offset)
+ObjectPtr objectPartial(ObjectPtr object, long long length,
+                        struct _Atom *headers);
+long long objectHoleSize(ObjectPtr object, long long offset)
     ATTRIBUTE ((pure));
-int objectHasData(ObjectPtr object, int from, int to)
+int objectHasData(ObjectPtr object, long long from, long long to)
     ATTRIBUTE ((pure));
-int objectAddData(ObjectPtr object, const char *data, int offset, int len);
-void objectPrintf(ObjectPtr object, int offset, const char *format, ...)
+int objectAddData(ObjectPtr object, const char *data,
+                  long long offset, int len);
+void objectPrintf(ObjectPtr object, long long offset, const char *format, ...)
      ATTRIBUTE ((format (printf, 3, 4)));
 int discardObjectsHandler(TimeEventHandlerPtr);
 void writeoutObjects(int);
 int discardObjects(int all, int force);
+void discardNegativeObjects(void);
 int objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
     ATTRIBUTE ((pure));
 int objectMustRevalidate(ObjectPtr object, CacheControlPtr cache_control)
     ATTRIBUTE ((pure));
+void discardObjectHeaderCache(ObjectPtr object);
+void writeoutObjectTable(void);
+void restoreObjectTable(void);
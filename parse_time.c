@@ -128,8 +128,59 @@ skip_separator(const char *buf, int i, int len)
     return i;
 }
 
+static int parse_time_1(const char *buf, int offset, int len,
+                        time_t *time_return);
+
+/* The same few dates turn up over and over again, so we keep a small
+   direct-mapped memo of recently parsed strings.  Only the exact
+   string is remembered, including any trailing garbage. */
+
+#define TIME_MEMO_SIZE 32
+#define TIME_MEMO_LENGTH 40
+
+typedef struct _TimeMemo {
+    char string[TIME_MEMO_LENGTH];
+    int length;
+    int consumed;               /* -1 on failure */
+    time_t time;
+} TimeMemoRec;
+
+static TimeMemoRec time_memo[TIME_MEMO_SIZE];
+
 int
 parse_time(const char *buf, int offset, int len, time_t *time_return)
+{
+    TimeMemoRec *memo;
+    unsigned int h = 0;
+    time_t t;
+    int i, n = len - offset;
+
+    if(n <= 0 || n > TIME_MEMO_LENGTH)
+        return parse_time_1(buf, offset, len, time_return);
+
+    for(i = 0; i < n; i++)
+        h = h * 31 + (unsigned char)buf[offset + i];
+    memo = &time_memo[h % TIME_MEMO_SIZE];
+
+    if(memo->length == n && memcmp(memo->string, buf + offset, n) == 0) {
+        if(memo->consumed < 0)
+            return -1;
+        *time_return = memo->time;
+        return offset + memo->consumed;
+    }
+
+    i = parse_time_1(buf, offset, len, &t);
+    memcpy(memo->string, buf + offset, n);
+    memo->length = n;
+    memo->consumed = i < 0 ? -1 : i - offset;
+    memo->time = t;
+    if(i >= 0)
+        *time_return = t;
+    return i;
+}
+
+static int
+parse_time_1(const char *buf, int offset, int len, time_t *time_return)
 {
     struct tm tm;
     time_t t;
@@ -196,20 +247,48 @@ parse_time(const char *buf, int offset, int len, time_t *time_return)
     return i;
 }
 
+/* Formatting is similarly cached.  Most of the dates we format are
+   either the current time or one of a handful of object dates. */
+
+#define TIME_CACHE_SIZE 16
+
+typedef struct _TimeCache {
+    time_t time;
+    int length;
+    char string[32];
+} TimeCacheRec;
+
+static TimeCacheRec time_cache[TIME_CACHE_SIZE];
+
 int
 format_time(char *buf, int i, int len, time_t t)
 {
+    TimeCacheRec *cache;
     struct tm *tm;
     int rc;
 
     if(i < 0 || i > len)
         return -1;
 
-    tm = gmtime(&t);
-    if(tm == NULL)
-        return -1;
-    rc = strftime(buf + i, len - i, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    if(rc <= 0)                 /* yes, that's <= */
+    cache = &time_cache[(unsigned long)t % TIME_CACHE_SIZE];
+    if(cache->length <= 0 || cache->time != t) {
+        tm = gmtime(&t);
+        if(tm == NULL)
+            return -1;
+        rc = strftime(cache->string, sizeof(cache->string),
+                      "%a, %d %b %Y %H:%M:%S GMT", tm);
+        if(rc <= 0) {           /* yes, that's <= */
+            cache->length = 0;
+            return -1;
+        }
+        cache->length = rc;
+        cache->time = t;
+    }
+
+    /* strftime needs room for the terminating NUL */
+    if(len - i <= cache->length)
         return -1;
-    return i + rc;
+    memcpy(buf + i, cache->string, cache->length);
+    buf[i + cache->length] = '\0';
+    return i + cache->length;
 }
@@ -24,6 +24,10 @@ THE SOFTWARE.
 #define _GNU_SOURCE
 #endif
 
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #ifndef WIN32
 #include <sys/param.h>
 #endif
@@ -215,6 +219,7 @@ THE SOFTWARE.
 #include "log.h"
 #include "auth.h"
 #include "tunnel.h"
+#include "compress.h"
 
 extern AtomPtr configFile;
 extern int daemonise;
@@ -40,13 +40,35 @@ int maxSideBuffering = 1500;
 int maxConnectionAge = 1260;
 int maxConnectionRequests = 400;
 int alwaysAddNoTransform = 0;
+int serverWarmConnections = 0;
+int serverWarmServers = 8;
+int negativeServerTime = 10;
+int negativeServerHits = 0;
+int serverConnections = 0, serverConnectionsOpened = 0;
+int quickAbortMin = 16 * 1024;
+int quickAbortMax = 1024 * 1024;
+int quickAbortPercent = 95;
+int quickAbortContinued = 0;
+long long quickAbortSaved = 0, quickAbortWasted = 0;
+int rangeFillPercent = -1;
+int rangeCoalesced = 0, rangeFills = 0;
 
 static HTTPServerPtr servers = 0;
 
+/* Servers are also hashed on (name, port, isProxy). */
+#define LOG2_SERVER_HASH_TABLE_SIZE 10
+static HTTPServerPtr serverHashTable[1 << LOG2_SERVER_HASH_TABLE_SIZE];
+
+#define WARM_INTERVAL 10
+#define MAX_WARM_SERVERS 64
+
 static int httpServerContinueConditionHandler(int, ConditionHandlerPtr);
 static int initParentProxy(void);
 static int parentProxySetter(ConfigVariablePtr var, void *value);
 static void httpServerDelayedFinish(HTTPConnectionPtr);
+static int warmServersHandler(TimeEventHandlerPtr);
+static void httpServerScheduleFill(ObjectPtr object);
+static void httpServerFillObject(ObjectPtr object);
 static int allowUnalignedRangeRequests = 0;
 
 void
@@ -95,6 +117,33 @@ preinitServer(void)
                              "Maximum number of requests on a server-side connection.");
     CONFIG_VARIABLE(alwaysAddNoTransform, CONFIG_BOOLEAN,
                     "If true, add a no-transform directive to all requests.");
+    CONFIG_VARIABLE_SETTABLE(serverWarmConnections, CONFIG_INT,
+                             configIntSetter,
+                             "Idle connections to keep open to busy servers.");
+    CONFIG_VARIABLE_SETTABLE(serverWarmServers, CONFIG_INT, configIntSetter,
+                             "Number of busy servers to keep connections to.");
+    CONFIG_VARIABLE_SETTABLE(negativeServerTime, CONFIG_TIME, configIntSetter,
+                             "Time during which a connect failure "
+                             "is remembered.");
+    CONFIG_VARIABLE_SETTABLE(quickAbortMin, CONFIG_INT, configIntSetter,
+                             "Finish a download abandoned by the client "
+                             "if this much remains.");
+    CONFIG_VARIABLE_SETTABLE(quickAbortMax, CONFIG_INT, configIntSetter,
+                             "Abort a download abandoned by the client "
+                             "if more than this remains.");
+    CONFIG_VARIABLE_SETTABLE(quickAbortPercent, CONFIG_INT, configIntSetter,
+                             "Finish a download abandoned by the client "
+                             "if this percentage has arrived.");
+    CONFIG_VARIABLE_SETTABLE(rangeFillPercent, CONFIG_INT, configIntSetter,
+                             "Fetch the rest of a partial object once this "
+                             "percentage is in memory.");
+}
+
+static int
+serverHash(char *name, int port, int proxy)
+{
+    return hash(port * 2 + (proxy ? 1 : 0), name, strlen(name),
+                LOG2_SERVER_HASH_TABLE_SIZE);
 }
 
 static int
@@ -109,6 +158,7 @@ static void
 discardServer(HTTPServerPtr server)
 {
     HTTPServerPtr previous;
+    int h;
     assert(!server->request);
 
     if(server == servers)
@@ -120,16 +170,42 @@ discardServer(HTTPServerPtr server)
         previous->next = server->next;
     }
 
+    h = serverHash(server->name, server->port, server->isProxy);
+    if(server == serverHashTable[h])
+        serverHashTable[h] = server->hash_next;
+    else {
+        previous = serverHashTable[h];
+        while(previous->hash_next != server)
+            previous = previous->hash_next;
+        previous->hash_next = server->hash_next;
+    }
+
     if(server->connection)
         free(server->connection);
     if(server->idleHandler)
         free(server->idleHandler);
     if(server->name)
         free(server->name);
+    if(server->failure)
+        releaseAtom(server->failure);
 
     free(server);
 }
 
+/* Forget about recent connect failures. */
+void
+discardServerFailures()
+{
+    HTTPServerPtr server;
+
+    for(server = servers; server; server = server->next) {
+        server->failed = 0;
+        if(server->failure)
+            releaseAtom(server->failure);
+        server->failure = NULL;
+    }
+}
+
 static int
 httpServerIdle(HTTPServerPtr server)
 {
@@ -219,6 +295,7 @@ initServer(void)
 {
     TimeEventHandlerPtr event;
     servers = NULL;
+    memset(serverHashTable, 0, sizeof(serverHashTable));
 
     if(pmmFirstSize || pmmSize) {
         if(pmmSize == 0) pmmSize = pmmFirstSize;
@@ -246,18 +323,25 @@ initServer(void)
         do_log(L_ERROR, "Couldn't schedule server expiry.\n");
         exit(1);
     }
+
+    event = scheduleTimeEvent(WARM_INTERVAL, warmServersHandler, 0, NULL);
+    if(event == NULL) {
+        do_log(L_ERROR, "Couldn't schedule connection warming.\n");
+        exit(1);
+    }
 }
 
 static HTTPServerPtr
 getServer(char *name, int port, int proxy)
 {
     HTTPServerPtr server;
-    int i;
+    int i, h;
 
-    server = servers;
+    h = serverHash(name, port, proxy);
+    server = serverHashTable[h];
     while(server) {
-        if(strcmp(server->name, name) == 0 && server->port == port &&
-           server->isProxy == proxy) {
+        if(server->port == port && server->isProxy == proxy &&
+           strcmp(server->name, name) == 0) {
             if(httpServerIdle(server) &&
                server->time +  serverExpireTime < current_time.tv_sec) {
                 discardServer(server);
@@ -268,7 +352,7 @@ getServer(char *name, int port, int proxy)
                 return server;
             }
         }
-        server = server->next;
+        server = server->hash_next;
     }
     
     server = malloc(sizeof(HTTPServerRec));
@@ -318,16 +402,23 @@ getServer(char *name, int port, int proxy)
     server->request = NULL;
     server->request_last = NULL;
     server->lies = 0;
+    server->uses = 0;
+    server->failed = 0;
+    server->failure = NULL;
 
     server->next = servers;
     servers = server;
+    server->hash_next = serverHashTable[h];
+    serverHashTable[h] = server;
     return server;
 }
 
 int
 httpServerQueueRequest(HTTPServerPtr server, HTTPRequestPtr request)
 {
-    assert(request->request && request->request->request == request);
+    assert(request->request ?
+           request->request->request == request :
+           (request->flags & REQUEST_DETACHED));
     assert(request->connection == NULL);
     if(server->request) {
         server->request_last->next = request;
@@ -383,20 +474,80 @@ httpServerAbortRequest(HTTPRequestPtr request, int fail,
     }
 }
 
+/* Decide whether a reply whose client went away is worth finishing in
+   the background, so that the object ends up complete in the cache.
+   This gets called again as data arrives, so the answer may change.
+   Refs is the number of references to the object held by this request
+   and by the client request being reset, if any. */
+static int
+httpServerDetachedContinue(HTTPRequestPtr request, int refs)
+{
+    HTTPConnectionPtr connection = request->connection;
+    ObjectPtr object = request->object;
+    long long to, remaining;
+
+    /* A background fetch, see httpServerFillObject. */
+    if((request->flags & REQUEST_DETACHED) && request->detached < 0)
+        return 1;
+
+    if(request->method != METHOD_GET &&
+       request->method != METHOD_CONDITIONAL_GET)
+        return 0;
+    /* The reply headers must have arrived. */
+    if(request->time1.tv_sec == null_time.tv_sec)
+        return 0;
+    if(!(object->flags & OBJECT_PUBLIC) ||
+       (object->flags & (OBJECT_FAILED | OBJECT_INITIAL)) ||
+       (object->cache_control & (CACHE_NO_STORE | CACHE_NO_HIDDEN)))
+        return 0;
+
+    /* Other clients hold this object, typically waiting for a further
+       range; rather than aborting and letting each of them fetch its
+       own range, keep going. */
+    if(object->refcount > refs)
+        return 1;
+
+    to = request->to >= 0 ? request->to : object->length;
+    if(to < 0 || to <= connection->offset)
+        return 0;
+    remaining = to - connection->offset;
+
+    if(remaining > quickAbortMax)
+        return 0;
+    if(remaining <= quickAbortMin)
+        return 1;
+    if(quickAbortPercent <= 100 &&
+       connection->offset * 100 >= to * quickAbortPercent)
+        return 1;
+    return 0;
+}
+
 void 
 httpServerClientReset(HTTPRequestPtr request)
 {
     if(request->connection && 
        request->connection->fd >= 0 &&
        !request->connection->connecting &&
-       request->connection->request == request)
+       request->connection->request == request) {
+        if(request->request == NULL &&
+           httpServerDetachedContinue(request, 2)) {
+            if(!(request->flags & REQUEST_DETACHED)) {
+                do_log(D_SERVER_CONN, "Finishing %s in the background.\n",
+                       scrub(request->object->key));
+                request->flags |= REQUEST_DETACHED;
+                request->detached = request->connection->offset;
+            }
+            return;
+        }
         pokeFdEvent(request->connection->fd, -ECLIENTRESET, POLLIN | POLLOUT);
+    }
 }
 
 
 int
 httpMakeServerRequest(char *name, int port, ObjectPtr object, 
-                  int method, int from, int to, HTTPRequestPtr requestor)
+                      int method, long long from, long long to,
+                      HTTPRequestPtr requestor)
 {
     HTTPServerPtr server;
     HTTPRequestPtr request;
@@ -410,6 +561,7 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
         server = getServer(name, port, 0);
     }
     if(server == NULL) return -1;
+    server->uses++;
 
     object->flags |= OBJECT_INPROGRESS;
     object->requestor = requestor;
@@ -438,14 +590,19 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
         if(server->lies > 0)
             request->method = METHOD_HEAD;
     }
-    request->flags =
-        REQUEST_PERSISTENT |
-        (expectContinue ? (requestor->flags & REQUEST_WAIT_CONTINUE) : 0);
+    request->flags = REQUEST_PERSISTENT;
     request->from = from;
     request->to = to;
     request->request = requestor;
-    requestor->request = request;
-    request->cache_control = requestor->cache_control;
+    if(requestor) {
+        if(expectContinue)
+            request->flags |= requestor->flags & REQUEST_WAIT_CONTINUE;
+        requestor->request = request;
+        request->cache_control = requestor->cache_control;
+    } else {
+        /* A background fetch, see httpServerFillObject. */
+        request->flags |= REQUEST_DETACHED;
+    }
     request->time0 = null_time;
     request->time1 = null_time;
 
@@ -453,7 +610,8 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
     if(rc < 0) {
         do_log(L_ERROR, "Couldn't queue request.\n");
         request->request = NULL;
-        requestor->request = NULL;
+        if(requestor)
+            requestor->request = NULL;
         object->flags &= ~(OBJECT_INPROGRESS | OBJECT_VALIDATING);
         releaseNotifyObject(object);
         httpDestroyRequest(request);
@@ -487,6 +645,27 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
     return 1;
 }
 
+/* Fail the requests queued on a server that has just refused us.  This
+   runs from its own event so as not to recurse into httpServerTrigger. */
+static int
+httpServerNegativeHandler(TimeEventHandlerPtr event)
+{
+    HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
+    HTTPServerPtr server = connection->server;
+    AtomPtr message;
+
+    negativeServerHits++;
+    if(server->failure)
+        message = retainAtom(server->failure);
+    else
+        message = internAtom("Connect failed");
+    connection->connecting = 0;
+    if(server->request)
+        httpServerAbortRequest(server->request, 1, 504, retainAtom(message));
+    httpServerAbort(connection, 1, 504, message);
+    return 1;
+}
+
 int
 httpServerConnection(HTTPServerPtr server)
 {
@@ -499,6 +678,8 @@ httpServerConnection(HTTPServerPtr server)
         return -1;
     }
     connection->server = server;
+    serverConnections++;
+    serverConnectionsOpened++;
 
     for(i = 0; i < server->numslots; i++) {
         if(!server->connection[i]) {
@@ -511,6 +692,16 @@ httpServerConnection(HTTPServerPtr server)
     connection->request = NULL;
     connection->request_last = NULL;
 
+    /* Don't bother the server again if it has just refused us. */
+    if(server->failure && server->failed > current_time.tv_sec &&
+       !proxyOffline) {
+        connection->connecting = CONNECTING_DNS;
+        if(scheduleTimeEvent(-1, httpServerNegativeHandler,
+                             sizeof(connection), &connection))
+            return 1;
+        connection->connecting = 0;
+    }
+
     do_log(D_SERVER_CONN, "C... %s:%d.\n",
            scrub(connection->server->name), connection->server->port);
     httpSetTimeout(connection, serverTimeout);
@@ -527,6 +718,81 @@ httpServerConnection(HTTPServerPtr server)
     return 1;
 }
 
+/* Open connections to server until it has at least
+   serverWarmConnections that are idle or being established. */
+static void
+warmServer(HTTPServerPtr server)
+{
+    int i, n = 0, empty = 0;
+
+    if(server->persistent < 0 || server->request ||
+       server->failed > current_time.tv_sec)
+        return;
+
+    for(i = 0; i < server->numslots; i++) {
+        if(!server->connection[i])
+            empty++;
+        else if(server->connection[i]->connecting ||
+                !server->connection[i]->request)
+            n++;
+    }
+
+    while(n < serverWarmConnections && empty > 0) {
+        if(httpServerConnection(server) < 0)
+            break;
+        n++;
+        empty--;
+    }
+}
+
+/* Keep a few idle connections open to the parent proxy and to the
+   servers that have seen the most requests recently, so that new
+   requests don't need to wait for a TCP handshake. */
+static int
+warmServersHandler(TimeEventHandlerPtr event)
+{
+    HTTPServerPtr busy[MAX_WARM_SERVERS];
+    HTTPServerPtr server;
+    TimeEventHandlerPtr e;
+    int i, j, n = 0, max;
+
+    max = MIN(serverWarmServers, MAX_WARM_SERVERS);
+
+    if(serverWarmConnections > 0 && !proxyOffline) {
+        if(parentHost) {
+            server = getServer(parentHost->string, parentPort, 1);
+            if(server)
+                warmServer(server);
+        } else {
+            for(server = servers; server; server = server->next) {
+                if(server->uses <= 1 || server->isProxy)
+                    continue;
+                for(i = n; i > 0 && busy[i - 1]->uses < server->uses; i--)
+                    ;
+                if(i >= max)
+                    continue;
+                for(j = MIN(n, max - 1); j > i; j--)
+                    busy[j] = busy[j - 1];
+                busy[i] = server;
+                if(n < max) n++;
+            }
+            for(i = 0; i < n; i++)
+                warmServer(busy[i]);
+        }
+    }
+
+    /* Only recent use counts. */
+    for(server = servers; server; server = server->next)
+        server->uses /= 2;
+
+    e = scheduleTimeEvent(WARM_INTERVAL, warmServersHandler, 0, NULL);
+    if(!e) {
+        do_log(L_ERROR, "Couldn't schedule connection warming.\n");
+        polipoExit();
+    }
+    return 1;
+}
+
 int
 httpServerConnectionDnsHandler(int status, GethostbynameRequestPtr request)
 {
@@ -575,6 +841,7 @@ httpServerConnectionDnsHandler(int status, GethostbynameRequestPtr request)
         return 1;
     }
 
+    connection->resolved = current_time;
     connection->connecting = CONNECTING_CONNECT;
     httpSetTimeout(connection, serverTimeout);
     do_connect(retainAtom(request->addr), connection->server->addrindex,
@@ -626,10 +893,18 @@ httpServerConnectionHandlerCommon(int status, HTTPConnectionPtr connection)
             internAtomError(-status, "Connect to %s:%d failed",
                             connection->server->name,
                             connection->server->port);
-        if(status != -ECLIENTRESET)
+        if(status != -ECLIENTRESET) {
             do_log_error(L_ERROR, -status, "Connect to %s:%d failed",
                          scrub(connection->server->name),
                          connection->server->port);
+            if(negativeServerTime > 0) {
+                HTTPServerPtr server = connection->server;
+                if(server->failure)
+                    releaseAtom(server->failure);
+                server->failure = retainAtom(message);
+                server->failed = current_time.tv_sec + negativeServerTime;
+            }
+        }
         connection->connecting = 0;
         if(connection->server->request)
             httpServerAbortRequest(connection->server->request,
@@ -642,6 +917,7 @@ httpServerConnectionHandlerCommon(int status, HTTPConnectionPtr connection)
     do_log(D_SERVER_CONN, "C    %s:%d.\n",
            scrub(connection->server->name), connection->server->port);
 
+    connection->connected = current_time;
     connection->connecting = 0;
     /* serverTrigger will take care of inserting any timeouts */
     httpServerTrigger(connection->server);
@@ -672,12 +948,43 @@ httpServerIdleHandler(int a, FdEventHandlerPtr event)
     return 1;
 }
 
+/* Charge the client with the setup of the connection that carries
+   its first request, but only if it was opened on its behalf. */
+static void
+httpServerRequestTimes(HTTPConnectionPtr connection, HTTPRequestPtr request)
+{
+    HTTPRequestPtr requestor = request->request;
+
+    if(requestor == NULL)
+        return;
+
+    if(connection->serviced == 0 && connection->pipelined == 0 &&
+       connection->connected.tv_sec != null_time.tv_sec &&
+       requestor->times[TIME_LOOKUP].tv_sec != null_time.tv_sec &&
+       timeval_minus_usec(&connection->start,
+                          &requestor->times[TIME_LOOKUP]) >= 0) {
+        /* With a SOCKS parent, the name is resolved by the proxy. */
+        if(connection->resolved.tv_sec != null_time.tv_sec) {
+            requestor->times[TIME_DNS] = connection->resolved;
+            requestor->times[TIME_CONNECT] = connection->connected;
+        } else {
+            requestor->times[TIME_SOCKS] = connection->connected;
+        }
+    }
+    httpRequestTime(requestor, TIME_SENT);
+}
+
 /* Discard aborted requests at the head of the queue. */
 static void
 httpServerDiscardRequests(HTTPServerPtr server)
 {
     HTTPRequestPtr request;
-    while(server->request && !server->request->request) {
+    /* A detached request has no client, but is still wanted unless
+       its object has failed. */
+    while(server->request && !server->request->request &&
+          (!(server->request->flags & REQUEST_DETACHED) ||
+           (server->request->object->flags &
+            (OBJECT_FAILED | OBJECT_ABORTED)))) {
         request = server->request;
         server->request = request->next;
         request->next = NULL;
@@ -842,7 +1149,8 @@ httpServerTrigger(HTTPServerPtr server)
             httpServerDiscardRequests(server);
             if(!server->request) break;
             request = server->request;
-            assert(request->request->request == request);
+            assert(!request->request ||
+                   request->request->request == request);
             rc = httpWriteRequest(connection, request, -1);
             if(rc < 0) {
                 if(i == 0)
@@ -858,6 +1166,7 @@ httpServerTrigger(HTTPServerPtr server)
             if(connection->pipelined > 0)
                 request->flags |= REQUEST_PIPELINED;
             request->time0 = current_time;
+            httpServerRequestTimes(connection, request);
             i++;
             server->request = request->next;
             request->next = NULL;
@@ -970,6 +1279,7 @@ httpServerSideRequest(HTTPServerPtr server)
     httpQueueRequest(connection, request);
     connection->pipelined = 1;
     request->time0 = current_time;
+    httpServerRequestTimes(connection, request);
     connection->reqoffset = 0;
     connection->bodylen = client->bodylen;
     httpServerDoSide(connection);
@@ -1161,7 +1471,7 @@ httpServerContinueConditionHandler(int status, ConditionHandlerPtr chandler)
 
 /* s is 0 to keep the connection alive, 1 to shutdown the connection */
 void
-httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
+httpServerFinish(HTTPConnectionPtr connection, int s, long long offset)
 {
     HTTPServerPtr server = connection->server;
     HTTPRequestPtr request = connection->request;
@@ -1196,7 +1506,8 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
 
     if(request) {
         /* Update statistics about the server */
-        int size = -1, d = -1, rtt = -1, rate = -1;
+        long long size = -1, to;
+        int d = -1, rtt = -1, rate = -1, complete;
         if(connection->offset > 0 && request->from >= 0)
             size = connection->offset - request->from;
         if(request->time1.tv_sec != null_time.tv_sec) {
@@ -1210,6 +1521,23 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
         request->time0 = null_time;
         request->time1 = null_time;
 
+        to = request->to >= 0 ? request->to : request->object->length;
+        complete = to >= 0 && connection->offset >= to &&
+            !(request->object->flags & OBJECT_FAILED);
+
+        if((request->flags & REQUEST_DETACHED) && request->detached >= 0) {
+            if(complete) {
+                quickAbortContinued++;
+                quickAbortSaved += connection->offset - request->detached;
+            } else {
+                quickAbortWasted += connection->offset - request->detached;
+            }
+        }
+
+        if(complete && request->method == METHOD_GET &&
+           (request->from > 0 || request->to >= 0))
+            httpServerScheduleFill(request->object);
+
         if(rtt >= 0) {
             if(server->rtt >= 0)
                 server->rtt = (3 * server->rtt + rtt + 2) / 4;
@@ -1248,7 +1576,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
                        "Closing connection to %s:%d: "
                        "%d stray bytes of data.\n",
                        scrub(server->name), server->port,
-                       connection->len - offset);
+                       (int)(connection->len - offset));
                 s = 1;
             } else {
                 memmove(connection->buf, connection->buf + offset,
@@ -1310,6 +1638,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
             unregisterFdEvent(server->idleHandler[i]);
         server->idleHandler[i] = NULL;
         server->connection[i] = NULL;
+        serverConnections--;
         free(connection);
     } else {
         server->persistent += 1;
@@ -1369,7 +1698,8 @@ httpServerReply(HTTPConnectionPtr connection, int immediate)
 {
     assert(connection->pipelined > 0);
 
-    if(connection->request->request == NULL) {
+    if(connection->request->request == NULL &&
+       !(connection->request->flags & REQUEST_DETACHED)) {
         do_log(L_WARN, "Aborting pipeline on %s:%d.\n",
                scrub(connection->server->name), connection->server->port);
         httpServerFinish(connection, 1, 0);
@@ -1459,8 +1789,113 @@ httpServerRestart(HTTPConnectionPtr connection)
     httpServerFinish(connection, 1, 0);
 }
 
+/* Somebody wants a range of an object that is already being fetched.
+   If the request for it hasn't been written yet, widen it to cover
+   this range too, as long as the two are adjacent or overlap. */
+void
+httpServerCoalesceRange(ObjectPtr object, long long from, long long to)
+{
+    HTTPRequestPtr requestor = object->requestor, request;
+    long long l;
+
+    if(requestor == NULL || requestor->request == NULL)
+        return;
+    request = requestor->request;
+    if(request->object != object || request->connection != NULL ||
+       (request->method != METHOD_GET &&
+        request->method != METHOD_CONDITIONAL_GET))
+        return;
+
+    if((request->to >= 0 && from > request->to) ||
+       (to >= 0 && to < request->from))
+        return;
+
+    if(request->to >= 0 && (to < 0 || to > request->to)) {
+        request->to = to;
+        rangeCoalesced++;
+    }
+    if(from < request->from) {
+        /* Don't fetch again data we already have. */
+        from = from / CHUNK_SIZE * CHUNK_SIZE;
+        l = objectHoleSize(object, from);
+        if(l < 0 || from + l >= request->from) {
+            request->from = from;
+            rangeCoalesced++;
+        }
+    }
+}
+
+static int
+httpServerFillHandler(TimeEventHandlerPtr event)
+{
+    ObjectPtr object = *(ObjectPtr*)event->data;
+    httpServerFillObject(object);
+    releaseObject(object);
+    return 1;
+}
+
+static void
+httpServerScheduleFill(ObjectPtr object)
+{
+    TimeEventHandlerPtr event;
+
+    if(rangeFillPercent < 0)
+        return;
+    retainObject(object);
+    event = scheduleTimeEvent(-1, httpServerFillHandler,
+                              sizeof(object), &object);
+    if(event == NULL)
+        releaseObject(object);
+}
+
+/* Once enough of a partial object has been fetched, fetch the first
+   missing part in the background.  We get called again when that is
+   done, so this continues until the object is complete. */
+static void
+httpServerFillObject(ObjectPtr object)
+{
+    long long present = 0, offset;
+    int i;
+
+    if(rangeFillPercent < 0 || proxyOffline ||
+       object->type != OBJECT_HTTP || object->length <= 0 ||
+       !(object->flags & OBJECT_PUBLIC) ||
+       (object->flags & (OBJECT_INITIAL | OBJECT_INPROGRESS |
+                         OBJECT_SUPERSEDED | OBJECT_LINEAR |
+                         OBJECT_FAILED | OBJECT_LOCAL | OBJECT_DYNAMIC)) ||
+       (object->cache_control & (CACHE_NO_STORE | CACHE_NO_HIDDEN)))
+        return;
+
+    for(i = 0; i < object->numchunks; i++)
+        present += object->chunks[i].size;
+    if(present * 100 < object->length * rangeFillPercent)
+        return;
+
+    offset = 0;
+    while(offset < object->length) {
+        i = offset / CHUNK_SIZE;
+        if(i >= object->numchunks || object->chunks[i].size < CHUNK_SIZE) {
+            /* The hole may be on disk. */
+            objectFillFromDisk(object, offset, 1);
+            if(i < object->numchunks)
+                offset += object->chunks[i].size;
+            if(offset < object->length && objectHoleSize(object, offset) != 0)
+                break;
+        }
+        offset = (long long)(i + 1) * CHUNK_SIZE;
+    }
+    if(offset >= object->length)
+        return;
+
+    do_log(D_SERVER_CONN, "Filling %s from %lld.\n",
+           scrub(object->key), offset);
+    rangeFills++;
+    httpServerRequest(object, METHOD_GET, offset, -1, NULL, NULL);
+}
+
 int
-httpServerRequest(ObjectPtr object, int method, int from, int to, 
+httpServerRequest(ObjectPtr object, int method,
+                  long long from, long long to,
                   HTTPRequestPtr requestor, void *closure)
 {
     int rc;
@@ -1476,10 +1911,11 @@ httpServerRequest(ObjectPtr object, int method, int from, int to,
     if(object->flags & OBJECT_INPROGRESS)
         return 1;
 
-    if(requestor->flags & REQUEST_REQUESTED)
-        return 0;
-
-    assert(requestor->request == NULL);
+    if(requestor) {
+        if(requestor->flags & REQUEST_REQUESTED)
+            return 0;
+        assert(requestor->request == NULL);
+    }
 
     if(proxyOffline)
         return -1;
@@ -1503,7 +1939,8 @@ httpServerRequest(ObjectPtr object, int method, int from, int to,
     memcpy(name, ((char*)object->key) + x, y - x);
     name[y - x] = '\0';
 
-    requestor->flags |= REQUEST_REQUESTED;
+    if(requestor)
+        requestor->flags |= REQUEST_REQUESTED;
     rc = httpMakeServerRequest(name, port, object, method, from, to,
                                requestor);
                                    
@@ -1522,12 +1959,13 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
                  int bodylen)
 {
     ObjectPtr object = request->object;
-    int from = request->from, to = request->to, method = request->method;
+    long long from = request->from, to = request->to, l;
+    int method = request->method;
     char *url = object->key, *m;
     int url_size = object->key_size;
     int x, y, port, z, location_size;
     char *location;
-    int l, n, rc, bufsize;
+    int n, rc, bufsize;
 
     assert(method != METHOD_NONE);
 
@@ -1616,7 +2054,7 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
     do_log_n(D_SERVER_REQ, url + x, y - x);
     do_log(D_SERVER_REQ, ": ");
     do_log_n(D_SERVER_REQ, connection->reqbuf, n);
-    do_log(D_SERVER_REQ, " (method %d from %d to %d, 0x%lx for 0x%lx)\n",
+    do_log(D_SERVER_REQ, " (method %d from %lld to %lld, 0x%lx for 0x%lx)\n",
            method, from, to,
            (unsigned long)connection, (unsigned long)object);
 
@@ -1643,10 +2081,10 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
     if(method != METHOD_HEAD && (from > 0 || to >= 0)) {
         if(to >= 0) {
             n = snnprintf(connection->reqbuf, n, bufsize,
-                          "\r\nRange: bytes=%d-%d", from, to - 1);
+                          "\r\nRange: bytes=%lld-%lld", from, to - 1);
         } else {
             n = snnprintf(connection->reqbuf, n, bufsize,
-                          "\r\nRange: bytes=%d-", from);
+                          "\r\nRange: bytes=%lld-", from);
         }
     }
 
@@ -1813,6 +2251,8 @@ httpServerReplyHandler(int status,
 
     if(i >= 0) {
         request->time1 = current_time;
+        if(request->request)
+            httpRequestTime(request->request, TIME_UPSTREAM);
         return httpServerHandlerHeaders(status, event, srequest, connection);
     }
 
@@ -1870,9 +2310,9 @@ httpServerHandlerHeaders(int eof,
     ObjectPtr object = request->object;
     int rc;
     int code, version;
-    int full_len;
+    long long full_len;
     AtomPtr headers;
-    int len;
+    long long len;
     int te;
     CacheControlRec cache_control;
     int age = -1;
@@ -2135,7 +2575,7 @@ httpServerHandlerHeaders(int eof,
 
     if(supersede) {
         do_log(L_SUPERSEDED,
-               "Superseding object %s (%d %d %d %s -> %d %d %d %s)\n",
+               "Superseding object %s (%d %lld %d %s -> %d %lld %d %s)\n",
                scrub(old_object->key),
                object->code, object->length, (int)object->last_modified,
                object->etag ? object->etag : "(none)",
@@ -2291,7 +2731,9 @@ httpServerHandlerHeaders(int eof,
         return 1;
     }
 
-    if(request->request == NULL) {
+    if(request->request == NULL &&
+       (!(request->flags & REQUEST_DETACHED) ||
+        !httpServerDetachedContinue(request, 1))) {
         httpServerFinish(connection, 1, 0);
         return 1;
     }
@@ -2324,7 +2766,7 @@ httpServerHandlerHeaders(int eof,
     if(content_range.to >= 0)
         request->to = content_range.to;
 
-    do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %d\n",
+    do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %lld\n",
            (unsigned long)connection, (unsigned long)object,
            connection->offset);
 
@@ -2489,11 +2931,13 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
 {
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
-    int to = -1;
+    long long to = -1;
 
     assert(object->flags & OBJECT_INPROGRESS);
 
-    if(request->request == NULL) {
+    if(request->request == NULL &&
+       (!(request->flags & REQUEST_DETACHED) ||
+        !httpServerDetachedContinue(request, 1))) {
         httpServerFinish(connection, 1, 0);
         return 1;
     }
@@ -2514,7 +2958,8 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
         /* Read directly into the object */
         int i = connection->offset / CHUNK_SIZE;
         int j = connection->offset % CHUNK_SIZE;
-        int end, len, more;
+        long long end, len;
+        int more;
         /* See httpServerDirectHandlerCommon if you change this */
         if(connection->te == TE_CHUNKED) {
             len = connection->chunk_remaining;
@@ -2557,7 +3002,7 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
                                 object->chunks[i].data, CHUNK_SIZE,
                                 object->chunks[i + 1].data,
                                 MIN(CHUNK_SIZE,
-                                    end - (i + 1) * CHUNK_SIZE),
+                                    end - (long long)(i + 1) * CHUNK_SIZE),
                                 connection->buf, connection->buf ? more : 0,
                                 httpServerDirectHandler2, connection);
                     return 1;
@@ -2570,7 +3015,7 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
             }
             do_stream_2(IO_READ | IO_NOTNOW, connection->fd, j,
                         object->chunks[i].data,
-                        MIN(CHUNK_SIZE, end - i * CHUNK_SIZE),
+                        MIN(CHUNK_SIZE, end - (long long)i * CHUNK_SIZE),
                         connection->buf, connection->buf ? more : 0,
                         httpServerDirectHandler, connection);
             return 1;
@@ -2602,7 +3047,8 @@ httpServerDirectHandlerCommon(int kind, int status,
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
     int i = connection->offset / CHUNK_SIZE;
-    int to, end, end1;
+    long long base = (long long)i * CHUNK_SIZE;
+    long long to, end, end1;
 
     assert(request->object->flags & OBJECT_INPROGRESS);
 
@@ -2629,17 +3075,17 @@ httpServerDirectHandlerCommon(int kind, int status,
     else
         end = to;
     /* The amount of data actually read into the object */
-    end1 = MIN(end, i * CHUNK_SIZE + MIN(kind * CHUNK_SIZE, srequest->offset));
+    end1 = MIN(end, base + MIN(kind * CHUNK_SIZE, srequest->offset));
 
     assert(end >= 0);
-    assert(end1 >= i * CHUNK_SIZE);
-    assert(end1 - 2 * CHUNK_SIZE <= i * CHUNK_SIZE);
+    assert(end1 >= base);
+    assert(end1 - 2 * CHUNK_SIZE <= base);
 
     object->chunks[i].size = 
-        MAX(object->chunks[i].size, MIN(end1 - i * CHUNK_SIZE, CHUNK_SIZE));
-    if(kind == 2 && end1 > (i + 1) * CHUNK_SIZE) {
+        MAX(object->chunks[i].size, MIN(end1 - base, CHUNK_SIZE));
+    if(kind == 2 && end1 > base + CHUNK_SIZE) {
         object->chunks[i + 1].size =
-            MAX(object->chunks[i + 1].size, end1 - (i + 1) * CHUNK_SIZE);
+            MAX(object->chunks[i + 1].size, end1 - base - CHUNK_SIZE);
     }
     if(connection->te == TE_CHUNKED) {
         connection->chunk_remaining -= (end1 - connection->offset);
@@ -2650,8 +3096,8 @@ httpServerDirectHandlerCommon(int kind, int status,
     unlockChunk(object, i);
     if(kind == 2) unlockChunk(object, i + 1);
 
-    if(i * CHUNK_SIZE + srequest->offset > end1) {
-        connection->len = i * CHUNK_SIZE + srequest->offset - end1;
+    if(base + srequest->offset > end1) {
+        connection->len = base + srequest->offset - end1;
         return httpServerIndirectHandlerCommon(connection, status);
     } else {
         notifyObject(object);
@@ -2713,7 +3159,7 @@ connectionAddData(HTTPConnectionPtr connection, int skip)
                 return -1;
             connection->offset += len;
             connection->len -= (len + skip);
-            do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %d\n",
+            do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %lld\n",
                    (unsigned long)connection, (unsigned long)object,
                    connection->offset);
         }
@@ -2778,7 +3224,7 @@ connectionAddData(HTTPConnectionPtr connection, int skip)
                         return -1;
                     i += size;
                     connection->chunk_remaining -= size;
-                    do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %d\n",
+                    do_log(D_SERVER_OFFSET, "0x%lx(0x%lx): offset = %lld\n",
                            (unsigned long)connection, 
                            (unsigned long)object,
                            connection->offset);
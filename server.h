@@ -21,6 +21,12 @@ THE SOFTWARE.
 */
 
 extern int serverExpireTime, dontCacheRedirects;
+extern int negativeServerTime, negativeServerHits;
+extern int serverConnections, serverConnectionsOpened;
+extern int quickAbortContinued;
+extern long long quickAbortSaved, quickAbortWasted;
+extern int rangeCoalesced, rangeFills;
+extern int alwaysAddNoTransform;
 
 typedef struct _HTTPServer {
     char *name;
@@ -39,7 +45,11 @@ typedef struct _HTTPServer {
     HTTPConnectionPtr *connection;
     FdEventHandlerPtr *idleHandler;
     HTTPRequestPtr request, request_last;
+    int uses;
+    time_t failed;
+    AtomPtr failure;
     struct _HTTPServer *next;
+    struct _HTTPServer *hash_next;
 } HTTPServerRec, *HTTPServerPtr;
 
 extern AtomPtr parentHost;
@@ -50,10 +60,11 @@ void initServer(void);
 
 void httpServerAbortHandler(ObjectPtr object);
 int httpMakeServerRequest(char *name, int port, ObjectPtr object, 
-                          int method, int from, int to,
+                          int method, long long from, long long to,
                           HTTPRequestPtr requestor);
 int httpServerQueueRequest(HTTPServerPtr server, HTTPRequestPtr request);
 int httpServerTrigger(HTTPServerPtr server);
+void discardServerFailures(void);
 int httpServerSideRequest(HTTPServerPtr server);
 int  httpServerDoSide(HTTPConnectionPtr connection);
 int httpServerSideHandler(int status,
@@ -70,12 +81,13 @@ int httpServerConnectionHandler(int status,
 int httpServerSocksHandler(int status, SocksRequestPtr request);
 int httpServerConnectionHandlerCommon(int status,
                                       HTTPConnectionPtr connection);
-void httpServerFinish(HTTPConnectionPtr connection, int s, int offset);
+void httpServerFinish(HTTPConnectionPtr connection, int s, long long offset);
 
 void httpServerReply(HTTPConnectionPtr connection, int immediate);
 void httpServerAbort(HTTPConnectionPtr connection, int, int, struct _Atom *);
 void httpServerAbortRequest(HTTPRequestPtr request, int, int, struct _Atom *);
 void httpServerClientReset(HTTPRequestPtr request);
+void httpServerCoalesceRange(ObjectPtr object, long long from, long long to);
 void httpServerUnpipeline(HTTPRequestPtr request);
 int
 httpServerSendRequest(HTTPConnectionPtr connection);
@@ -99,7 +111,8 @@ int
 httpServerDirectHandler2(int status,
                          FdEventHandlerPtr event, 
                          StreamRequestPtr request);
-int httpServerRequest(ObjectPtr object, int method, int from, int to,
+int httpServerRequest(ObjectPtr object, int method,
+                      long long from, long long to,
                       HTTPRequestPtr, void*);
 int httpServerHandlerHeaders(int eof,
                              FdEventHandlerPtr event,
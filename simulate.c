@@ -0,0 +1,607 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* An offline cache simulator.  This replays an access log, as written
+   by Polipo when accessLogFile is set, through a model of Polipo's
+   memory and disk caches, and prints hit ratios and eviction churn for
+   a number of configurations.
+
+   The in-memory model follows object.c: objects are kept in a list in
+   order of last use, occupy one chunk per CHUNK_SIZE bytes, and are
+   discarded from the tail by the same two passes as discardObjects --
+   first stripping the chunks of large objects, then dropping whole
+   objects -- with the same marks.  Discarded data is written out to
+   disk unless larger than maxDiskCacheEntrySize, as in diskcache.c.
+   Polipo itself doesn't bound the size of the disk cache, which is
+   expired by polipo -x; the simulator can optionally bound it, and
+   then evicts the least recently used entries. */
+
+#include "polipo.h"
+
+#define POLICY_LRU 0
+#define POLICY_FIFO 1
+
+typedef struct _SimConfig {
+    char *name;
+    long long chunkHighMark;
+    long long chunkLowMark;
+    int objectHighMark;
+    int publicObjectLowMark;
+    long long maxDiskCacheEntrySize;
+    long long diskCacheSize;
+    int policy;
+} SimConfigRec, *SimConfigPtr;
+
+typedef struct _SimObject {
+    long long size;
+    int chunks;                 /* resident in memory */
+    int inMemory, onDisk;
+    int previous, next;         /* memory list */
+    int diskPrevious, diskNext; /* disk list */
+} SimObjectRec, *SimObjectPtr;
+
+typedef struct _SimStats {
+    long requests;
+    long memoryHits, diskHits;
+    long long bytes, memoryHitBytes, diskHitBytes;
+    long discardedObjects, strippedObjects;
+    long long discardedBytes;
+    long long diskWritten, diskEvicted;
+} SimStatsRec, *SimStatsPtr;
+
+/* The replayed trace: one entry per cacheable request. */
+static int *trace = NULL;
+static int traceLength = 0, traceSize = 0;
+
+static char **urls = NULL;
+static long long *urlSizes = NULL;
+static int numUrls = 0, urlsSize = 0;
+
+static int *urlTable = NULL;
+static int urlTableSize = 0;
+
+static long skippedRequests = 0;
+
+/* Simulation state. */
+static SimObjectPtr objects;
+static int objectList, objectListEnd;
+static int diskList, diskListEnd;
+static long long usedChunks, diskUsed;
+static int objectCount;
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr,
+            "%s logfile [ var=val,... ]...\n"
+            "Each argument after the log file describes one configuration, "
+            "as a\ncomma-separated list of assignments to chunkHighMark, "
+            "chunkLowMark,\nobjectHighMark, publicObjectLowMark, "
+            "maxDiskCacheEntrySize, diskCacheSize\n(0 means no disk cache, "
+            "-1 unbounded) and policy (lru or fifo).\n"
+            "Sizes may be followed by k, M or G.  Use - for the log file "
+            "to read stdin.\n",
+            argv0);
+}
+
+static unsigned int
+hashString(const char *s, int len)
+{
+    unsigned int h = 5381;
+    int i;
+    for(i = 0; i < len; i++)
+        h = h * 33 + (unsigned char)s[i];
+    return h;
+}
+
+static int
+growUrlTable(void)
+{
+    int *table;
+    int size = urlTableSize ? urlTableSize * 2 : 4096;
+    int i, j;
+
+    table = malloc(size * sizeof(int));
+    if(table == NULL)
+        return -1;
+    for(i = 0; i < size; i++)
+        table[i] = -1;
+    for(i = 0; i < numUrls; i++) {
+        j = hashString(urls[i], strlen(urls[i])) % size;
+        while(table[j] >= 0)
+            j = (j + 1) % size;
+        table[j] = i;
+    }
+    free(urlTable);
+    urlTable = table;
+    urlTableSize = size;
+    return 1;
+}
+
+static int
+internUrl(const char *url, int len)
+{
+    int i;
+
+    if(numUrls * 2 >= urlTableSize) {
+        if(growUrlTable() < 0)
+            return -1;
+    }
+    i = hashString(url, len) % urlTableSize;
+    while(urlTable[i] >= 0) {
+        char *u = urls[urlTable[i]];
+        if(strncmp(u, url, len) == 0 && u[len] == '\0')
+            return urlTable[i];
+        i = (i + 1) % urlTableSize;
+    }
+
+    if(numUrls >= urlsSize) {
+        int n = urlsSize ? urlsSize * 2 : 4096;
+        char **u = realloc(urls, n * sizeof(char*));
+        long long *s;
+        if(u == NULL)
+            return -1;
+        urls = u;
+        s = realloc(urlSizes, n * sizeof(long long));
+        if(s == NULL)
+            return -1;
+        urlSizes = s;
+        urlsSize = n;
+    }
+    urls[numUrls] = malloc(len + 1);
+    if(urls[numUrls] == NULL)
+        return -1;
+    memcpy(urls[numUrls], url, len);
+    urls[numUrls][len] = '\0';
+    urlSizes[numUrls] = 0;
+    urlTable[i] = numUrls;
+    return numUrls++;
+}
+
+/* Finds the value of field name in a logfmt line; returns its length. */
+static int
+logField(const char *line, const char *name, const char **value)
+{
+    int n = strlen(name);
+    const char *p = line;
+
+    while(*p) {
+        while(*p == ' ')
+            p++;
+        if(strncmp(p, name, n) == 0 && p[n] == '=') {
+            const char *q = p + n + 1;
+            *value = q;
+            while(*q && *q != ' ' && *q != '\n')
+                q++;
+            return q - *value;
+        }
+        while(*p && *p != ' ')
+            p++;
+    }
+    return -1;
+}
+
+static int
+readLog(FILE *f)
+{
+    char line[2048];
+    const char *v;
+    int n, id;
+    long long bytes;
+
+    while(fgets(line, 2048, f)) {
+        n = logField(line, "cache", &v);
+        if(n == 5 && memcmp(v, "local", 5) == 0)
+            continue;
+        n = logField(line, "method", &v);
+        if(n >= 0 && !(n == 3 && memcmp(v, "GET", 3) == 0)) {
+            skippedRequests++;
+            continue;
+        }
+        n = logField(line, "status", &v);
+        if(n >= 0 && atoi(v) != 200) {
+            skippedRequests++;
+            continue;
+        }
+        n = logField(line, "cacheable", &v);
+        if(n >= 0 && atoi(v) == 0) {
+            skippedRequests++;
+            continue;
+        }
+        n = logField(line, "bytes", &v);
+        if(n < 0) {
+            skippedRequests++;
+            continue;
+        }
+        bytes = atoll(v);
+        n = logField(line, "url", &v);
+        if(n <= 0 || (n == 1 && v[0] == '-') ||
+           (n == 10 && memcmp(v, "(scrubbed)", 10) == 0)) {
+            skippedRequests++;
+            continue;
+        }
+
+        id = internUrl(v, n);
+        if(id < 0)
+            return -1;
+        /* Interrupted transfers log fewer bytes than the object's size,
+           so take the largest size ever seen. */
+        if(bytes > urlSizes[id])
+            urlSizes[id] = bytes;
+
+        if(traceLength >= traceSize) {
+            int size = traceSize ? traceSize * 2 : 65536;
+            int *t = realloc(trace, size * sizeof(int));
+            if(t == NULL)
+                return -1;
+            trace = t;
+            traceSize = size;
+        }
+        trace[traceLength++] = id;
+    }
+    return 1;
+}
+
+static long long
+parseSize(const char *s)
+{
+    char *end;
+    double d = strtod(s, &end);
+    switch(*end) {
+    case 'k': case 'K': d *= 1024; break;
+    case 'm': case 'M': d *= 1024 * 1024; break;
+    case 'g': case 'G': d *= 1024 * 1024 * 1024; break;
+    }
+    return (long long)d;
+}
+
+/* Defaults and sanity checks follow preinitChunks and initObject. */
+static int
+parseSimConfig(char *arg, SimConfigPtr config)
+{
+    char *copy, *p, *q, *v;
+
+    config->name = arg;
+    config->chunkHighMark = 24 * 1024 * 1024;
+    config->chunkLowMark = 0;
+    config->objectHighMark = 2048;
+    config->publicObjectLowMark = 0;
+    config->maxDiskCacheEntrySize = -1;
+    config->diskCacheSize = -1;
+    config->policy = POLICY_LRU;
+
+    copy = strdup(arg);
+    if(copy == NULL)
+        return -1;
+    p = copy;
+    while(p && *p) {
+        q = strchr(p, ',');
+        if(q)
+            *q++ = '\0';
+        v = strchr(p, '=');
+        if(v == NULL) {
+            fprintf(stderr, "Couldn't parse %s.\n", p);
+            free(copy);
+            return -1;
+        }
+        *v++ = '\0';
+        if(strcmp(p, "chunkHighMark") == 0)
+            config->chunkHighMark = parseSize(v);
+        else if(strcmp(p, "chunkLowMark") == 0)
+            config->chunkLowMark = parseSize(v);
+        else if(strcmp(p, "objectHighMark") == 0)
+            config->objectHighMark = atoi(v);
+        else if(strcmp(p, "publicObjectLowMark") == 0)
+            config->publicObjectLowMark = atoi(v);
+        else if(strcmp(p, "maxDiskCacheEntrySize") == 0)
+            config->maxDiskCacheEntrySize = parseSize(v);
+        else if(strcmp(p, "diskCacheSize") == 0)
+            config->diskCacheSize = parseSize(v);
+        else if(strcmp(p, "policy") == 0 && strcmp(v, "lru") == 0)
+            config->policy = POLICY_LRU;
+        else if(strcmp(p, "policy") == 0 && strcmp(v, "fifo") == 0)
+            config->policy = POLICY_FIFO;
+        else {
+            fprintf(stderr, "Unknown variable or value %s=%s.\n", p, v);
+            free(copy);
+            return -1;
+        }
+        p = q;
+    }
+    free(copy);
+
+    config->chunkHighMark = MAX(config->chunkHighMark, 8 * CHUNK_SIZE);
+    if(config->chunkLowMark < 4 * CHUNK_SIZE ||
+       config->chunkLowMark > config->chunkHighMark - 4 * CHUNK_SIZE)
+        config->chunkLowMark = MIN(config->chunkHighMark - 4 * CHUNK_SIZE,
+                                   config->chunkHighMark * 3 / 4);
+    config->objectHighMark = MAX(config->objectHighMark, 16);
+    if(config->publicObjectLowMark < 8 ||
+       config->publicObjectLowMark >= config->objectHighMark - 4)
+        config->publicObjectLowMark = config->objectHighMark / 2;
+    return 1;
+}
+
+static void
+unlinkMemory(int i)
+{
+    SimObjectPtr object = &objects[i];
+    if(object->previous >= 0)
+        objects[object->previous].next = object->next;
+    else
+        objectList = object->next;
+    if(object->next >= 0)
+        objects[object->next].previous = object->previous;
+    else
+        objectListEnd = object->previous;
+    object->previous = object->next = -1;
+}
+
+static void
+linkMemory(int i)
+{
+    SimObjectPtr object = &objects[i];
+    object->previous = -1;
+    object->next = objectList;
+    if(objectList >= 0)
+        objects[objectList].previous = i;
+    else
+        objectListEnd = i;
+    objectList = i;
+}
+
+static void
+unlinkDisk(int i)
+{
+    SimObjectPtr object = &objects[i];
+    if(object->diskPrevious >= 0)
+        objects[object->diskPrevious].diskNext = object->diskNext;
+    else
+        diskList = object->diskNext;
+    if(object->diskNext >= 0)
+        objects[object->diskNext].diskPrevious = object->diskPrevious;
+    else
+        diskListEnd = object->diskPrevious;
+    object->diskPrevious = object->diskNext = -1;
+}
+
+static void
+linkDisk(int i)
+{
+    SimObjectPtr object = &objects[i];
+    object->diskPrevious = -1;
+    object->diskNext = diskList;
+    if(diskList >= 0)
+        objects[diskList].diskPrevious = i;
+    else
+        diskListEnd = i;
+    diskList = i;
+}
+
+static void
+writeoutSim(SimConfigPtr config, SimStatsPtr stats, int i)
+{
+    SimObjectPtr object = &objects[i];
+
+    if(object->onDisk || config->diskCacheSize == 0)
+        return;
+    if(config->maxDiskCacheEntrySize >= 0 &&
+       object->size > config->maxDiskCacheEntrySize)
+        return;
+    if(config->diskCacheSize > 0 && object->size > config->diskCacheSize)
+        return;
+
+    object->onDisk = 1;
+    linkDisk(i);
+    diskUsed += object->size;
+    stats->diskWritten += object->size;
+
+    while(config->diskCacheSize > 0 && diskUsed > config->diskCacheSize) {
+        int j = diskListEnd;
+        unlinkDisk(j);
+        objects[j].onDisk = 0;
+        diskUsed -= objects[j].size;
+        stats->diskEvicted += objects[j].size;
+    }
+}
+
+static void
+discardSim(SimConfigPtr config, SimStatsPtr stats)
+{
+    long long low = CHUNKS(config->chunkLowMark);
+    int i, next;
+    long long freed;
+
+    if(usedChunks < CHUNKS(config->chunkHighMark) &&
+       objectCount < config->publicObjectLowMark &&
+       objectCount < config->objectHighMark)
+        return;
+
+    /* First pass: strip the chunks of large objects. */
+    for(i = objectListEnd; i >= 0 && usedChunks >= low; i = next) {
+        next = objects[i].previous;
+        if(objects[i].chunks > low / 4) {
+            writeoutSim(config, stats, i);
+            usedChunks -= objects[i].chunks;
+            stats->discardedBytes +=
+                MIN(objects[i].size, (long long)objects[i].chunks * CHUNK_SIZE);
+            objects[i].chunks = 0;
+            stats->strippedObjects++;
+        }
+    }
+
+    /* Second pass: drop whole objects. */
+    freed = 0;
+    for(i = objectListEnd;
+        i >= 0 && (usedChunks - freed > low ||
+                   objectCount > config->publicObjectLowMark);
+        i = next) {
+        next = objects[i].previous;
+        writeoutSim(config, stats, i);
+        freed += objects[i].chunks;
+        stats->discardedBytes +=
+            MIN(objects[i].size, (long long)objects[i].chunks * CHUNK_SIZE);
+        stats->discardedObjects++;
+        unlinkMemory(i);
+        objects[i].inMemory = 0;
+        objectCount--;
+    }
+    usedChunks -= freed;
+}
+
+static void
+simulate(SimConfigPtr config, SimStatsPtr stats)
+{
+    int k, i;
+
+    memset(stats, 0, sizeof(*stats));
+    for(i = 0; i < numUrls; i++) {
+        objects[i].size = urlSizes[i];
+        objects[i].chunks = 0;
+        objects[i].inMemory = objects[i].onDisk = 0;
+        objects[i].previous = objects[i].next = -1;
+        objects[i].diskPrevious = objects[i].diskNext = -1;
+    }
+    objectList = objectListEnd = diskList = diskListEnd = -1;
+    usedChunks = diskUsed = 0;
+    objectCount = 0;
+
+    for(k = 0; k < traceLength; k++) {
+        SimObjectPtr object;
+        int needed;
+
+        i = trace[k];
+        object = &objects[i];
+        needed = (object->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        stats->requests++;
+        stats->bytes += object->size;
+
+        if(object->inMemory && object->chunks >= needed) {
+            stats->memoryHits++;
+            stats->memoryHitBytes += object->size;
+        } else if(object->onDisk) {
+            stats->diskHits++;
+            stats->diskHitBytes += object->size;
+            if(config->policy == POLICY_LRU) {
+                unlinkDisk(i);
+                linkDisk(i);
+            }
+        }
+
+        if(!object->inMemory) {
+            object->inMemory = 1;
+            objectCount++;
+            linkMemory(i);
+        } else if(config->policy == POLICY_LRU) {
+            unlinkMemory(i);
+            linkMemory(i);
+        }
+        usedChunks += needed - object->chunks;
+        object->chunks = needed;
+
+        discardSim(config, stats);
+    }
+}
+
+static void
+printStats(SimConfigPtr config, SimStatsPtr stats)
+{
+    long hits = stats->memoryHits + stats->diskHits;
+    long long hitBytes = stats->memoryHitBytes + stats->diskHitBytes;
+
+    printf("%s\n", config->name);
+    printf("  hit ratio       %.1f%% (memory %.1f%%, disk %.1f%%)\n",
+           stats->requests ? 100.0 * hits / stats->requests : 0.0,
+           stats->requests ? 100.0 * stats->memoryHits / stats->requests : 0.0,
+           stats->requests ? 100.0 * stats->diskHits / stats->requests : 0.0);
+    printf("  byte hit ratio  %.1f%% (memory %.1f%%, disk %.1f%%)\n",
+           stats->bytes ? 100.0 * hitBytes / stats->bytes : 0.0,
+           stats->bytes ? 100.0 * stats->memoryHitBytes / stats->bytes : 0.0,
+           stats->bytes ? 100.0 * stats->diskHitBytes / stats->bytes : 0.0);
+    printf("  memory churn    %ld objects discarded, %ld stripped, "
+           "%.1f MB\n",
+           stats->discardedObjects, stats->strippedObjects,
+           stats->discardedBytes / 1048576.0);
+    if(config->diskCacheSize != 0)
+        printf("  disk churn      %.1f MB written, %.1f MB evicted\n",
+               stats->diskWritten / 1048576.0,
+               stats->diskEvicted / 1048576.0);
+}
+
+int
+main(int argc, char **argv)
+{
+    SimConfigRec config;
+    SimStatsRec stats;
+    FILE *f;
+    int i, rc;
+    long long total = 0;
+
+    if(argc < 2 || strcmp(argv[1], "-h") == 0) {
+        usage(argv[0]);
+        exit(argc < 2 ? 1 : 0);
+    }
+
+    if(strcmp(argv[1], "-") == 0) {
+        f = stdin;
+    } else {
+        f = fopen(argv[1], "r");
+        if(f == NULL) {
+            perror(argv[1]);
+            exit(1);
+        }
+    }
+    rc = readLog(f);
+    if(f != stdin)
+        fclose(f);
+    if(rc < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(i = 0; i < numUrls; i++)
+        total += urlSizes[i];
+    printf("%d requests for %d objects (%.1f MB), %ld requests skipped.\n",
+           traceLength, numUrls, total / 1048576.0, skippedRequests);
+
+    objects = malloc(MAX(numUrls, 1) * sizeof(SimObjectRec));
+    if(objects == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(argc < 3) {
+        char defaults[] = "";
+        if(parseSimConfig(defaults, &config) < 0)
+            exit(1);
+        config.name = "(defaults)";
+        simulate(&config, &stats);
+        printStats(&config, &stats);
+    }
+    for(i = 2; i < argc; i++) {
+        if(parseSimConfig(argv[i], &config) < 0)
+            exit(1);
+        simulate(&config, &stats);
+        printStats(&config, &stats);
+    }
+    return 0;
+}
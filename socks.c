@@ -63,8 +63,19 @@ int socksProxyPort = -1;
 AtomPtr socksProxyAddress = NULL;
 int socksProxyAddressIndex = -1;
 AtomPtr socksUserName = NULL;
+AtomPtr socksAuthCredentials = NULL;
 AtomPtr socksProxyType = NULL;
 AtomPtr aSocks4a, aSocks5;
+int socksPipelineHandshake = 1;
+
+/* The authentication method chosen by the SOCKS5 parent last time,
+   or -1 if unknown. */
+static int socks5Method = -1;
+
+/* The SOCKS5 read area is followed by room for a greeting, an
+   RFC 1929 authentication request and a CONNECT request. */
+#define SOCKS5_READ_SIZE 16
+#define SOCKS5_WRITE_SIZE (4 + 513 + 262)
 
 static int socksParentProxySetter(ConfigVariablePtr, void*);
 static int socksProxyTypeSetter(ConfigVariablePtr, void*);
@@ -75,7 +86,6 @@ static int socksWriteHandler(int, FdEventHandlerPtr, StreamRequestPtr);
 static int socksReadHandler(int, FdEventHandlerPtr, StreamRequestPtr);
 static int socks5ReadHandler(int, FdEventHandlerPtr, StreamRequestPtr);
 static int socks5WriteHandler(int, FdEventHandlerPtr, StreamRequestPtr);
-static int socks5ReadHandler2(int, FdEventHandlerPtr, StreamRequestPtr);
 
 void
 preinitSocks()
@@ -90,6 +100,12 @@ preinitSocks()
     CONFIG_VARIABLE_SETTABLE(socksUserName, CONFIG_ATOM,
                              configAtomSetter,
                              "SOCKS4a user name");
+    CONFIG_VARIABLE(socksAuthCredentials, CONFIG_PASSWORD,
+                    "SOCKS5 authentication (username:password).");
+    CONFIG_VARIABLE_SETTABLE(socksPipelineHandshake, CONFIG_BOOLEAN,
+                             configIntSetter,
+                             "Send the whole SOCKS5 handshake at once "
+                             "when possible.");
     CONFIG_VARIABLE_SETTABLE(socksProxyType, CONFIG_ATOM_LOWER,
                              socksProxyTypeSetter,
                              "One of socks4a or socks5");
@@ -144,6 +160,7 @@ initSocks()
         releaseAtom(socksProxyAddress);
     socksProxyAddress = NULL;
     socksProxyAddressIndex = -1;
+    socks5Method = -1;
 
     if(socksProxyType != aSocks4a && socksProxyType != aSocks5) {
         do_log(L_ERROR, "Unknown socksProxyType %s\n", socksProxyType->string);
@@ -245,6 +262,100 @@ socksDnsHandler(int status, GethostbynameRequestPtr grequest)
     return 1;
 }
 
+/* Append an RFC 1929 username/password request to buf at n. */
+static int
+socks5Auth(char *buf, int n)
+{
+    char *colon;
+    int ulen, plen;
+
+    if(socksAuthCredentials == NULL)
+        return -1;
+
+    colon = memchr(socksAuthCredentials->string, ':',
+                   socksAuthCredentials->length);
+    if(colon == NULL)
+        return -1;
+    ulen = colon - socksAuthCredentials->string;
+    plen = socksAuthCredentials->length - ulen - 1;
+    if(ulen > 255 || plen > 255)
+        return -1;
+
+    buf[n++] = 1;               /* ver */
+    buf[n++] = ulen;
+    memcpy(buf + n, socksAuthCredentials->string, ulen);
+    n += ulen;
+    buf[n++] = plen;
+    memcpy(buf + n, colon + 1, plen);
+    n += plen;
+    return n;
+}
+
+static int
+socks5Connect(SocksRequestPtr request, char *buf, int n)
+{
+    buf[n++] = 5;               /* ver */
+    buf[n++] = 1;               /* cmd */
+    buf[n++] = 0;               /* rsv */
+    buf[n++] = 3;               /* atyp */
+    buf[n++] = request->name->length;
+    memcpy(buf + n, request->name->string, request->name->length);
+    n += request->name->length;
+    buf[n++] = (request->port >> 8) & 0xFF;
+    buf[n++] = request->port & 0xFF;
+    return n;
+}
+
+/* The number of bytes we expect the server to send in reply to what
+   we have just written. */
+static int
+socks5ReplyLength(SocksRequestPtr request)
+{
+    if(request->optimistic)
+        return 2 + (socks5Method == 2 ? 2 : 0) + 10;
+    return request->phase == 2 ? 10 : 2;
+}
+
+/* Send the greeting.  If we already know which method the parent will
+   choose, we offer just that one, and follow up with the
+   authentication and CONNECT requests without waiting for the
+   replies. */
+static void
+socks5Start(SocksRequestPtr request)
+{
+    char *buf = request->buf + SOCKS5_READ_SIZE;
+    int n = 0, rc;
+
+    request->phase = 0;
+    request->optimistic = socksPipelineHandshake && socks5Method >= 0;
+
+    buf[n++] = 5;               /* ver */
+    if(request->optimistic) {
+        buf[n++] = 1;           /* nmethods */
+        buf[n++] = socks5Method;
+        rc = socks5Method == 2 ? socks5Auth(buf, n) : n;
+        if(rc >= 0) {
+            n = socks5Connect(request, buf, rc);
+        } else {
+            request->optimistic = 0;
+            n = 1;
+        }
+    }
+
+    if(!request->optimistic) {
+        if(socksAuthCredentials) {
+            buf[n++] = 2;       /* nmethods */
+            buf[n++] = 0;       /* no authentication required */
+            buf[n++] = 2;       /* username/password */
+        } else {
+            buf[n++] = 1;
+            buf[n++] = 0;
+        }
+    }
+
+    do_stream(IO_WRITE, request->fd, 0, buf, n, socksWriteHandler, request);
+}
+
 static int
 socksConnectHandler(int status,
                     FdEventHandlerPtr event,
@@ -298,7 +409,7 @@ socksConnectHandler(int status,
                   8 + socksUserName->length + 1 + request->name->length + 1,
                   socksWriteHandler, request);
     } else if(socksProxyType == aSocks5) {
-        request->buf = malloc(8); /* 8 needed for the subsequent read */
+        request->buf = malloc(SOCKS5_READ_SIZE + SOCKS5_WRITE_SIZE);
         if(request->buf == NULL) {
             CLOSE(request->fd);
             request->fd = -1;
@@ -306,12 +417,7 @@ socksConnectHandler(int status,
             destroySocksRequest(request);
             return 1;
         }
-
-        request->buf[0] = 5;             /* ver */
-        request->buf[1] = 1;             /* nmethods */
-        request->buf[2] = 0;             /* no authentication required */
-        do_stream(IO_WRITE, request->fd, 0, request->buf, 3,
-                  socksWriteHandler, request);
+        socks5Start(request);
     } else {
         request->handler(-EUNKNOWN, request);
     }
@@ -336,10 +442,13 @@ socksWriteHandler(int status,
         return 0;
     }
 
-    do_stream(IO_READ | IO_NOTNOW, request->fd, 0, request->buf, 8,
-              socksProxyType == aSocks5 ?
-              socks5ReadHandler : socksReadHandler,
-              request);
+    if(socksProxyType == aSocks5)
+        do_stream(IO_READ | IO_NOTNOW, request->fd, 0,
+                  request->buf, socks5ReplyLength(request),
+                  socks5ReadHandler, request);
+    else
+        do_stream(IO_READ | IO_NOTNOW, request->fd, 0, request->buf, 8,
+                  socksReadHandler, request);
     return 1;
 
  error:
@@ -394,42 +503,104 @@ socks5ReadHandler(int status,
                   StreamRequestPtr srequest)
 {
     SocksRequestPtr request = srequest->data;
+    char *buf = request->buf;
+    int i = 0, method, n;
 
     if(status < 0)
         goto error;
 
-    if(srequest->offset < 2) {
-        if(status) {
-            status = -ESOCKS_PROTOCOL;
-            goto error;
+    /* A pipelined reply is parsed from the start every time. */
+    if(request->optimistic)
+        request->phase = 0;
+
+    while(1) {
+        switch(request->phase) {
+        case 0:
+            if(srequest->offset < i + 2)
+                goto more;
+            if(buf[i] != 5) {
+                status = -ESOCKS_PROTOCOL;
+                goto error;
+            }
+            method = (unsigned char)buf[i + 1];
+            if(request->optimistic && method != socks5Method)
+                goto fallback;
+            if(method != 0 && (method != 2 || socksAuthCredentials == NULL)) {
+                status = -ESOCKS_PROTOCOL;
+                goto error;
+            }
+            socks5Method = method;
+            i += 2;
+            request->phase = method == 2 ? 1 : 2;
+            break;
+        case 1:
+            if(srequest->offset < i + 2)
+                goto more;
+            if(buf[i] != 1 || buf[i + 1] != 0) {
+                status = -ESOCKS_AUTH_FAIL;
+                goto error;
+            }
+            i += 2;
+            request->phase = 2;
+            break;
+        case 2:
+            if(srequest->offset < i + 4)
+                goto more;
+            if(buf[i] != 5) {
+                status = -ESOCKS_PROTOCOL;
+                goto error;
+            }
+            if(buf[i + 1] != 0) {
+                status = -(ESOCKS5_BASE + buf[i + 1]);
+                goto error;
+            }
+            if(buf[i + 3] != 1) {
+                status = -ESOCKS_PROTOCOL;
+                goto error;
+            }
+            if(srequest->offset < i + 10)
+                goto more;
+            request->handler(1, request);
+            destroySocksRequest(request);
+            return 1;
+        default:
+            abort();
+        }
+
+        if(!request->optimistic) {
+            char *wbuf = request->buf + SOCKS5_READ_SIZE;
+            if(request->phase == 1)
+                n = socks5Auth(wbuf, 0);
+            else
+                n = socks5Connect(request, wbuf, 0);
+            if(n < 0) {
+                status = -ESOCKS_PROTOCOL;
+                goto error;
+            }
+            do_stream(IO_WRITE, request->fd, 0, wbuf, n,
+                      socks5WriteHandler, request);
+            return 1;
         }
-        return 0;
     }
 
-    if(request->buf[0] != 5 || request->buf[1] != 0) {
+ more:
+    if(status) {
+        /* The parent hung up on a pipelined handshake */
+        if(request->optimistic && request->phase == 0)
+            goto fallback;
         status = -ESOCKS_PROTOCOL;
         goto error;
     }
+    return 0;
 
+ fallback:
+    do_log(L_WARN, "SOCKS parent refused pipelined handshake, retrying.\n");
+    socks5Method = -1;
+    CLOSE(request->fd);
+    request->fd = -1;
     free(request->buf);
-    request->buf = malloc(5 + request->name->length + 2);
-    if(request->buf == NULL) {
-        status = -ENOMEM;
-        goto error;
-    }
-
-    request->buf[0] = 5;        /* ver */
-    request->buf[1] = 1;        /* cmd */
-    request->buf[2] = 0;        /* rsv */
-    request->buf[3] = 3;        /* atyp */
-    request->buf[4] = request->name->length;
-    memcpy(request->buf + 5, request->name->string, request->name->length);
-    request->buf[5 + request->name->length] = (request->port >> 8) & 0xFF;
-    request->buf[5 + request->name->length + 1] = request->port & 0xFF;
-
-    do_stream(IO_WRITE, request->fd, 0,
-              request->buf, 5 + request->name->length + 2,
-              socks5WriteHandler, request);
+    request->buf = NULL;
+    do_socks_connect_common(request);
     return 1;
 
  error:
@@ -458,54 +629,9 @@ socks5WriteHandler(int status,
         return 0;
     }
 
-    do_stream(IO_READ | IO_NOTNOW, request->fd, 0, request->buf, 10,
-              socks5ReadHandler2, request);
-    return 1;
-
- error:
-    request->handler(status, request);
-    destroySocksRequest(request);
-    return 1;
-}
-
-static int
-socks5ReadHandler2(int status,
-                   FdEventHandlerPtr event,
-                   StreamRequestPtr srequest)
-{
-    SocksRequestPtr request = srequest->data;
-
-    if(status < 0)
-        goto error;
-
-    if(srequest->offset < 4) {
-        if(status) {
-            status = -ESOCKS_PROTOCOL;
-            goto error;
-        }
-        return 0;
-    }
-
-    if(request->buf[0] != 5) {
-        status = -ESOCKS_PROTOCOL;
-        goto error;
-    }
-
-    if(request->buf[1] != 0) {
-        status = -(ESOCKS5_BASE + request->buf[1]);
-        goto error;
-    }
-
-    if(request->buf[3] != 1) {
-        status = -ESOCKS_PROTOCOL;
-        goto error;
-    }
-
-    if(srequest->offset < 10)
-        return 0;
-
-    request->handler(1, request);
-    destroySocksRequest(request);
+    do_stream(IO_READ | IO_NOTNOW, request->fd, 0,
+              request->buf, socks5ReplyLength(request),
+              socks5ReadHandler, request);
     return 1;
 
  error:
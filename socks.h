@@ -29,6 +29,8 @@ typedef struct _SocksRequest {
     int (*handler)(int, struct _SocksRequest*);
     char *buf;
     void *data;
+    int phase;
+    int optimistic;
 } SocksRequestRec, *SocksRequestPtr;
 
 void preinitSocks(void);
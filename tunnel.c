@@ -320,9 +320,9 @@ tunnelHandlerCommon(int fd, TunnelPtr tunnel)
 }
 
 static void
-bufRead(int fd, CircularBufferPtr buf,
-        int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-        void *data)
+bufReadNamed(int fd, CircularBufferPtr buf,
+             int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+             const char *name, void *data)
 {
     int tail;
 
@@ -332,41 +332,46 @@ bufRead(int fd, CircularBufferPtr buf,
         tail = buf->tail - 1;
 
     if(buf->head == 0)
-        do_stream_buf(IO_READ | IO_NOTNOW,
-                      fd, 0,
-                      &buf->buf, tail,
-                      handler, data);
+        do_stream_buf_named(IO_READ | IO_NOTNOW,
+                            fd, 0,
+                            &buf->buf, tail,
+                            handler, name, data);
     else if(buf->tail > buf->head)
-        do_stream(IO_READ | IO_NOTNOW,
-                  fd, buf->head,
-                  buf->buf, tail,
-                  handler, data);
+        do_stream_named(IO_READ | IO_NOTNOW,
+                        fd, buf->head,
+                        buf->buf, tail,
+                        handler, name, data);
     else 
-        do_stream_2(IO_READ | IO_NOTNOW,
-                    fd, buf->head,
-                    buf->buf, CHUNK_SIZE,
-                    buf->buf, tail,
-                    handler, data);
+        do_stream_2_named(IO_READ | IO_NOTNOW,
+                          fd, buf->head,
+                          buf->buf, CHUNK_SIZE,
+                          buf->buf, tail,
+                          handler, name, data);
 }
 
 static void
-bufWrite(int fd, CircularBufferPtr buf,
-        int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
-        void *data)
+bufWriteNamed(int fd, CircularBufferPtr buf,
+              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+              const char *name, void *data)
 {
     if(buf->head > buf->tail)
-        do_stream(IO_WRITE,
-                  fd, buf->tail,
-                  buf->buf, buf->head,
-                  handler, data);
+        do_stream_named(IO_WRITE,
+                        fd, buf->tail,
+                        buf->buf, buf->head,
+                        handler, name, data);
     else
-        do_stream_2(IO_WRITE,
-                    fd, buf->tail,
-                    buf->buf, CHUNK_SIZE,
-                    buf->buf, buf->head,
-                    handler, data);
+        do_stream_2_named(IO_WRITE,
+                          fd, buf->tail,
+                          buf->buf, CHUNK_SIZE,
+                          buf->buf, buf->head,
+                          handler, name, data);
 }
-                    
+
+#define bufRead(fd, buf, handler, data) \
+    bufReadNamed(fd, buf, handler, #handler, data)
+#define bufWrite(fd, buf, handler, data) \
+    bufWriteNamed(fd, buf, handler, #handler, data)
+
 static void
 tunnelDispatch(TunnelPtr tunnel)
 {
@@ -378,6 +378,7 @@ pstrerror(int e)
     case ESOCKS_REJECT_UID_MISMATCH: s = "SOCKS request rejected: "
                                          "uid mismatch";
         break;
+    case ESOCKS_AUTH_FAIL: s = "SOCKS authentication failed"; break;
     case ESOCKS5_BASE: s = "SOCKS success"; break;
     case ESOCKS5_BASE + 1: s = "General SOCKS server failure"; break;
     case ESOCKS5_BASE + 2: s = "SOCKS connection not allowed"; break;
@@ -790,6 +791,58 @@ intListCons(int from, int to, IntListPtr list)
     return insertRange(from, to, list, i);
 }
 
+/* Histogram buckets are log-linear: values below HISTOGRAM_SUB have a
+   bucket each, and every further power of two is split into
+   HISTOGRAM_SUB buckets, which gives a relative error below 1/8. */
+int
+histogramBucket(int value)
+{
+    int e, i;
+
+    if(value < HISTOGRAM_SUB)
+        return MAX(value, 0);
+    e = log2_floor(value) - HISTOGRAM_SUB_BITS;
+    i = (e + 1) * HISTOGRAM_SUB + (value >> e) - HISTOGRAM_SUB;
+    return MIN(i, HISTOGRAM_BUCKETS - 1);
+}
+
+/* The smallest value that goes above bucket i. */
+int
+histogramBucketLimit(int i)
+{
+    int e;
+
+    if(i < HISTOGRAM_SUB)
+        return i + 1;
+    e = i / HISTOGRAM_SUB - 1;
+    return (HISTOGRAM_SUB + i % HISTOGRAM_SUB + 1) << e;
+}
+
+/* An upper bound on the given percentile, -1 if empty. */
+int
+histogramPercentile(HistogramPtr histogram, int percent)
+{
+    int i, n = 0, target;
+
+    if(histogram->count <= 0)
+        return -1;
+    target = MAX(((long long)histogram->count * percent + 99) / 100, 1);
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        n += histogram->buckets[i];
+        if(n >= target)
+            break;
+    }
+    return histogramBucketLimit(MIN(i, HISTOGRAM_BUCKETS - 1));
+}
+
+void
+histogramRecord(HistogramPtr histogram, int value)
+{
+    histogram->buckets[histogramBucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
 /* Return the amount of physical memory on the box, -1 if unknown or
    over two gigs. */
 #if defined(__linux__)
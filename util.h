@@ -49,6 +49,7 @@ THE SOFTWARE.
 #define ESOCKS_REJECT_FAIL (E2 + 1)
 #define ESOCKS_REJECT_IDENTD (E2 + 2)
 #define ESOCKS_REJECT_UID_MISMATCH (E2 + 3)
+#define ESOCKS_AUTH_FAIL (E2 + 4)
 /* (ESOCKS5_BASE + n) corresponds to SOCKS5 status code n (0 to 8) */
 #define ESOCKS5_BASE (E3)
 
@@ -63,6 +64,18 @@ typedef struct _IntList {
     IntRangePtr ranges;
 } IntListRec, *IntListPtr;
 
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_GROUPS 26
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB * HISTOGRAM_GROUPS)
+
+/* Durations, in microseconds. */
+typedef struct _Histogram {
+    int count;
+    long long sum;
+    int buckets[HISTOGRAM_BUCKETS];
+} HistogramRec, *HistogramPtr;
+
 char *strdup_n(const char *restrict buf, int n) ATTRIBUTE ((malloc));
 int snnprintf(char *restrict buf, int n, int len, const char *format, ...)
      ATTRIBUTE ((format (printf, 4, 5)));
@@ -105,4 +118,8 @@ IntListPtr makeIntList(int size) ATTRIBUTE ((malloc));
 void destroyIntList(IntListPtr list);
 int intListMember(int n, IntListPtr list) ATTRIBUTE ((pure));
 int intListCons(int from, int to, IntListPtr list);
+int histogramBucket(int value) ATTRIBUTE ((const));
+int histogramBucketLimit(int i) ATTRIBUTE ((const));
+int histogramPercentile(HistogramPtr histogram, int percent);
+void histogramRecord(HistogramPtr histogram, int value);
 int physicalMemory(void);